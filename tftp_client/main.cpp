@@ -1,4 +1,9 @@
 #include "tftp_client.h"
+#include "tftp_bench.h"
+#include "tftp_latency.h"
+#include "tftp_sync.h"
+#include "tftp_server.h"
+#include "tftp_storm.h"
 
 using namespace tftp;
 
@@ -12,11 +17,60 @@ bool starts_with(string s, string subs)
 	return true;
 }
 
+string To_rate_string(U64 bytes_per_second)
+{
+	if (bytes_per_second == 0) return "unlimited";
+	return std::to_string(bytes_per_second / 1024) + " KiB/s";
+}
+
+bool sync(const Tftp_client& client, I32 sessions, const vector<string>& tokens)
+{
+	Tftp_sync sync(client.get_servers(), sessions);
+	if (!sync.start(client))
+	{
+		Err("Could not start sync sessions");
+		return false;
+	}
+
+	Sync_stats stats;
+	bool good = tokens[1] == "put" ?
+		sync.put_directory(tokens[2], tokens.size() > 3 ? tokens[3] : "", stats) :
+		sync.get_list(tokens[2], tokens[3], stats);
+	sync.stop();
+	Log("Sync finished: " + To_string(stats));
+	return good;
+}
+
+bool stripe(const Tftp_client& client, I32 sessions, const vector<string>& tokens)
+{
+	Tftp_sync sync(client.get_servers(), sessions);
+	if (!sync.start(client))
+	{
+		Err("Could not start stripe sessions");
+		return false;
+	}
+
+	Sync_stats stats;
+	bool good = sync.get_striped(tokens[1], tokens[2], stats);
+	sync.stop();
+	Log("Striped get finished: " + To_string(stats));
+	return good;
+}
+
+bool replay(const string& capture_file, const string& local_file)
+{
+	Replay_stats stats;
+	bool good = Tftp_client::Replay(capture_file, local_file, stats);
+	if (good) Log("Replay " + To_string(stats));
+	return good;
+}
+
 void command_thread(Tftp_client& client)
 {
-	Tftp_command command;
+	I32 sessions = Tftp_sync_sessions_default;
 	while (client.is_running())
 	{
+		Tftp_command command;
 		string line;
 		std::getline(std::cin, line);
 
@@ -52,6 +106,230 @@ void command_thread(Tftp_client& client)
 				continue;
 			}
 		}
+		else if (count == 1 &&
+			tokens[0] == "window")
+		{
+			Log("Using window of " + std::to_string(client.get_window_size()) + " blocks");
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "window")
+		{
+			if (client.set_window_size(std::atoi(tokens[1].c_str())))
+			{
+				Log("Using window of " + std::to_string(client.get_window_size()) + " blocks");
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "blksize")
+		{
+			Log("Using blocks of " + std::to_string(client.get_block_size()) + " bytes");
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "blksize")
+		{
+			if (client.set_block_size(std::atoi(tokens[1].c_str())))
+			{
+				Log("Using blocks of " + std::to_string(client.get_block_size()) + " bytes");
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "tune")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				client.set_tuning(tokens[1] == "on");
+				Log(string("Window and blksize tuning ") + (client.is_tuning() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "offload")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				client.set_offload(tokens[1] == "on");
+				Log(string("Segmentation offload ") + (client.is_offload() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "compress")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				client.set_compress(tokens[1] == "on");
+				Log(string("Compression ") + (client.is_compress() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "resume")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				client.set_resume(tokens[1] == "on");
+				Log(string("Resuming interrupted gets ") + (client.is_resume() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "busypoll")
+		{
+			Log("Busy polling " + (client.get_busy_poll() > 0 ?
+				"for " + std::to_string(client.get_busy_poll()) + " us" : string("off")));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "busypoll")
+		{
+			if (client.set_busy_poll(tokens[1] == "off" ? 0 : std::strtoull(tokens[1].c_str(), nullptr, 10)))
+			{
+				Log("Busy polling " + (client.get_busy_poll() > 0 ?
+					"for " + std::to_string(client.get_busy_poll()) + " us" : string("off")));
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "rate")
+		{
+			Log("Rate per transfer " + To_rate_string(client.get_rate()) +
+				", total " + To_rate_string(client.get_total_rate()));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "rate")
+		{
+			client.set_rate(std::strtoull(tokens[1].c_str(), nullptr, 10) * 1024);
+			Log("Rate per transfer " + To_rate_string(client.get_rate()));
+			continue;
+		}
+		else if (count == 3 &&
+			tokens[0] == "rate" &&
+			tokens[1] == "total")
+		{
+			client.set_total_rate(std::strtoull(tokens[2].c_str(), nullptr, 10) * 1024);
+			Log("Rate total " + To_rate_string(client.get_total_rate()));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "verbose")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				client.set_verbose(tokens[1] == "on");
+				Log(string("Package logging ") + (client.is_verbose() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "sessions")
+		{
+			Log("Syncing over " + std::to_string(sessions) + " sessions");
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "sessions")
+		{
+			I32 value = std::atoi(tokens[1].c_str());
+			if (value >= 1 && value <= Tftp_sync_sessions_max)
+			{
+				sessions = value;
+				Log("Syncing over " + std::to_string(sessions) + " sessions");
+				continue;
+			}
+		}
+		else if ((count == 3 || count == 4) &&
+			tokens[0] == "sync" &&
+			tokens[1] == "put")
+		{
+			sync(client, sessions, tokens);
+			continue;
+		}
+		else if (count == 4 &&
+			tokens[0] == "sync" &&
+			tokens[1] == "get")
+		{
+			sync(client, sessions, tokens);
+			continue;
+		}
+		else if (count == 3 &&
+			tokens[0] == "stripe")
+		{
+			stripe(client, sessions, tokens);
+			continue;
+		}
+		else if (count == 1 &&
+			(tokens[0] == "servers" || tokens[0] == "probe"))
+		{
+			if (tokens[0] == "probe") client.probe_servers();
+			for (auto& status : client.get_servers().statuses())
+			{
+				Log("Server " + To_string(status) +
+					(status.address == client.get_server_address() ? " (current)" : ""));
+			}
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "trace")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				Tracer::Instance().set_enabled(tokens[1] == "on");
+				Log(string("Event tracing ") + (Tracer::Instance().is_enabled() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 3 &&
+			tokens[0] == "trace" &&
+			tokens[1] == "dump")
+		{
+			if (Tracer::Instance().dump(tokens[2])) Log("Trace written to " + tokens[2] + ", tracing off");
+			else Err("Failed to write trace to " + tokens[2]);
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "capture")
+		{
+			if (tokens[1] == "off")
+			{
+				client.stop_capture();
+				Log("Capture off");
+			}
+			else if (client.start_capture(tokens[1])) Log("Capturing to " + tokens[1]);
+			else Err("Could not write capture " + tokens[1]);
+			continue;
+		}
+		else if (count == 1 &&
+			tokens[0] == "cache")
+		{
+			if (client.is_caching()) Log("Cache " + To_string(client.get_cache_stats()));
+			else Log("Cache off");
+			continue;
+		}
+		else if ((count == 2 || count == 3) &&
+			tokens[0] == "cache")
+		{
+			if (tokens[1] == "off")
+			{
+				client.close_cache();
+				Log("Cache off");
+				continue;
+			}
+			U64 capacity = count == 3 ? std::strtoull(tokens[2].c_str(), nullptr, 10) << 20 : Tftp_cache_capacity_default;
+			if (client.open_cache(tokens[1], capacity)) Log("Caching in " + tokens[1] + ", " + To_string(client.get_cache_stats()));
+			else Err("Could not open cache " + tokens[1]);
+			continue;
+		}
+		else if ((count == 2 || count == 3) &&
+			tokens[0] == "replay")
+		{
+			replay(tokens[1], count == 3 ? tokens[2] : "");
+			continue;
+		}
 		else if (count == 2 &&
 			tokens[0] == "get")
 		{
@@ -71,6 +349,17 @@ void command_thread(Tftp_client& client)
 			client.order(command);
 			continue;
 		}
+		else if (count == 4 &&
+			tokens[0] == "get" &&
+			Parse_checksum(tokens[3], command.expected_checksum))
+		{
+			command.type = Tftp_command::Type::Get_file;
+			command.file_name = tokens[1];
+			command.destination_name = tokens[2];
+			command.verify = true;
+			client.order(command);
+			continue;
+		}
 		else if (count == 2 &&
 			tokens[0] == "put")
 		{
@@ -90,36 +379,279 @@ void command_thread(Tftp_client& client)
 			client.order(command);
 			continue;
 		}
+		else if (count == 4 &&
+			tokens[0] == "put" &&
+			Parse_checksum(tokens[3], command.expected_checksum))
+		{
+			command.type = Tftp_command::Type::Send_file;
+			command.file_name = tokens[1];
+			command.destination_name = tokens[2];
+			command.verify = true;
+			client.order(command);
+			continue;
+		}
+
+		std::cout << "Commands: \nquit\nget <filename> <destination> [crc32c]\nput <filename> <destination> [crc32c]\nmode\nmode [octet, netascii]\nwindow\nwindow <blocks>\nblksize\nblksize <bytes>\ntune [on, off]\nrate\nrate <KiB/s>\nrate total <KiB/s>\nbusypoll\nbusypoll [off, <us>]\noffload [on, off]\ncompress [on, off]\nresume [on, off]\nverbose [on, off]\ntrace [on, off]\ntrace dump <file>\ncapture <file>\ncapture off\nreplay <capture> [local file]\ncache\ncache <directory> [MiB]\ncache off\nsync put <directory> [remote directory]\nsync get <remote file list> <directory>\nstripe <filename> <destination>\nsessions\nsessions <count>\nservers\nprobe\n" << std::endl;
+	}
+}
+
+void server_command_thread(Tftp_server& server)
+{
+	while (server.is_running())
+	{
+		string line;
+		if (!std::getline(std::cin, line))
+		{
+			// No console, serve until killed
+			return;
+		}
+
+		vector<string> tokens = Split(line, ' ');
+		auto count = tokens.size();
+
+		if (count == 1 &&
+			tokens[0] == "quit")
+		{
+			server.stop();
+			break;
+		}
+		else if (count == 1 &&
+			tokens[0] == "stats")
+		{
+			Log("Server stats: " + To_string(server.get_stats()));
+			continue;
+		}
+		else if (count == 1 &&
+			tokens[0] == "index")
+		{
+			Log("File index: " + To_string(server.get_index_stats()));
+			continue;
+		}
+		else if (count == 1 &&
+			tokens[0] == "durability")
+		{
+			Log("Upload durability: " + To_string(server.get_durability()));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "durability")
+		{
+			bool known = true;
+			if (tokens[1] == "none") server.set_durability(Tftp_durability::None);
+			else if (tokens[1] == "batched") server.set_durability(Tftp_durability::Batched);
+			else if (tokens[1] == "immediate") server.set_durability(Tftp_durability::Immediate);
+			else known = false;
+			if (known)
+			{
+				Log("Upload durability: " + To_string(server.get_durability()));
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "admission")
+		{
+			Log("Serving " + std::to_string(server.get_active_max()) + " sessions at once, " +
+				std::to_string(server.get_waiting_max()) + " requests waiting");
+			continue;
+		}
+		else if (count == 3 &&
+			tokens[0] == "admission")
+		{
+			if (server.set_admission(std::strtoul(tokens[1].c_str(), nullptr, 10), std::strtoul(tokens[2].c_str(), nullptr, 10)))
+			{
+				Log("Serving " + std::to_string(server.get_active_max()) + " sessions at once, " +
+					std::to_string(server.get_waiting_max()) + " requests waiting");
+				continue;
+			}
+		}
+		else if (count == 1 &&
+			tokens[0] == "bandwidth")
+		{
+			Log("Server bandwidth " + To_rate_string(server.get_bandwidth()));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "bandwidth")
+		{
+			server.set_bandwidth(std::strtoull(tokens[1].c_str(), nullptr, 10) * 1024);
+			Log("Server bandwidth " + To_rate_string(server.get_bandwidth()));
+			continue;
+		}
+		else if (count == 2 &&
+			tokens[0] == "offload")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				server.set_offload(tokens[1] == "on");
+				Log(string("Segmentation offload ") + (server.is_offload() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "verbose")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				server.set_verbose(tokens[1] == "on");
+				Log(string("Package logging ") + (server.is_verbose() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 2 &&
+			tokens[0] == "trace")
+		{
+			if (tokens[1] == "on" || tokens[1] == "off")
+			{
+				Tracer::Instance().set_enabled(tokens[1] == "on");
+				Log(string("Event tracing ") + (Tracer::Instance().is_enabled() ? "on" : "off"));
+				continue;
+			}
+		}
+		else if (count == 3 &&
+			tokens[0] == "trace" &&
+			tokens[1] == "dump")
+		{
+			if (Tracer::Instance().dump(tokens[2])) Log("Trace written to " + tokens[2] + ", tracing off");
+			else Err("Failed to write trace to " + tokens[2]);
+			continue;
+		}
+
+		std::cout << "Commands: \nquit\nstats\nindex\ndurability\ndurability [none, batched, immediate]\nadmission\nadmission <sessions> <waiting>\nbandwidth\nbandwidth <KiB/s>\noffload [on, off]\nverbose [on, off]\ntrace [on, off]\ntrace dump <file>\n" << std::endl;
+	}
+}
+
+/*
+ *	--serve <root directory> [port]
+ *	Files below the root must be replaced by rename, not rewritten in
+ *	place, while they may be served
+ */
+int serve(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		Err("Usage: --serve <root directory> [port]");
+		Err("Replace served files by rename, a file rewritten in place reaches clients mixed or cut short");
+		return 1;
+	}
+	U16 port = argc > 3 ? static_cast<U16>(std::atoi(argv[3])) : Tftp_server_port;
+
+	Tftp_server server;
+	if (!server.start(argv[2], port))
+	{
+		return 1;
+	}
+
+	Thread t1([&server]() { server.run(); });
+	Thread t2([&server]() { server_command_thread(server); });
+	t2.detach();
+
+	t1.join();
+	return 0;
+}
+
+/*
+ *	--storm <server> <clients> <file>[,<file>...] [ramp ms] [think ms] [loss %] [blksize] [window]
+ *	Files prefixed with ? may be missing
+ */
+int storm(int argc, char* argv[])
+{
+	if (argc < 5)
+	{
+		Err("Usage: --storm <server> <clients> <file>[,<file>...] [ramp ms] [think ms] [loss %] [blksize] [window]");
+		return 1;
+	}
 
-		std::cout << "Commands: \nquit\nget <filename> <destination>\nput <filename> <destination>\nmode\nmode [octet, netascii]\n" << std::endl;
+	Storm_settings settings;
+	if (!Resolve(argv[2], Tftp_server_port, settings.server))
+	{
+		Err("Could not resolve " + string(argv[2]));
+		return 1;
 	}
+	settings.clients = std::strtoul(argv[3], nullptr, 10);
+	settings.files = Split(argv[4], ',');
+	if (argc > 5) settings.ramp_ms = std::strtoull(argv[5], nullptr, 10);
+	if (argc > 6) settings.think_ms = std::strtoull(argv[6], nullptr, 10);
+	if (argc > 7) settings.loss = std::atof(argv[7]) / 100.0;
+	if (argc > 8) settings.block_size = std::atoi(argv[8]);
+	if (argc > 9) settings.window = std::atoi(argv[9]);
+	if (settings.clients == 0 || settings.block_size < Tftp_blksize_min || settings.block_size > Tftp_packet_blksize_max)
+	{
+		Err("Need at least one client and a blksize from " + std::to_string(Tftp_blksize_min) + " to " +
+			std::to_string(Tftp_packet_blksize_max));
+		return 1;
+	}
+
+	Log("Booting " + std::to_string(settings.clients) + " clients from " + To_string(settings.server));
+	Tftp_storm generator(settings);
+	Storm_report report;
+	if (!generator.run(report)) return 1;
+	Log("Storm finished: " + To_string(report));
+	return report.failed == 0 ? 0 : 1;
 }
 
 int main(int argc, char* argv[])
 {
-	Address server;
-	if (argc < 2)
+	if (argc >= 3 && string(argv[1]) == "--bench" && string(argv[2]) == "latency")
+	{
+		Run_latency_benchmark();
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench")
+	{
+		Run_benchmarks();
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--serve")
+	{
+		return serve(argc, argv);
+	}
+	if (argc >= 2 && string(argv[1]) == "--storm")
+	{
+		return storm(argc, argv);
+	}
+	if (argc >= 3 && string(argv[1]) == "--replay")
+	{
+		return replay(argv[2], argc > 3 ? argv[3] : "") ? 0 : 1;
+	}
+
+	vector<string> server_ips(argv + 1, argv + argc);
+	if (server_ips.empty())
 	{
 		std::cout << "No address specified\n";
-		server.ip = "192.168.0.100";
+		server_ips.push_back("192.168.0.100");
+	}
+
+	vector<Address> addresses;
+	for (auto& server_ip : server_ips)
+	{
+		Address server;
+		if (!Resolve(server_ip, U16{ 69 }, server))
+		{
+			Err("Could not resolve " + server_ip);
+			return 1;
+		}
+		addresses.push_back(server);
 	}
-	else
+
+	// With mirrors to choose from, start on the fastest one answering
+	Server_list servers(addresses);
+	if (addresses.size() > 1)
 	{
-		server.ip = argv[1];
+		servers.probe();
+		for (auto& status : servers.statuses()) Log("Server " + To_string(status));
 	}
 
 	Tftp_client client;
-	server.port = U16{ 69 };
+	client.set_servers(servers);
 
-	if (!client.connect_to_server(server))
+	if (!client.connect_to_server(servers.ranking(AF_UNSPEC).front()))
 	{
 		return 1;
 	}
 
 	/*
 	Package pack;
-	pack.address.ip = "192.168.0.100";
-	pack.address.port = 69;
+	Resolve("192.168.0.100", 69, pack.address);
 	client.send_package(pack)
 	*/
 
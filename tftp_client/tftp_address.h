@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+
+#include <string.h>
+#include <netdb.h>
+
+namespace tftp
+{
+
+/*
+ *	Socket address kept in binary form (IPv4 or IPv6) so the packet
+ *	path never formats or parses text, To_string is for logging only
+ */
+struct Address
+{
+	sockaddr_storage storage{};
+	socklen_t length{ 0 };
+
+	I32 family() const { return storage.ss_family; }
+
+	const sockaddr* data() const { return reinterpret_cast<const sockaddr*>(&storage); }
+	sockaddr* data() { return reinterpret_cast<sockaddr*>(&storage); }
+
+	U16 port() const
+	{
+		if (family() == AF_INET6) return ntohs(reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_port);
+		if (family() == AF_INET) return ntohs(reinterpret_cast<const sockaddr_in*>(&storage)->sin_port);
+		return 0;
+	}
+
+	void set_port(U16 port)
+	{
+		if (family() == AF_INET6) reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = htons(port);
+		else if (family() == AF_INET) reinterpret_cast<sockaddr_in*>(&storage)->sin_port = htons(port);
+	}
+};
+
+inline bool operator==(const Address& address, const Address& other)
+{
+	if (address.family() != other.family()) return false;
+	if (address.family() == AF_INET)
+	{
+		auto a = reinterpret_cast<const sockaddr_in*>(&address.storage);
+		auto b = reinterpret_cast<const sockaddr_in*>(&other.storage);
+		return a->sin_port == b->sin_port &&
+			a->sin_addr.s_addr == b->sin_addr.s_addr;
+	}
+	if (address.family() == AF_INET6)
+	{
+		auto a = reinterpret_cast<const sockaddr_in6*>(&address.storage);
+		auto b = reinterpret_cast<const sockaddr_in6*>(&other.storage);
+		return a->sin6_port == b->sin6_port &&
+			memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+	}
+	return address.length == other.length &&
+		memcmp(&address.storage, &other.storage, address.length) == 0;
+}
+
+inline bool operator!=(const Address& address, const Address& other)
+{
+	return !operator==(address, other);
+}
+
+/*
+ *	Resolves a numeric IPv4 / IPv6 address or a host name, done once
+ *	per server rather than per package
+ */
+inline bool Resolve(const string& host, U16 port, Address& out)
+{
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result) return false;
+
+	memcpy(&out.storage, result->ai_addr, result->ai_addrlen);
+	out.length = static_cast<socklen_t>(result->ai_addrlen);
+	out.set_port(port);
+	freeaddrinfo(result);
+	return true;
+}
+
+inline string To_string(const Address& address)
+{
+	char ip[INET6_ADDRSTRLEN] = { 0 };
+	if (address.family() == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&address.storage)->sin6_addr, ip, sizeof(ip));
+		return "[" + string(ip) + "]:" + std::to_string(address.port());
+	}
+	if (address.family() == AF_INET)
+	{
+		inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&address.storage)->sin_addr, ip, sizeof(ip));
+		return string(ip) + ":" + std::to_string(address.port());
+	}
+	return "<no address>";
+}
+
+}
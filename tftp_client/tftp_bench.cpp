@@ -0,0 +1,49 @@
+#include "tftp_bench.h"
+
+#include <new>
+#include <stdlib.h>
+
+#ifdef TFTP_BENCH_ALLOCATIONS
+
+namespace
+{
+
+thread_local U64 allocations{ 0 };
+
+}
+
+U64 tftp::Bench_allocations()
+{
+	return allocations;
+}
+
+/*
+ *	Counting replacements of the global allocation functions, the array
+ *	and nothrow forms forward to these. Only in bench builds, the client
+ *	itself keeps the library allocator.
+ */
+void* operator new(size_t size)
+{
+	++allocations;
+	if (void* memory = malloc(size == 0 ? 1 : size)) return memory;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+#else
+
+U64 tftp::Bench_allocations()
+{
+	return 0;
+}
+
+#endif
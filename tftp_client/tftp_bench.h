@@ -0,0 +1,281 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_timer.h"
+#include "tftp_checksum.h"
+
+#include <chrono>
+#include <iomanip>
+#include <functional>
+#include <queue>
+#include <random>
+
+namespace tftp
+{
+
+/*
+ *	Heap allocations made by the calling thread so far, counted by the
+ *	global operator new replacement in tftp_bench.cpp. That is only
+ *	built with TFTP_BENCH_ALLOCATIONS defined, otherwise nothing is
+ *	counted.
+ */
+#ifdef TFTP_BENCH_ALLOCATIONS
+constexpr bool Bench_counts_allocations = true;
+#else
+constexpr bool Bench_counts_allocations = false;
+#endif
+U64 Bench_allocations();
+
+struct Bench_result
+{
+	string name;
+	U64 operations{ 0 };
+	double ns_per_operation{ 0.0 };
+	double allocations_per_operation{ 0.0 };
+};
+
+inline string To_string(const Bench_result& result)
+{
+	std::ostringstream out;
+	out.precision(1);
+	out << std::fixed << result.name << ": " << result.ns_per_operation << " ns/op ("
+		<< result.operations << " ops";
+	if (Bench_counts_allocations) out << ", " << std::setprecision(2) << result.allocations_per_operation << " allocs/op";
+	out << ")";
+	return out.str();
+}
+
+/*
+ *	Runs body once, body returns the number of operations it performed
+ */
+inline Bench_result Bench(const string& name, const std::function<U64()>& body)
+{
+	U64 allocations = Bench_allocations();
+	auto start = std::chrono::steady_clock::now();
+	U64 operations = body();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	allocations = Bench_allocations() - allocations;
+
+	Bench_result result;
+	result.name = name;
+	result.operations = operations;
+	result.ns_per_operation = operations == 0 ? 0.0 :
+		static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / operations;
+	result.allocations_per_operation = operations == 0 ? 0.0 :
+		static_cast<double>(allocations) / operations;
+	return result;
+}
+
+/*
+ *	Retransmission timer workload: sessions each keep one armed timer, every
+ *	step one session receives a package (timer rearmed) and the clock moves,
+ *	expired sessions are rearmed as a retransmit would
+ */
+constexpr I32 Bench_timer_sessions = 10000;
+constexpr I32 Bench_timer_steps = 1000000;
+
+inline U64 Bench_timer_wheel()
+{
+	std::mt19937 random(42);
+	Time now = 0;
+	Timer_wheel wheel(1, now);
+	vector<Timer_wheel::Timer_id> timers(Bench_timer_sessions);
+	for (I32 i = 0; i < Bench_timer_sessions; ++i)
+	{
+		timers[i] = wheel.schedule(now + 1 + random() % 1000, i);
+	}
+
+	U64 fired{ 0 };
+	for (I32 step = 0; step < Bench_timer_steps; ++step)
+	{
+		I32 session = random() % Bench_timer_sessions;
+		wheel.cancel(timers[session]);
+		timers[session] = wheel.schedule(now + 1000, session);
+
+		if (step % 100 == 0)
+		{
+			++now;
+			wheel.advance(now, [&](U64 expired)
+			{
+				timers[expired] = wheel.schedule(now + 1000, expired);
+				++fired;
+			});
+		}
+	}
+	return Bench_timer_steps + fired;
+}
+
+inline U64 Bench_timer_heap()
+{
+	struct Entry
+	{
+		Time deadline;
+		I32 session;
+		U32 generation;
+		bool operator>(const Entry& other) const { return deadline > other.deadline; }
+	};
+
+	std::mt19937 random(42);
+	Time now = 0;
+	std::priority_queue<Entry, vector<Entry>, std::greater<Entry>> heap;
+	vector<U32> generations(Bench_timer_sessions, 0);
+	for (I32 i = 0; i < Bench_timer_sessions; ++i)
+	{
+		heap.push({ now + 1 + random() % 1000, i, 0 });
+	}
+
+	U64 fired{ 0 };
+	for (I32 step = 0; step < Bench_timer_steps; ++step)
+	{
+		// A heap cannot cancel, stale entries are skipped by generation on pop
+		I32 session = random() % Bench_timer_sessions;
+		heap.push({ now + 1000, session, ++generations[session] });
+
+		if (step % 100 == 0)
+		{
+			++now;
+			while (!heap.empty() && heap.top().deadline <= now)
+			{
+				Entry entry = heap.top();
+				heap.pop();
+				if (entry.generation != generations[entry.session]) continue;
+				heap.push({ now + 1000, entry.session, ++generations[entry.session] });
+				++fired;
+			}
+		}
+	}
+	return Bench_timer_steps + fired;
+}
+
+/*
+ *	Checksum of a transfer sized buffer in 512 byte blocks, one
+ *	operation per byte
+ */
+constexpr size_t Bench_checksum_bytes = 64 * 1024 * 1024;
+
+inline U64 Bench_checksum(const vector<Byte>& data, bool hardware)
+{
+	U32 crc = 0xffffffff;
+	for (size_t off = 0; off < data.size(); off += Tftp_packet_data_size)
+	{
+		crc = hardware ?
+			Crc32c::Update_hardware(crc, &data[off], Tftp_packet_data_size) :
+			Crc32c::Update_software(crc, &data[off], Tftp_packet_data_size);
+	}
+	volatile U32 sink = crc;
+	(void)sink;
+	return data.size();
+}
+
+/*
+ *	Codec workloads, one operation per packet built or parsed. The sink
+ *	keeps the compiler from dropping packets it can see are unused.
+ */
+constexpr I32 Bench_codec_packets = 200000;
+
+inline U64 Bench_sink(U64 value)
+{
+	static volatile U64 sink;
+	sink = sink + value;
+	return value;
+}
+
+inline U64 Bench_codec(const std::function<U64(I32)>& step)
+{
+	U64 total{ 0 };
+	for (I32 i = 0; i < Bench_codec_packets; ++i) total += step(i);
+	Bench_sink(total);
+	return Bench_codec_packets;
+}
+
+inline void Run_codec_benchmarks()
+{
+	const Tftp_options options = { { Tftp_option_windowsize, "16" } };
+	vector<Byte> block(Tftp_packet_data_size, 0x5a);
+
+	Log(To_string(Bench("Create_read", [&]()
+	{
+		return Bench_codec([&](I32) { return Create_read("pxelinux.0", Tftp_mode::Octet).size(); });
+	})));
+	Log(To_string(Bench("Create_read with options", [&]()
+	{
+		return Bench_codec([&](I32) { return Create_read("pxelinux.0", Tftp_mode::Octet, options).size(); });
+	})));
+	Log(To_string(Bench("Create_write", [&]()
+	{
+		return Bench_codec([&](I32) { return Create_write("pxelinux.0", Tftp_mode::Octet).size(); });
+	})));
+	for (I32 size : { 0, 64, 256, Tftp_packet_data_size })
+	{
+		Log(To_string(Bench("Create_data " + std::to_string(size) + " bytes", [&]()
+		{
+			return Bench_codec([&](I32 i) { return Create_data(static_cast<Word>(i), block.data(), size).size(); });
+		})));
+	}
+	Log(To_string(Bench("Create_ack", [&]()
+	{
+		return Bench_codec([&](I32 i) { return Create_ack(static_cast<Word>(i)).size(); });
+	})));
+	Log(To_string(Bench("Create_error", [&]()
+	{
+		return Bench_codec([&](I32) { return Create_error(To_word(Tftp_error::Error_1), "File not found").size(); });
+	})));
+	Log(To_string(Bench("Create_oack", [&]()
+	{
+		return Bench_codec([&](I32) { return Create_oack(options).size(); });
+	})));
+
+	Tftp_packet read = Create_read("pxelinux.0", Tftp_mode::Octet, options);
+	Tftp_packet data = Create_data(1, block.data(), Tftp_packet_data_size);
+	Tftp_packet ack = Create_ack(1);
+	Tftp_packet error = Create_error(To_word(Tftp_error::Error_1), "File not found");
+	Tftp_packet oack = Create_oack(options);
+
+	Log(To_string(Bench("get_op + get_word", [&]()
+	{
+		return Bench_codec([&](I32) { return To_word(data.get_op()) + data.get_word(2); });
+	})));
+	Log(To_string(Bench("get_string file name", [&]()
+	{
+		return Bench_codec([&](I32) { return read.get_string(2, 10).size(); });
+	})));
+	Log(To_string(Bench("Get_options request", [&]()
+	{
+		Tftp_options parsed;
+		return Bench_codec([&](I32) { Get_options(read, 2 + 11 + 6, parsed); return parsed.size(); });
+	})));
+	Log(To_string(Bench("Get_options oack", [&]()
+	{
+		Tftp_options parsed;
+		return Bench_codec([&](I32) { Get_options(oack, 2, parsed); return parsed.size(); });
+	})));
+	const std::pair<const char*, const Tftp_packet*> printed[] =
+	{
+		{ "RRQ", &read }, { "DATA", &data }, { "ACK", &ack }, { "ERROR", &error }, { "OACK", &oack },
+	};
+	for (auto& entry : printed)
+	{
+		Log(To_string(Bench(string("To_string ") + entry.first, [&]()
+		{
+			return Bench_codec([&](I32) { return To_string(*entry.second).size(); });
+		})));
+	}
+}
+
+inline void Run_benchmarks()
+{
+	Run_codec_benchmarks();
+
+	Log(To_string(Bench("timer_wheel rearm/expire", Bench_timer_wheel)));
+	Log(To_string(Bench("priority_queue rearm/expire", Bench_timer_heap)));
+
+	vector<Byte> data(Bench_checksum_bytes);
+	for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<Byte>(i * 31 + 7);
+	if (Crc32c::Hardware())
+	{
+		Log(To_string(Bench("crc32c hardware per byte", [&]() { return Bench_checksum(data, true); })));
+	}
+	Log(To_string(Bench("crc32c software per byte", [&]() { return Bench_checksum(data, false); })));
+}
+
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_checksum.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+namespace tftp
+{
+
+constexpr U64 Tftp_cache_capacity_default = 256ull << 20;
+/*
+ *	Entries up to this size are also kept in memory, boot scripts and
+ *	configs are served without touching the disk
+ */
+constexpr U64 Tftp_cache_memory_entry_max = 64 * 1024;
+const string Tftp_cache_meta_suffix = ".meta";
+
+struct Cache_stats
+{
+	U64 hits{ 0 };
+	U64 misses{ 0 };
+	U64 stores{ 0 };
+	U64 evictions{ 0 };
+	U64 entries{ 0 };
+	U64 bytes{ 0 };
+	U64 capacity{ 0 };
+};
+
+inline string To_string(const Cache_stats& stats)
+{
+	return "hits " + std::to_string(stats.hits) +
+		", misses " + std::to_string(stats.misses) +
+		", stores " + std::to_string(stats.stores) +
+		", evictions " + std::to_string(stats.evictions) +
+		", entries " + std::to_string(stats.entries) +
+		", " + std::to_string(stats.bytes / 1024) + " of " + std::to_string(stats.capacity / 1024) + " KiB";
+}
+
+/*
+ *	What a cached file is validated against: the size (tsize) and the
+ *	crc32c the server reports, and the checksum the get comes with
+ */
+struct Cache_entry
+{
+	string key;
+	U64 size{ 0 };
+	U32 checksum{ 0 };
+	U64 last_used{ 0 };
+	vector<Byte> contents;
+};
+
+/*
+ *	Files got before, keyed by server, mode and remote path. Every
+ *	entry is a data file and a .meta file (key, size, crc32c) in the
+ *	cache directory, so the cache outlives the client. The least
+ *	recently used entries are evicted once the data exceeds the
+ *	capacity. Used by the execute thread and read by the command
+ *	thread, so every access locks.
+ */
+class Content_cache
+{
+public:
+	Content_cache() = default;
+	Content_cache(const Content_cache& other) = delete;
+
+	/*
+	 *	Takes over the entries a previous run left in the directory
+	 */
+	bool open(const string& cache_directory, U64 capacity_bytes)
+	{
+		Guard gate_out(mutex);
+
+		entries.clear();
+		directory = cache_directory;
+		capacity = capacity_bytes;
+		bytes = 0;
+		if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) return false;
+
+		DIR* listing = opendir(directory.c_str());
+		if (!listing) return false;
+		// Last use is kept as the modification time of the data file
+		vector<std::pair<U64, Cache_entry>> found;
+		while (dirent* file = readdir(listing))
+		{
+			string name = file->d_name;
+			if (name.size() <= Tftp_cache_meta_suffix.size() ||
+				name.compare(name.size() - Tftp_cache_meta_suffix.size(), string::npos, Tftp_cache_meta_suffix) != 0) continue;
+
+			Cache_entry entry;
+			struct stat data;
+			string meta_path = directory + "/" + name;
+			if (!read_meta(meta_path, entry) ||
+				stat(data_path(entry.key).c_str(), &data) != 0 || static_cast<U64>(data.st_size) != entry.size)
+			{
+				unlink(meta_path.c_str());
+				continue;
+			}
+			U64 modified = static_cast<U64>(data.st_mtim.tv_sec) * 1000000000 + static_cast<U64>(data.st_mtim.tv_nsec);
+			found.emplace_back(modified, std::move(entry));
+		}
+		closedir(listing);
+
+		std::sort(found.begin(), found.end(),
+			[](const std::pair<U64, Cache_entry>& a, const std::pair<U64, Cache_entry>& b) { return a.first < b.first; });
+		for (auto& entry : found)
+		{
+			entry.second.last_used = ++use_counter;
+			bytes += entry.second.size;
+			entries[entry.second.key] = std::move(entry.second);
+		}
+		opened = true;
+		evict();
+		return true;
+	}
+
+	void close()
+	{
+		Guard gate_out(mutex);
+
+		opened = false;
+		entries.clear();
+		bytes = 0;
+	}
+
+	bool is_open() const
+	{
+		Guard gate_in(mutex);
+		return opened;
+	}
+
+	static string Key(const string& server, Tftp_mode mode, const string& remote_path)
+	{
+		return server + " " + To_string(mode) + " " + remote_path;
+	}
+
+	/*
+	 *	Size and checksum of the entry for key, false when there is none
+	 */
+	bool find(const string& key, U64& size, U32& checksum) const
+	{
+		Guard gate_in(mutex);
+
+		auto found = entries.find(key);
+		if (!opened || found == entries.end()) return false;
+		size = found->second.size;
+		checksum = found->second.checksum;
+		return true;
+	}
+
+	/*
+	 *	Writes the cached file, a hit when that succeeded
+	 */
+	bool fetch(const string& key, std::ostream& out)
+	{
+		Guard gate_out(mutex);
+
+		auto found = entries.find(key);
+		if (!opened || found == entries.end()) return false;
+		Cache_entry& entry = found->second;
+		bool good = false;
+		if (!entry.contents.empty() || entry.size == 0)
+		{
+			out.write(reinterpret_cast<const char*>(entry.contents.data()), entry.contents.size());
+			good = out.good();
+		}
+		else
+		{
+			std::ifstream in(data_path(key), std::ifstream::binary);
+			good = in.good() && (out << in.rdbuf()) && out.good();
+		}
+		if (!good) return false;
+		utimensat(AT_FDCWD, data_path(key).c_str(), nullptr, 0);
+		entry.last_used = ++use_counter;
+		++stats.hits;
+		return true;
+	}
+
+	void miss()
+	{
+		Guard gate_out(mutex);
+
+		if (opened) ++stats.misses;
+	}
+
+	/*
+	 *	Copies a file just got into the cache, written aside and renamed
+	 *	so a crash never leaves a torn entry behind. The copy is made
+	 *	without holding the lock, only the entry table is updated under it.
+	 */
+	bool store(const string& key, const string& file_name, U64 size, U32 checksum)
+	{
+		string path;
+		string stored_directory;
+		{
+			Guard gate_in(mutex);
+
+			if (!opened || size > capacity) return false;
+			path = data_path(key);
+			stored_directory = directory;
+		}
+
+		Cache_entry entry;
+		entry.key = key;
+		entry.size = size;
+		entry.checksum = checksum;
+		string temp_path = path + ".part";
+		{
+			std::ifstream in(file_name, std::ifstream::binary);
+			std::ofstream out(temp_path, std::ofstream::binary | std::ofstream::trunc);
+			if (size > 0 && !(out << in.rdbuf())) return false;
+			out.flush();
+			if (!out.good() || static_cast<U64>(out.tellp()) != size)
+			{
+				unlink(temp_path.c_str());
+				return false;
+			}
+		}
+		if (size <= Tftp_cache_memory_entry_max)
+		{
+			std::ifstream in(temp_path, std::ifstream::binary);
+			entry.contents.resize(size);
+			in.read(reinterpret_cast<char*>(entry.contents.data()), size);
+			if (static_cast<U64>(in.gcount()) != size) entry.contents.clear();
+		}
+
+		Guard gate_out(mutex);
+
+		// Closed or moved elsewhere while copying
+		if (!opened || directory != stored_directory || size > capacity)
+		{
+			unlink(temp_path.c_str());
+			return false;
+		}
+		remove(key);
+		if (rename(temp_path.c_str(), path.c_str()) != 0 || !write_meta(entry))
+		{
+			unlink(temp_path.c_str());
+			unlink(path.c_str());
+			return false;
+		}
+
+		entry.last_used = ++use_counter;
+		bytes += size;
+		entries[key] = std::move(entry);
+		++stats.stores;
+		evict();
+		return true;
+	}
+
+	Cache_stats get_stats() const
+	{
+		Guard gate_in(mutex);
+
+		Cache_stats result = stats;
+		result.entries = entries.size();
+		result.bytes = bytes;
+		result.capacity = capacity;
+		return result;
+	}
+
+private:
+	using Guard = std::lock_guard<std::mutex>;
+
+	/*
+	 *	FNV-1a of the key, names stay short and free of path separators
+	 */
+	string data_path(const string& key) const
+	{
+		U64 hash = 14695981039346656037ull;
+		for (char c : key)
+		{
+			hash ^= static_cast<Byte>(c);
+			hash *= 1099511628211ull;
+		}
+		char name[17];
+		snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+		return directory + "/" + name;
+	}
+
+	bool read_meta(const string& meta_path, Cache_entry& entry) const
+	{
+		std::ifstream in(meta_path);
+		string checksum;
+		if (!std::getline(in, entry.key) || !(in >> entry.size >> checksum)) return false;
+		return Parse_checksum(checksum, entry.checksum);
+	}
+
+	bool write_meta(const Cache_entry& entry) const
+	{
+		std::ofstream out(data_path(entry.key) + Tftp_cache_meta_suffix, std::ofstream::trunc);
+		out << entry.key << "\n" << entry.size << " " << To_checksum_string(entry.checksum) << "\n";
+		return out.good();
+	}
+
+	void remove(const string& key)
+	{
+		auto found = entries.find(key);
+		if (found == entries.end()) return;
+		string path = data_path(key);
+		unlink((path + Tftp_cache_meta_suffix).c_str());
+		unlink(path.c_str());
+		bytes -= found->second.size;
+		entries.erase(found);
+	}
+
+	void evict()
+	{
+		while (bytes > capacity && !entries.empty())
+		{
+			auto oldest = entries.begin();
+			for (auto it = entries.begin(); it != entries.end(); ++it)
+			{
+				if (it->second.last_used < oldest->second.last_used) oldest = it;
+			}
+			string key = oldest->first;
+			remove(key);
+			++stats.evictions;
+		}
+	}
+
+	mutable std::mutex mutex;
+	string directory;
+	U64 capacity{ Tftp_cache_capacity_default };
+	U64 bytes{ 0 };
+	U64 use_counter{ 0 };
+	bool opened{ false };
+	std::unordered_map<string, Cache_entry> entries;
+	Cache_stats stats;
+};
+
+}
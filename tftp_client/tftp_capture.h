@@ -0,0 +1,330 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_address.h"
+#include "tftp_timer.h"
+
+#include <atomic>
+#include <mutex>
+#include <time.h>
+
+namespace tftp
+{
+
+/*
+ *	pcap with nanosecond timestamps, datagrams are stored with made up
+ *	IPv4 / IPv6 and UDP headers (LINKTYPE_RAW) so Wireshark decodes
+ *	them as TFTP
+ */
+constexpr U32 Pcap_magic_us = 0xa1b2c3d4;
+constexpr U32 Pcap_magic_ns = 0xa1b23c4d;
+constexpr U32 Pcap_link_ethernet = 1;
+constexpr U32 Pcap_link_raw = 101;
+constexpr U32 Pcap_link_linux_sll = 113;
+constexpr U32 Pcap_link_ipv4 = 228;
+constexpr U32 Pcap_link_ipv6 = 229;
+constexpr U32 Pcap_snap_length = 65535;
+
+struct Pcap_file_header
+{
+	U32 magic;
+	U16 version_major;
+	U16 version_minor;
+	I32 zone;
+	U32 sigfigs;
+	U32 snap_length;
+	U32 link_type;
+};
+
+struct Pcap_record_header
+{
+	U32 seconds;
+	U32 fraction;
+	U32 captured_length;
+	U32 length;
+};
+
+/*
+ *	Datagram of a capture, time_us counts from the first one
+ */
+struct Capture_record
+{
+	Time time_us{ 0 };
+	Address from;
+	Address to;
+	Tftp_packet packet;
+};
+
+/*
+ *	Writes every datagram sent or received on a socket, safe to use
+ *	from the listen and execute threads at once. The local address is
+ *	looked up once the socket has been bound by its first send.
+ */
+class Packet_capture
+{
+public:
+	Packet_capture() = default;
+	Packet_capture(const Packet_capture& other) = delete;
+
+	bool open(const string& file_name)
+	{
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		out.close();
+		out.clear();
+		out.open(file_name, std::ofstream::binary | std::ofstream::trunc);
+		if (!out.good()) return false;
+
+		Pcap_file_header header{ Pcap_magic_ns, 2, 4, 0, 0, Pcap_snap_length, Pcap_link_raw };
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		local = Address();
+		opened = out.good();
+		return opened;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		opened = false;
+		out.close();
+	}
+
+	bool is_open() const { return opened.load(std::memory_order_relaxed); }
+
+	void sent(I32 socket, const Address& to, const Tftp_packet& packet)
+	{
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		if (!opened || !find_local(socket)) return;
+		write(local, to, packet);
+	}
+
+	void received(I32 socket, const Address& from, const Tftp_packet& packet)
+	{
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		if (!opened || !find_local(socket)) return;
+		write(from, local, packet);
+	}
+
+private:
+	bool find_local(I32 socket)
+	{
+		if (local.port() != 0) return true;
+		local.length = sizeof(local.storage);
+		return getsockname(socket, local.data(), &local.length) == 0;
+	}
+
+	/*
+	 *	IPv4: 20 byte header, IPv6: 40 byte header, both followed by the
+	 *	8 byte UDP header, UDP checksums are left out
+	 */
+	void write(const Address& from, const Address& to, const Tftp_packet& packet)
+	{
+		Byte header[48] = { 0 };
+		size_t header_size = 0;
+		U16 udp_size = static_cast<U16>(8 + packet.size());
+		if (from.family() == AF_INET6)
+		{
+			header_size = 48;
+			header[0] = 0x60;
+			header[4] = static_cast<Byte>(udp_size >> 8);
+			header[5] = static_cast<Byte>(udp_size & 0xff);
+			header[6] = IPPROTO_UDP;
+			header[7] = 64;
+			memcpy(header + 8, &reinterpret_cast<const sockaddr_in6*>(&from.storage)->sin6_addr, 16);
+			memcpy(header + 24, &reinterpret_cast<const sockaddr_in6*>(&to.storage)->sin6_addr, 16);
+		}
+		else
+		{
+			header_size = 28;
+			U16 total = static_cast<U16>(20 + udp_size);
+			header[0] = 0x45;
+			header[2] = static_cast<Byte>(total >> 8);
+			header[3] = static_cast<Byte>(total & 0xff);
+			header[6] = 0x40;
+			header[8] = 64;
+			header[9] = IPPROTO_UDP;
+			memcpy(header + 12, &reinterpret_cast<const sockaddr_in*>(&from.storage)->sin_addr, 4);
+			memcpy(header + 16, &reinterpret_cast<const sockaddr_in*>(&to.storage)->sin_addr, 4);
+			U32 sum = 0;
+			for (size_t i = 0; i < 20; i += 2) sum += (header[i] << 8) | header[i + 1];
+			while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+			header[10] = static_cast<Byte>(~sum >> 8);
+			header[11] = static_cast<Byte>(~sum & 0xff);
+		}
+		Byte* udp = header + header_size - 8;
+		udp[0] = static_cast<Byte>(from.port() >> 8);
+		udp[1] = static_cast<Byte>(from.port() & 0xff);
+		udp[2] = static_cast<Byte>(to.port() >> 8);
+		udp[3] = static_cast<Byte>(to.port() & 0xff);
+		udp[4] = static_cast<Byte>(udp_size >> 8);
+		udp[5] = static_cast<Byte>(udp_size & 0xff);
+
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		U32 length = static_cast<U32>(header_size + packet.size());
+		Pcap_record_header record{ static_cast<U32>(now.tv_sec), static_cast<U32>(now.tv_nsec), length, length };
+		out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		out.write(reinterpret_cast<const char*>(header), header_size);
+		out.write(reinterpret_cast<const char*>(packet.raw_data()), packet.size());
+	}
+
+	std::mutex mutex;
+	std::ofstream out;
+	Address local;
+	std::atomic<bool> opened{ false };
+};
+
+inline U32 Swap_bytes(U32 value)
+{
+	return __builtin_bswap32(value);
+}
+
+/*
+ *	Takes the UDP payload out of an IP datagram, fragments and other
+ *	protocols are skipped
+ */
+inline bool Parse_datagram(const Byte* data, size_t size, Capture_record& record)
+{
+	if (size < 1) return false;
+	size_t header_size = 0;
+	record.from = Address();
+	record.to = Address();
+	if ((data[0] >> 4) == 4)
+	{
+		header_size = static_cast<size_t>(data[0] & 0x0f) * 4;
+		bool fragment = ((data[6] & 0x3f) | data[7]) != 0;
+		if (size < header_size + 8 || header_size < 20 || data[9] != IPPROTO_UDP || fragment) return false;
+
+		auto from = reinterpret_cast<sockaddr_in*>(&record.from.storage);
+		auto to = reinterpret_cast<sockaddr_in*>(&record.to.storage);
+		from->sin_family = to->sin_family = AF_INET;
+		memcpy(&from->sin_addr, data + 12, 4);
+		memcpy(&to->sin_addr, data + 16, 4);
+		record.from.length = record.to.length = sizeof(sockaddr_in);
+	}
+	else if ((data[0] >> 4) == 6)
+	{
+		header_size = 40;
+		if (size < header_size + 8 || data[6] != IPPROTO_UDP) return false;
+
+		auto from = reinterpret_cast<sockaddr_in6*>(&record.from.storage);
+		auto to = reinterpret_cast<sockaddr_in6*>(&record.to.storage);
+		from->sin6_family = to->sin6_family = AF_INET6;
+		memcpy(&from->sin6_addr, data + 8, 16);
+		memcpy(&to->sin6_addr, data + 24, 16);
+		record.from.length = record.to.length = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		return false;
+	}
+
+	const Byte* udp = data + header_size;
+	record.from.set_port(static_cast<U16>((udp[0] << 8) | udp[1]));
+	record.to.set_port(static_cast<U16>((udp[2] << 8) | udp[3]));
+	size_t udp_size = static_cast<size_t>((udp[4] << 8) | udp[5]);
+	if (udp_size < 8 || header_size + udp_size > size) return false;
+
+	I32 payload_size = static_cast<I32>(udp_size - 8);
+	if (!record.packet.resize(payload_size)) return false;
+	memcpy(record.packet.raw_data(), udp + 8, payload_size);
+	return true;
+}
+
+/*
+ *	Reads the UDP datagrams of a capture, written by Packet_capture or
+ *	taken with tcpdump (Ethernet, Linux cooked or raw IP), in either
+ *	byte order and timestamp resolution
+ */
+inline bool Read_capture(const string& file_name, vector<Capture_record>& records)
+{
+	records.clear();
+	std::ifstream in(file_name, std::ifstream::binary);
+	Pcap_file_header header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+	bool swapped = header.magic == Swap_bytes(Pcap_magic_us) || header.magic == Swap_bytes(Pcap_magic_ns);
+	U32 magic = swapped ? Swap_bytes(header.magic) : header.magic;
+	if (magic != Pcap_magic_us && magic != Pcap_magic_ns) return false;
+	U32 link_type = swapped ? Swap_bytes(header.link_type) : header.link_type;
+	U32 fraction_ns = magic == Pcap_magic_ns ? 1 : 1000;
+
+	vector<Byte> frame;
+	Time first_ns = Time_never;
+	Pcap_record_header record_header;
+	while (in.read(reinterpret_cast<char*>(&record_header), sizeof(record_header)))
+	{
+		if (swapped)
+		{
+			record_header.seconds = Swap_bytes(record_header.seconds);
+			record_header.fraction = Swap_bytes(record_header.fraction);
+			record_header.captured_length = Swap_bytes(record_header.captured_length);
+		}
+		if (record_header.captured_length > 256 * 1024) return false;
+		frame.resize(record_header.captured_length);
+		if (!in.read(reinterpret_cast<char*>(frame.data()), frame.size())) return false;
+
+		size_t offset = 0;
+		if (link_type == Pcap_link_ethernet)
+		{
+			offset = 14;
+			// 802.1Q tags
+			while (offset <= frame.size() && offset >= 2 &&
+				frame[offset - 2] == 0x81 && frame[offset - 1] == 0x00) offset += 4;
+		}
+		else if (link_type == Pcap_link_linux_sll)
+		{
+			offset = 16;
+		}
+		else if (link_type != Pcap_link_raw && link_type != Pcap_link_ipv4 && link_type != Pcap_link_ipv6)
+		{
+			Err("Unsupported capture link type " + std::to_string(link_type));
+			return false;
+		}
+		if (offset >= frame.size()) continue;
+
+		Capture_record record;
+		if (!Parse_datagram(frame.data() + offset, frame.size() - offset, record)) continue;
+
+		Time time_ns = static_cast<Time>(record_header.seconds) * 1000000000 +
+			static_cast<Time>(record_header.fraction) * fraction_ns;
+		if (first_ns == Time_never) first_ns = time_ns;
+		record.time_us = time_ns > first_ns ? (time_ns - first_ns) / 1000 : 0;
+		records.push_back(std::move(record));
+	}
+	return true;
+}
+
+/*
+ *	Outcome of replaying a captured transfer. Sent datagrams are
+ *	compared in order with those the capture shows the client sending,
+ *	matched counts those equal up to the first difference.
+ */
+struct Replay_stats
+{
+	U64 received{ 0 };
+	U64 sent{ 0 };
+	U64 expected{ 0 };
+	U64 matched{ 0 };
+	bool succeeded{ false };
+	Time capture_us{ 0 };
+	Time virtual_us{ 0 };
+	Time elapsed_us{ 0 };
+};
+
+inline string To_string(const Replay_stats& stats)
+{
+	return string(stats.succeeded ? "succeeded" : "failed") +
+		", received " + std::to_string(stats.received) +
+		", sent " + std::to_string(stats.sent) +
+		", captured sends " + std::to_string(stats.expected) +
+		", matching " + std::to_string(stats.matched) +
+		", captured " + std::to_string(stats.capture_us / 1000) + " ms" +
+		", replayed " + std::to_string(stats.virtual_us / 1000) + " ms" +
+		" in " + std::to_string(stats.elapsed_us / 1000) + " ms";
+}
+
+}
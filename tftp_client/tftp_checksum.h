@@ -0,0 +1,253 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <iomanip>
+#include <ctype.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define TFTP_CRC32C_X86 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define TFTP_CRC32C_ARM 1
+#endif
+
+namespace tftp
+{
+
+/*
+ *	Castagnoli CRC (CRC32C, polynomial 0x82F63B78 reflected), computed
+ *	incrementally as blocks pass through a transfer. Uses the SSE4.2 /
+ *	ARMv8 CRC32C instructions when available, slicing by 8 otherwise.
+ */
+class Crc32c
+{
+public:
+	void update(const Byte* data, size_t size)
+	{
+		state = Update(state, data, size);
+	}
+
+	U32 value() const { return ~state; }
+
+	void reset() { state = 0xffffffff; }
+
+	/*
+	 *	Continues after data whose checksum is value
+	 */
+	void resume(U32 value) { state = ~value; }
+
+	static U32 Compute(const Byte* data, size_t size)
+	{
+		return ~Update(0xffffffff, data, size);
+	}
+
+	static bool Hardware()
+	{
+#if defined(TFTP_CRC32C_X86)
+		static const bool supported = __builtin_cpu_supports("sse4.2");
+		return supported;
+#elif defined(TFTP_CRC32C_ARM)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static U32 Update(U32 crc, const Byte* data, size_t size)
+	{
+		if (Hardware()) return Update_hardware(crc, data, size);
+		return Update_software(crc, data, size);
+	}
+
+	static U32 Update_software(U32 crc, const Byte* data, size_t size)
+	{
+		const Table& table = Tables();
+		while (size >= 8)
+		{
+			U32 low;
+			U32 high;
+			memcpy(&low, data, 4);
+			memcpy(&high, data + 4, 4);
+			low = Little_endian(low) ^ crc;
+			high = Little_endian(high);
+			crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+				table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+				table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+				table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+			data += 8;
+			size -= 8;
+		}
+		while (size-- > 0)
+		{
+			crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		}
+		return crc;
+	}
+
+#if defined(TFTP_CRC32C_X86)
+	__attribute__((target("sse4.2")))
+	static U32 Update_hardware(U32 crc, const Byte* data, size_t size)
+	{
+#if defined(__x86_64__)
+		U64 crc64 = crc;
+		while (size >= 8)
+		{
+			U64 word;
+			memcpy(&word, data, 8);
+			crc64 = _mm_crc32_u64(crc64, word);
+			data += 8;
+			size -= 8;
+		}
+		crc = static_cast<U32>(crc64);
+#endif
+		while (size-- > 0)
+		{
+			crc = _mm_crc32_u8(crc, *data++);
+		}
+		return crc;
+	}
+#elif defined(TFTP_CRC32C_ARM)
+	static U32 Update_hardware(U32 crc, const Byte* data, size_t size)
+	{
+		while (size >= 8)
+		{
+			U64 word;
+			memcpy(&word, data, 8);
+			crc = __crc32cd(crc, word);
+			data += 8;
+			size -= 8;
+		}
+		while (size-- > 0)
+		{
+			crc = __crc32cb(crc, *data++);
+		}
+		return crc;
+	}
+#else
+	static U32 Update_hardware(U32 crc, const Byte* data, size_t size)
+	{
+		return Update_software(crc, data, size);
+	}
+#endif
+
+private:
+	using Table = std::array<std::array<U32, 256>, 8>;
+
+	static const Table& Tables()
+	{
+		static const Table tables = []()
+		{
+			Table result;
+			for (U32 i = 0; i < 256; ++i)
+			{
+				U32 crc = i;
+				for (I32 bit = 0; bit < 8; ++bit)
+				{
+					crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+				}
+				result[0][i] = crc;
+			}
+			for (U32 i = 0; i < 256; ++i)
+			{
+				for (I32 slice = 1; slice < 8; ++slice)
+				{
+					U32 previous = result[slice - 1][i];
+					result[slice][i] = (previous >> 8) ^ result[0][previous & 0xff];
+				}
+			}
+			return result;
+		}();
+		return tables;
+	}
+
+	static U32 Little_endian(U32 value)
+	{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		return __builtin_bswap32(value);
+#else
+		return value;
+#endif
+	}
+
+	U32 state{ 0xffffffff };
+};
+
+inline string To_checksum_string(U32 checksum)
+{
+	std::ostringstream out;
+	out << std::hex << std::setw(8) << std::setfill('0') << checksum;
+	return out.str();
+}
+
+/*
+ *	Accepts 8 hex digits with an optional 0x prefix
+ */
+inline bool Parse_checksum(const string& text, U32& out)
+{
+	string digits = text.compare(0, 2, "0x") == 0 ? text.substr(2) : text;
+	if (digits.empty() || digits.size() > 8) return false;
+	for (char c : digits)
+	{
+		if (!isxdigit(static_cast<unsigned char>(c))) return false;
+	}
+	out = static_cast<U32>(std::stoul(digits, nullptr, 16));
+	return true;
+}
+
+/*
+ *	Extension of this implementation: an RRQ asking for "crc32c" with
+ *	value 0 (like tsize) is answered with the CRC32C of the whole file
+ *	in the OACK, as 8 hex digits. Servers which do not know it leave it
+ *	out.
+ */
+const string Tftp_option_crc32c = "crc32c";
+
+/*
+ *	Sidecar files hold the expected checksum of the file next to them
+ *	as "<crc32c hex> [name]", the format written by common sum tools
+ */
+inline string Checksum_sidecar(const string& file_name)
+{
+	return file_name + ".crc32c";
+}
+
+inline bool Read_checksum_sidecar(const string& file_name, U32& out)
+{
+	std::ifstream in(Checksum_sidecar(file_name));
+	string token;
+	if (!(in >> token)) return false;
+	return Parse_checksum(token, out);
+}
+
+inline bool Write_checksum_sidecar(const string& file_name, U32 checksum, const string& label)
+{
+	std::ofstream out(Checksum_sidecar(file_name));
+	out << To_checksum_string(checksum) << "  " << label << "\n";
+	return out.good();
+}
+
+/*
+ *	CRC32C of a whole local file read in large chunks
+ */
+inline bool File_checksum(const string& file_name, U32& out)
+{
+	std::ifstream in(file_name, std::ifstream::binary);
+	if (!in.good()) return false;
+
+	vector<char> buffer(1 << 16);
+	Crc32c checksum;
+	while (in)
+	{
+		in.read(buffer.data(), buffer.size());
+		checksum.update(reinterpret_cast<const Byte*>(buffer.data()), static_cast<size_t>(in.gcount()));
+	}
+	if (!in.eof()) return false;
+	out = checksum.value();
+	return true;
+}
+
+}
@@ -1,10 +1,27 @@
 #pragma once
 
 #include "tftp_packet.h"
+#include "tftp_address.h"
+#include "tftp_timer.h"
+#include "tftp_pool.h"
+#include "tftp_congestion.h"
+#include "tftp_checksum.h"
+#include "tftp_trace.h"
+#include "tftp_servers.h"
+#include "tftp_capture.h"
+#include "tftp_offload.h"
+#include "tftp_compress.h"
+#include "tftp_cache.h"
+#include "tftp_resume.h"
+#include "tftp_tuning.h"
 
 #include <chrono>
 #include <vector>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <sstream>
 
 namespace tftp
@@ -17,41 +34,67 @@ using Mutex = std::mutex;
 template <typename T>
 using Lock_guard = std::lock_guard<T>;
 using Mutex_guard = Lock_guard<Mutex>;
+using Unique_lock = std::unique_lock<Mutex>;
+using Condition = std::condition_variable;
 
 using Socket = int32_t;
-using Time = uint64_t;
 
 constexpr Time Tftp_timeout_ms = 1000;
-constexpr Time Tftp_quant_ms = 25;
 constexpr I32 Tftp_ack_attempts = 4;
-
-struct Address
-{
-	string ip;
-	U16 port{ 0 };
-};
-
-inline bool operator==(const Address& address, const Address& other)
+constexpr Time Tftp_idle_ms = Tftp_timeout_ms * (Tftp_ack_attempts + 1);
+constexpr I32 Tftp_window_max = 64;
+
+/*
+ *	Upper bounds of pooled objects, packages beyond the queue
+ *	limit are dropped and recovered by retransmission
+ */
+constexpr size_t Tftp_package_pool_size = 256;
+constexpr size_t Tftp_transfer_pool_size = 16;
+
+/*
+ *	Replays start their virtual clock here so repeated runs see the
+ *	same absolute times
+ */
+constexpr Time Tftp_replay_epoch_us = 1000000000;
+
+/*
+ *	Busy polling: how long the socket is polled by the kernel per
+ *	receive (SO_BUSY_POLL) and the most a spin may last
+ */
+constexpr I32 Tftp_busy_poll_socket_us = 50;
+constexpr Time Tftp_busy_poll_spin_max_us = 100000;
+
+/*
+ *	One round of a spin loop. With a single CPU spinning would keep the
+ *	thread being waited for off it, so the spin yields instead.
+ */
+inline void Spin_pause()
 {
-	return address.ip == other.ip &&
-		address.port == other.port;
-}
-
-inline bool operator!=(const Address& address, const Address& other)
-{
-	return !operator==(address, other);
+	static const bool single_cpu = std::thread::hardware_concurrency() <= 1;
+	if (single_cpu)
+	{
+		std::this_thread::yield();
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
 }
 
 struct Package
 {
 	Address address;
 	Tftp_packet packet;
+	/*
+	 *	Arrival on the Now_us clock, stamped by the kernel when the
+	 *	socket delivers SO_TIMESTAMPNS, when the listen thread got it
+	 *	otherwise
+	 */
+	Time received_us{ 0 };
 };
 
-inline string To_string(Address address)
-{
-	return address.ip + ":" + std::to_string(address.port);
-}
+using Package_pool = Pool<Package>;
+using Package_ptr = Package_pool::Pointer;
 
 inline string To_string(Package package)
 {
@@ -78,10 +121,32 @@ struct Tftp_command
 		Get_file = 0,
 		Send_file = 1,
 		Quit = 2,
+		Get_size = 3,
 	};
 	Type type{ Type::Get_file };
 	string file_name;
 	string destination_name;
+	/*
+	 *	CRC32C the transferred file must have, otherwise taken from
+	 *	a sidecar next to the local file when there is one
+	 */
+	bool verify{ false };
+	U32 expected_checksum{ 0 };
+	U32 failovers{ 0 };
+	/*
+	 *	Gets only the bytes [offset, offset + length) of the file into
+	 *	the same place of the destination, which is not truncated. Needs
+	 *	a server taking the offset / length options, the get fails on
+	 *	any other.
+	 */
+	bool ranged{ false };
+	U64 offset{ 0 };
+	U64 length{ 0 };
+	/*
+	 *	Called on the execute thread once the command finished, size is
+	 *	the bytes transferred or the size a Get_size probe reported
+	 */
+	std::function<void(const Tftp_command& command, bool succeeded, U64 size)> done;
 };
 
 inline string To_string(const Tftp_command::Type& command_type)
@@ -95,6 +160,8 @@ inline string To_string(const Tftp_command::Type& command_type)
 	case Tftp_command::Type::Quit:
 		return "quit";
 		break;
+	case Tftp_command::Type::Get_size:
+		return "get size";
 	}
 	assert(false);
 	return "";
@@ -105,6 +172,162 @@ inline string To_string(const Tftp_command& command)
 	return To_string(command.type) + " " + command.file_name;
 }
 
+enum class Tftp_timer : U64
+{
+	Retransmit = 0,
+	Idle = 1,
+	Pace = 2,
+};
+
+/*
+ *	Loss recovery counters of a transfer
+ */
+struct Tftp_transfer_stats
+{
+	U64 sent{ 0 };
+	U64 received{ 0 };
+	U64 timeouts{ 0 };
+	U64 fast_retransmits{ 0 };
+	U64 duplicates{ 0 };
+	U64 out_of_order{ 0 };
+	U64 unexpected{ 0 };
+	Time srtt_us{ 0 };
+	I32 window{ 0 };
+	I32 block_size{ 0 };
+	I32 path_mtu{ 0 };
+	Latency_histogram rtt;
+	Latency_histogram queue_delay;
+};
+
+inline string To_string(const Tftp_transfer_stats& stats)
+{
+	return "sent " + std::to_string(stats.sent) +
+		", received " + std::to_string(stats.received) +
+		", timeouts " + std::to_string(stats.timeouts) +
+		", fast retransmits " + std::to_string(stats.fast_retransmits) +
+		", duplicates " + std::to_string(stats.duplicates) +
+		", out of order " + std::to_string(stats.out_of_order) +
+		", unexpected " + std::to_string(stats.unexpected) +
+		", srtt " + std::to_string(stats.srtt_us) + " us" +
+		", window " + std::to_string(stats.window) +
+		", blksize " + std::to_string(stats.block_size) +
+		(stats.path_mtu > 0 ? ", path mtu " + std::to_string(stats.path_mtu) : "") +
+		", rtt " + To_string(stats.rtt) +
+		", queue delay " + To_string(stats.queue_delay);
+}
+
+/*
+ *	State of a single get / put, driven by incoming packages and
+ *	by the retransmit and idle timers on the client timer wheel
+ *
+ *	Blocks are tracked as absolute numbers. A get expects next_block
+ *	and has acknowledged acked_block, a put has window_size blocks in
+ *	flight after acked_block and sends next_block once the window
+ *	slides. recovery_sent allows one immediate ACK (get) or window
+ *	resend (put) per point of progress, so duplicates never multiply
+ *	traffic (RFC 1123 4.2.3.1).
+ *
+ *	A put paces its blocks by the congestion window, the retransmit
+ *	timeout follows the measured RTT with exponential backoff, and
+ *	rate limits pace sends (put) or ACKs (get).
+ *
+ *	A compressed transfer moves the deflated stream, deflating runs
+ *	ahead of the window (put) and inflating behind the ACKs (get) on
+ *	threads of their own. checksum and total_size are those of the
+ *	file once the transfer completed.
+ *
+ *	A get of a cached file asks for tsize. When the size the server
+ *	reports (and the checksum, if one is expected) agrees with the
+ *	cache entry, the transfer is declined with error 8 and the file
+ *	comes from the cache, otherwise it goes on as usual.
+ *
+ *	A ranged get writes from the requested offset on and ends once the
+ *	range_length bytes the server confirmed arrived.
+ *
+ *	With resume on (off unless asked for), a get records its durable
+ *	progress next to the destination (recording). A later get of the
+ *	same file asks for the rest from there (resuming) and goes on
+ *	where the file left off if the server takes the offset and still
+ *	reports the same size. A server ignoring the offset sends the
+ *	whole file, which then replaces the partial one, a file of another
+ *	size is got anew (restarting).
+ */
+struct Tftp_transfer
+{
+	enum class State : I32
+	{
+		Active = 0,
+		Succeeded = 1,
+		Failed = 2,
+	};
+	U64 id{ 0 };
+	Tftp_command command;
+	State state{ State::Active };
+
+	Address peer;
+	bool negotiated{ false };
+	I32 window_size{ 1 };
+	I32 requested_window_size{ 1 };
+	I32 block_size{ Tftp_packet_data_size };
+	I32 requested_block_size{ Tftp_packet_data_size };
+	I32 path_mtu{ 0 };
+	bool tuned{ false };
+	Time base_rtt_us{ 0 };
+	U64 delay_block{ 0 };
+
+	Package request;
+	U64 next_block{ 1 };
+	U64 acked_block{ 0 };
+	U64 final_block{ 0 };
+	bool recovery_sent{ false };
+	vector<Tftp_packet> window;
+	vector<Time> sent_at;
+	Time ack_sent_at{ 0 };
+	U64 deferred_ack{ 0 };
+
+	Rtt_estimator rtt;
+	Congestion_window congestion;
+	Token_bucket pacing;
+	Token_bucket rate;
+	Time rto_ms{ Tftp_rto_initial_ms };
+
+	I32 attempts{ Tftp_ack_attempts };
+	bool unreachable{ false };
+	size_t total_size{ 0 };
+	Time last_activity{ 0 };
+
+	Crc32c checksum;
+	bool verify{ false };
+	U32 expected_checksum{ 0 };
+
+	std::ofstream out;
+	std::ifstream in;
+	string cache_key;
+	bool cache_candidate{ false };
+	bool size_reported{ false };
+	U64 reported_size{ 0 };
+	bool checksum_reported{ false };
+	U32 reported_checksum{ 0 };
+	bool offset_confirmed{ false };
+	bool length_confirmed{ false };
+	U64 range_length{ 0 };
+	bool recording{ false };
+	bool resuming{ false };
+	bool restarting{ false };
+	Resume_record resumed;
+	U64 saved_offset{ 0 };
+	bool compression_requested{ false };
+	bool compressed{ false };
+	std::unique_ptr<Deflate_reader> deflating;
+	std::unique_ptr<Inflate_writer> inflating;
+
+	Timer_wheel::Timer_id retransmit_timer{ Timer_wheel::No_timer };
+	Timer_wheel::Timer_id idle_timer{ Timer_wheel::No_timer };
+	Timer_wheel::Timer_id pace_timer{ Timer_wheel::No_timer };
+
+	Tftp_transfer_stats stats;
+};
+
 class Tftp_client
 {
 public:
@@ -117,7 +340,7 @@ public:
 		assert(socket_descriptor == 0);
 		Log("Connecting to " + To_string(server_address));
 
-		Socket socket_descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+		Socket socket_descriptor = socket(server_address.family(), SOCK_DGRAM, 0);
 		if (socket_descriptor < 0)
 		{
 			Err("Failed to create socket");
@@ -132,10 +355,18 @@ public:
 			close(socket_descriptor);
 			return false;
 		}
+		// Arrival times from the kernel, RTT samples then leave out the queueing in user space
+		if (setsockopt(socket_descriptor, SOL_SOCKET, SO_TIMESTAMPNS, &level, sizeof(level)) < 0)
+		{
+			Log("Kernel receive timestamps unavailable");
+		}
 
 		Log("Connected successfully");
+		packages.reserve(Tftp_package_pool_size);
+		pulled.reserve(Tftp_package_pool_size);
 		this->socket_descriptor = socket_descriptor;
 		this->server_address = server_address;
+		if (servers.size() == 0) servers = Server_list({ server_address });
 
 		running = true;
 		return true;
@@ -156,244 +387,1572 @@ public:
 			Mutex_guard gate_out(commands_mutex);
 
 			commands.push_back(command);
+			ordered.store(true, std::memory_order_release);
 		}
+		wake();
 	}
 
 	bool is_running() const { return running; }
 
 	bool send_package(const Package& package)
 	{
-		sockaddr_in target;
-		target.sin_family = AF_INET;
-		inet_pton(AF_INET, package.address.ip.c_str(), &target.sin_addr);
-		target.sin_port = htons(package.address.port);
-
-		vector<Byte> data = package.packet.get_bytes();
+		return send_package(package.address, package.packet);
+	}
 
-		Log("Sending package: " + To_string(package.packet));
+	bool send_package(const Address& address, const Tftp_packet& packet)
+	{
+		if (verbose) Log("Sending package: " + To_string(packet));
+		if (replaying)
+		{
+			replay_sent.push_back(packet);
+			if (transfer) ++transfer->stats.sent;
+			return true;
+		}
 
-		auto send_result = sendto(socket_descriptor, data.data(), data.size(), 0, (const sockaddr*)(&target), sizeof(target));
+		auto send_result = sendto(socket_descriptor, packet.raw_data(), packet.size(), 0, address.data(), address.length);
 		if (send_result <= 0)
 		{
-			Err("Failed to send a package to " + To_string(package.address));
+			Err("Failed to send a package to " + To_string(address));
 			return false;
 		}
+		Trace(Trace_event::Package_sent, packet.size());
+		if (capture.is_open()) capture.sent(socket_descriptor, address, packet);
+		if (transfer) ++transfer->stats.sent;
 		return true;
 	}
 
+	/*
+	 *	Writes every datagram the client sends and receives to a pcap file
+	 */
+	bool start_capture(const string& file_name) { return capture.open(file_name); }
+	void stop_capture() { capture.close(); }
+	bool is_capturing() const { return capture.is_open(); }
+
+	/*
+	 *	Runs the first transfer of a capture through a client of its own
+	 *	on a virtual clock: the server's datagrams are fed in at their
+	 *	captured times and timers fire when the clock passes them, so the
+	 *	run is deterministic and takes no longer than the computation.
+	 *	A get writes to local_file (the data is dropped when empty), a
+	 *	put reads the file it sends from it.
+	 */
+	static bool Replay(const string& capture_file, const string& local_file, Replay_stats& stats)
+	{
+		vector<Capture_record> records;
+		if (!Read_capture(capture_file, records))
+		{
+			Err("Could not read capture " + capture_file);
+			return false;
+		}
+
+		Time start_us = Now_us();
+		bool good{ false };
+		{
+			Virtual_clock clock(Tftp_replay_epoch_us);
+			Tftp_client client;
+			client.verbose = false;
+			good = client.replay(records, local_file, clock, stats);
+		}
+		stats.elapsed_us = Now_us() - start_us;
+		return good;
+	}
+
+	const Address& get_server_address() const { return server_address; }
+
+	/*
+	 *	Mirrors to fail over to, those of another address family than
+	 *	the connected server are not used
+	 */
+	const Server_list& get_servers() const { return servers; }
+	void set_servers(const Server_list& new_servers) { servers = new_servers; }
+	void probe_servers() { servers.probe(); }
+
 	Tftp_mode get_mode() const { return mode; }
 	void set_mode(Tftp_mode new_mode)  { mode = new_mode; }
 
-private:
+	bool is_verbose() const { return verbose; }
+	void set_verbose(bool new_verbose) { verbose = new_verbose; }
+
+	/*
+	 *	Bandwidth caps in bytes per second for each transfer and for
+	 *	all of them together, 0 means unlimited
+	 */
+	U64 get_rate() const { return rate_limit; }
+	void set_rate(U64 bytes_per_second) { rate_limit = bytes_per_second; }
+	U64 get_total_rate() const { return total_rate_limit; }
+	void set_total_rate(U64 bytes_per_second) { total_rate_limit = bytes_per_second; }
+
+	I32 get_window_size() const { return window_size; }
+	bool set_window_size(I32 new_window_size)
+	{
+		if (new_window_size < 1 || new_window_size > Tftp_window_max) return false;
+		window_size = new_window_size;
+		return true;
+	}
 
+	/*
+	 *	blksize asked for (RFC 2348), the default 512 asks for none
+	 */
+	I32 get_block_size() const { return block_size; }
+	bool set_block_size(I32 new_block_size)
+	{
+		if (new_block_size < Tftp_blksize_min || new_block_size > Tftp_packet_blksize_max) return false;
+		block_size = new_block_size;
+		return true;
+	}
 
-	vector<Package> pull_data_packages(Word packet_number)
+	/*
+	 *	Tuning takes blksize from the path MTU to the server. A get asks
+	 *	for twice the window the gets before settled on for that path and
+	 *	moves its own below that with loss and round trips, a put asks
+	 *	for the largest window and lets its congestion window find the
+	 *	size. Overrides the window and blksize settings.
+	 */
+	bool is_tuning() const { return tuning; }
+	void set_tuning(bool new_tuning) { tuning = new_tuning; }
+
+	/*
+	 *	Puts send their windows as one UDP_SEGMENT buffer, gets take
+	 *	UDP_GRO coalesced runs of blocks. Once coalescing was enabled the
+	 *	listen thread keeps receiving into a buffer large enough for it.
+	 */
+	bool is_offload() const { return offload; }
+	void set_offload(bool new_offload)
 	{
-		vector<Package> result;
+		offload = new_offload;
+		if (Enable_udp_gro(socket_descriptor, new_offload) && new_offload) coalescing = true;
+		else if (new_offload) Log("Receive coalescing unavailable");
+	}
 
-		vector<Package> packages = pull_packages();
-		for (auto& package : packages)
+	/*
+	 *	Content cache for repeated gets, capacity in bytes. A cached
+	 *	copy is only used when the server announces the file's size and
+	 *	crc32c and both match, servers which do not are always asked.
+	 */
+	bool open_cache(const string& directory, U64 capacity) { return cache.open(directory, capacity); }
+	void close_cache() { cache.close(); }
+	bool is_caching() const { return cache.is_open(); }
+	Cache_stats get_cache_stats() const { return cache.get_stats(); }
+
+	/*
+	 *	Asks for deflated octet transfers, servers which do not know the
+	 *	option send the file as it is
+	 */
+	bool is_compress() const { return compress; }
+	void set_compress(bool new_compress) { compress = new_compress; }
+
+	/*
+	 *	Gets record their progress and continue an interrupted get of the
+	 *	same file from there instead of from block 1
+	 */
+	bool is_resume() const { return resume; }
+	void set_resume(bool new_resume) { resume = new_resume; }
+
+	/*
+	 *	Spin budget in microseconds, 0 sleeps in the kernel between
+	 *	packages. While spinning the listen thread retries non-blocking
+	 *	receives and the execute thread watches the queue, each for up
+	 *	to the budget before blocking again, so a reply is picked up
+	 *	without two thread wake-ups at the cost of two busy cores.
+	 */
+	Time get_busy_poll() const { return busy_poll_us; }
+	bool set_busy_poll(Time spin_us)
+	{
+		if (spin_us > Tftp_busy_poll_spin_max_us) return false;
+#ifdef SO_BUSY_POLL
+		I32 socket_us = spin_us > 0 ? Tftp_busy_poll_socket_us : 0;
+		if (setsockopt(socket_descriptor, SOL_SOCKET, SO_BUSY_POLL, &socket_us, sizeof(socket_us)) < 0 && spin_us > 0)
 		{
-			Log("Pulled package " + To_string(package.packet));
+			Log("Kernel busy polling unavailable, spinning in user space only");
+		}
+#endif
+		busy_poll_us = spin_us;
+		return true;
+	}
 
-			if (package.packet.get_op() == Tftp_operation::Data &&
-				package.packet.get_word(2) == packet_number)
+private:
+	/*
+	 *	Takes the command back from the captured request, then runs the
+	 *	execute loop with the clock jumping from event to event
+	 */
+	bool replay(const vector<Capture_record>& records, const string& local_file, Virtual_clock& clock, Replay_stats& stats)
+	{
+		auto request = std::find_if(records.begin(), records.end(), [](const Capture_record& record)
+		{
+			return record.packet.size() >= 2 && (record.packet.get_op() == Tftp_operation::Read ||
+				record.packet.get_op() == Tftp_operation::Write);
+		});
+		Tftp_command command;
+		string mode_name;
+		Tftp_options options;
+		if (request == records.end() || !Get_request(request->packet, command.file_name, mode_name, options))
+		{
+			Err("Capture holds no request");
+			return false;
+		}
+
+		const string* window = Find_option(options, Tftp_option_windowsize);
+		const string* size = Find_option(options, Tftp_option_tsize);
+		if (request->packet.get_op() == Tftp_operation::Write)
+		{
+			command.type = Tftp_command::Type::Send_file;
+			command.destination_name = command.file_name;
+			command.file_name = local_file;
+		}
+		else if (size && !window)
+		{
+			command.type = Tftp_command::Type::Get_size;
+		}
+		else
+		{
+			command.type = Tftp_command::Type::Get_file;
+			command.destination_name = local_file.empty() ? "/dev/null" : local_file;
+		}
+		mode = mode_name == "octet" ? Tftp_mode::Octet : Tftp_mode::Netascii;
+		window_size = window ? std::atoi(window->c_str()) : 1;
+		const string* blksize = Find_option(options, Tftp_option_blksize);
+		block_size = blksize ? std::atoi(blksize->c_str()) : Tftp_packet_data_size;
+		tuning = false;
+		// A get asks for tsize when it records its progress
+		resume = size && command.type == Tftp_command::Type::Get_file;
+		if (command.type == Tftp_command::Type::Send_file && local_file.empty())
+		{
+			Err("Replaying a put needs the file it sent");
+			return false;
+		}
+
+		vector<const Capture_record*> inputs;
+		vector<const Capture_record*> expected;
+		Address client_address = request->from;
+		for (auto record = request; record != records.end(); ++record)
+		{
+			if (record->from == client_address) expected.push_back(&*record);
+			else if (record->to == client_address) inputs.push_back(&*record);
+		}
+		Log("Replaying " + To_string(command) + " from " + To_string(request->to) +
+			", " + std::to_string(inputs.size()) + " datagrams to feed");
+
+		replaying = true;
+		server_address = request->to;
+		servers = Server_list({ server_address });
+		running = true;
+		Time base_us = clock.now_us() - request->time_us;
+		if (!execute(command)) return false;
+
+		bool succeeded{ false };
+		U64 transfer_id = transfer->id;
+		transfer->command.done = [&succeeded](const Tftp_command&, bool good, U64) { succeeded = good; };
+		size_t next = 0;
+		while (transfer && transfer->id == transfer_id)
+		{
+			Time input_us = next < inputs.size() ? base_us + inputs[next]->time_us : Time_never;
+			Time deadline = timers.next_expiry();
+			Time timer_us = deadline == Time_never ? Time_never : deadline * 1000;
+			if (input_us == Time_never && timer_us == Time_never) break;
+			clock.advance_to(std::min(input_us, timer_us));
+
+			for (; next < inputs.size() && base_us + inputs[next]->time_us <= clock.now_us(); ++next)
 			{
-				result.push_back(package);
-				continue;
+				Package_ptr package = package_pool.acquire();
+				if (!package) break;
+				package->address = inputs[next]->from;
+				package->received_us = base_us + inputs[next]->time_us;
+				package->packet = inputs[next]->packet;
+				packages.push_back(std::move(package));
+				++stats.received;
 			}
+			dispatch_packages();
+			timers.advance(Now_ms(), [this](U64 timer_cookie) { on_timer(timer_cookie); });
+			finish_transfer();
+		}
+
+		stats.succeeded = succeeded;
+		stats.sent = replay_sent.size();
+		stats.expected = expected.size();
+		for (size_t i = 0; i < replay_sent.size() && i < expected.size(); ++i)
+		{
+			const Tftp_packet& sent = replay_sent[i];
+			const Tftp_packet& captured = expected[i]->packet;
+			if (sent.size() != captured.size() ||
+				memcmp(sent.raw_data(), captured.raw_data(), sent.size()) != 0) break;
+			++stats.matched;
+		}
+		stats.capture_us = std::max(expected.back()->time_us, inputs.empty() ? Time{ 0 } : inputs.back()->time_us) - request->time_us;
+		stats.virtual_us = clock.now_us() - base_us - request->time_us;
+		return true;
+	}
 
-			Err("Unexpected package, dropping");
+	/*
+	 *	Swaps the queue into result, both vectors keep their capacity
+	 *	so the exchange does not allocate once warmed up
+	 */
+	void pull_packages(vector<Package_ptr>& result)
+	{
+		result.clear();
+		{
+			Trace_scope lock_trace(Trace_event::Lock);
+			Mutex_guard gate_in(packages_mutex);
+			lock_trace.close();
+
+			std::swap(result, packages);
+			queued.store(false, std::memory_order_relaxed);
 		}
+		if (!result.empty()) Trace(Trace_event::Package_dequeued, result.size());
+	}
+
+	bool has_commands()
+	{
+		Mutex_guard gate_in(commands_mutex);
 
-		return result;
+		return !commands.empty();
 	}
 
-	vector<Package> pull_ack_packages(Word packet_number)
+	bool pop_command(Tftp_command& out)
 	{
-		vector<Package> result;
+		Mutex_guard gate_in(commands_mutex);
 
-		vector<Package> packages = pull_packages();
-		for (auto& package : packages)
+		if (commands.empty()) return false;
+		out = commands.front();
+		commands.erase(commands.begin());
+		ordered.store(!commands.empty(), std::memory_order_relaxed);
+		return true;
+	}
+
+	/*
+	 *	Blocks until a package arrives, a command can be started
+	 *	or the next timer on the wheel is due
+	 */
+	void wait_for_events()
+	{
+		Time deadline = timers.next_expiry();
+		Time now = Now_ms();
+		Trace_scope wait_trace(Trace_event::Wait,
+			deadline == Time_never ? 0 : (deadline > now ? deadline - now : 0));
+
+		Time spin_us = busy_poll_us;
+		if (spin_us > 0)
 		{
-			Log("Pulled package " + To_string(package.packet));
+			Time until_us = std::min(Now_us() + spin_us, deadline == Time_never ? Time_never : deadline * 1000);
+			while (running && !queued.load(std::memory_order_acquire) &&
+				(transfer || !ordered.load(std::memory_order_acquire)) && Now_us() < until_us) Spin_pause();
+		}
 
-			if (package.packet.get_op() == Tftp_operation::Ack &&
-				package.packet.get_word(2) == packet_number)
-			{
-				result.push_back(package);
-				continue;
-			}
+		Unique_lock gate_in(packages_mutex);
+		auto ready = [this]()
+		{
+			return !running || !packages.empty() || (!transfer && has_commands());
+		};
+		if (deadline == Time_never)
+		{
+			events.wait(gate_in, ready);
+			return;
+		}
+		events.wait_for(gate_in,
+			std::chrono::milliseconds(deadline > now ? deadline - now : 0), ready);
+	}
 
-			Err("Unexpected package, dropping");
+	void wake()
+	{
+		{
+			Mutex_guard gate_out(packages_mutex);
 		}
+		events.notify_one();
+	}
 
-		return result;
+	void arm_retransmit()
+	{
+		timers.cancel(transfer->retransmit_timer);
+		transfer->retransmit_timer = timers.schedule(
+			Now_ms() + transfer->rto_ms, cookie(Tftp_timer::Retransmit));
 	}
 
-	vector<Package> pull_packages()
+	/*
+	 *	received_us is the arrival of the answer, so the time it waited
+	 *	for the execute thread does not count
+	 */
+	void sample_rtt(Time sent_us, Time received_us)
 	{
-		vector<Package> result;
+		Tftp_transfer& t = *transfer;
+		Time rtt_us = received_us > sent_us ? received_us - sent_us : 0;
+		t.rtt.sample(rtt_us);
+		t.stats.rtt.record(rtt_us);
+		t.rto_ms = t.rtt.rto_ms(Tftp_timeout_ms);
+	}
+
+	bool rate_ready()
+	{
+		U64 total_limit = total_rate_limit;
+		if (total_rate.get_rate() != total_limit) total_rate.set_rate(total_limit);
+		Time now = Now_us();
+		return transfer->pacing.ready(now) && transfer->rate.ready(now) && total_rate.ready(now);
+	}
+
+	void consume_rate(U64 bytes)
+	{
+		Time now = Now_us();
+		transfer->pacing.consume(bytes, now);
+		transfer->rate.consume(bytes, now);
+		total_rate.consume(bytes, now);
+	}
+
+	/*
+	 *	Follows congestion window changes with the pacing rate
+	 */
+	void update_pacing()
+	{
+		Tftp_transfer& t = *transfer;
+		I32 datagram_size = Tftp_packet_header_size + t.block_size;
+		U64 rate = t.congestion.pacing_rate(t.rtt, datagram_size);
+		if (rate == 0)
 		{
-			Mutex_guard gate_in(packages_mutex);
+			t.pacing.set_rate(0);
+			return;
+		}
+		t.pacing.update_rate(rate, 2 * datagram_size, Now_us());
+	}
+
+	void arm_pace()
+	{
+		Tftp_transfer& t = *transfer;
+		if (t.pace_timer != Timer_wheel::No_timer) return;
+
+		Time now = Now_us();
+		Time ready_us = std::max({ t.pacing.ready_at_us(now), t.rate.ready_at_us(now), total_rate.ready_at_us(now) });
+		t.pace_timer = timers.schedule((ready_us + 999) / 1000, cookie(Tftp_timer::Pace));
+	}
+
+	void arm_idle()
+	{
+		transfer->idle_timer = timers.schedule(
+			transfer->last_activity + Tftp_idle_ms, cookie(Tftp_timer::Idle));
+	}
+
+	U64 cookie(Tftp_timer timer) const
+	{
+		return (transfer->id << 2) | static_cast<U64>(timer);
+	}
+
+	void begin_transfer(const Tftp_command& command, Package request)
+	{
+		transfer->id = ++transfer_counter;
+		transfer->rate.set_rate(rate_limit);
+		transfer->command = command;
+
+		const string& local_name = command.type == Tftp_command::Type::Get_file ?
+			command.destination_name : command.file_name;
+		transfer->verify = command.verify;
+		transfer->expected_checksum = command.expected_checksum;
+		if (!transfer->verify && command.type != Tftp_command::Type::Get_size && !command.ranged)
+		{
+			transfer->verify = Read_checksum_sidecar(local_name, transfer->expected_checksum);
+		}
+		transfer->request = request;
+		transfer->last_activity = Now_ms();
+
+		send_package(transfer->request);
+		arm_retransmit();
+		arm_idle();
+	}
+
+	Tftp_options request_options() const
+	{
+		Tftp_options options;
+		if (transfer->requested_window_size > 1)
+		{
+			options.emplace_back(Tftp_option_windowsize, std::to_string(transfer->requested_window_size));
+		}
+		if (transfer->requested_block_size != Tftp_packet_data_size)
+		{
+			options.emplace_back(Tftp_option_blksize, std::to_string(transfer->requested_block_size));
+		}
+		if (transfer->compression_requested)
+		{
+			options.emplace_back(Tftp_option_compress, Tftp_compress_deflate);
+		}
+		if (transfer->cache_candidate || transfer->recording)
+		{
+			options.emplace_back(Tftp_option_tsize, "0");
+		}
+		if (transfer->cache_candidate)
+		{
+			options.emplace_back(Tftp_option_crc32c, "0");
+		}
+		if (transfer->resuming)
+		{
+			options.emplace_back(Tftp_option_offset, std::to_string(transfer->resumed.offset));
+		}
+		return options;
+	}
 
-			result = packages;
-			packages.clear();
+	bool execute_get(const Tftp_command& command)
+	{
+		Log("Getting file " + command.file_name + " into " + command.destination_name);
+
+		transfer = transfer_pool.acquire();
+		if (!transfer)
+		{
+			Err("Too many transfers");
+			return false;
 		}
-		return result;
+		if (!command.ranged && resume)
+		{
+			transfer->recording = true;
+			transfer->resuming = Is_resumable(command, transfer->resumed);
+			if (!transfer->resuming) Remove_resume_record(command.destination_name);
+		}
+		if (command.ranged || transfer->resuming)
+		{
+			transfer->out.open(command.destination_name, std::ofstream::binary | std::ofstream::in | std::ofstream::out);
+			transfer->out.seekp(static_cast<std::streamoff>(command.ranged ? command.offset : transfer->resumed.offset));
+		}
+		else
+		{
+			transfer->out.open(command.destination_name, std::ofstream::binary);
+		}
+		if (!transfer->out.good())
+		{
+			Err("Could not write to file " + command.destination_name);
+			transfer.reset();
+			return false;
+		}
+		choose_parameters(false);
+		if (command.ranged)
+		{
+			// A byte range of a file is always moved as is, and never cached
+			Tftp_options options = request_options();
+			options.emplace_back(Tftp_option_offset, std::to_string(command.offset));
+			options.emplace_back(Tftp_option_length, std::to_string(command.length));
+			begin_transfer(command, { server_address, Create_read(command.file_name, Tftp_mode::Octet, options) });
+			return true;
+		}
+		transfer->compression_requested = compress && mode == Tftp_mode::Octet && !transfer->resuming;
+		if (cache.is_open() && !transfer->resuming)
+		{
+			U64 size{ 0 };
+			U32 checksum{ 0 };
+			transfer->cache_key = Content_cache::Key(To_string(server_address), mode, command.file_name);
+			transfer->cache_candidate = cache.find(transfer->cache_key, size, checksum);
+			if (!transfer->cache_candidate) cache.miss();
+		}
+
+		begin_transfer(command, { server_address, Create_read(command.file_name, mode, request_options()) });
+		return true;
 	}
 
-	bool execute_get(string file_name, string destination_name)
+	/*
+	 *	Window and blksize to ask for, those of the server path when
+	 *	tuning with headroom for a get to grow its window
+	 */
+	void choose_parameters(bool put)
 	{
-		Word packet_number{ 1 };
-		Log("Getting file " + file_name + " into " + destination_name);
-		std::ofstream out(destination_name, std::ofstream::binary);
-		size_t total_size{ 0 };
+		Tftp_transfer& t = *transfer;
+		t.requested_window_size = window_size;
+		t.requested_block_size = block_size;
+		if (!tuning) return;
+
+		Path_tuning& path = tunings[To_string(server_address)];
+		path.mtu = Path_mtu(server_address);
+		path.block_size = path.mtu > 0 ? Blksize_for_mtu(path.mtu, server_address.family()) : Tftp_packet_data_size;
+		t.path_mtu = path.mtu;
+		t.tuned = true;
+		t.base_rtt_us = path.base_rtt_us;
+		t.requested_block_size = path.block_size;
+		t.requested_window_size = put ? Tftp_window_max : std::min(Tftp_window_max, 2 * path.window_size);
+	}
 
-		I32 attempts = Tftp_ack_attempts;
+	/*
+	 *	Starts the live window of a tuned get where the gets before on
+	 *	the path left it, below the negotiated window
+	 */
+	void start_get_window()
+	{
+		Tftp_transfer& t = *transfer;
+		t.congestion.reset(t.window_size);
+		t.congestion.restart(tunings[To_string(server_address)].window_size);
+	}
 
-		Package request = { server_address, Create_read(file_name, mode) };
-		Package response;
+	/*
+	 *	Moves the live window of a tuned get once blocks more arrived in
+	 *	order, a quarter down at most once a window while the round trip
+	 *	shows queueing, up otherwise. The window is enforced by pacing
+	 *	the ACKs, a sender only moves on to the next window when the
+	 *	last one is acknowledged.
+	 */
+	void tune_get_window(U64 blocks)
+	{
+		Tftp_transfer& t = *transfer;
+		if (Is_queueing(t.base_rtt_us, t.rtt.srtt_us()))
+		{
+			if (t.next_block <= t.delay_block) return;
+			t.congestion.on_delay();
+			t.delay_block = t.next_block + t.congestion.window();
+		}
+		else
+		{
+			t.congestion.on_ack(blocks);
+		}
+		update_pacing();
+	}
 
-		bool finished{ false };
+	/*
+	 *	Lets the next get on the path start from the window this one
+	 *	ended with
+	 */
+	void tune_path()
+	{
+		Tftp_transfer& t = *transfer;
+		if (!t.tuned || !t.negotiated || t.command.type != Tftp_command::Type::Get_file) return;
 
-		while (attempts > 0)
+		Path_tuning& path = tunings[To_string(server_address)];
+		path.base_rtt_us = t.base_rtt_us;
+		I32 window = t.congestion.window();
+		if (path.window_size != window)
 		{
-			/*
-			 * Send out request / acknowledge
-			 */
-			send_package(request);
+			path.window_size = window;
+			Log("Tuned window for " + To_string(server_address) + " to " + std::to_string(window));
+		}
+	}
 
-			if (finished)
+	/*
+	 *	A get resumes from the record next to its destination when the
+	 *	record is of the same remote file and the bytes it claims are there
+	 */
+	static bool Is_resumable(const Tftp_command& command, Resume_record& record)
+	{
+		struct stat local;
+		return Read_resume_record(command.destination_name, record) &&
+			record.remote_name == command.file_name && record.offset > 0 &&
+			stat(command.destination_name.c_str(), &local) == 0 &&
+			static_cast<U64>(local.st_size) >= record.offset;
+	}
+
+	bool execute_put(const Tftp_command& command)
+	{
+		Log("Putting file " + command.file_name + " into " + command.destination_name);
+
+		transfer = transfer_pool.acquire();
+		if (!transfer)
+		{
+			Err("Too many transfers");
+			return false;
+		}
+		transfer->in.open(command.file_name, std::ifstream::binary);
+		if (!transfer->in.good())
+		{
+			Err("Could not read from file " + command.file_name);
+			transfer.reset();
+			return false;
+		}
+		choose_parameters(true);
+		transfer->compression_requested = compress && mode == Tftp_mode::Octet;
+
+		begin_transfer(command, { server_address, Create_write(command.destination_name, mode, request_options()) });
+		return true;
+	}
+
+	/*
+	 *	Asks for the size of a file (RFC 2349) without transferring it,
+	 *	the transfer is ended right after the OACK
+	 */
+	bool execute_size(const Tftp_command& command)
+	{
+		transfer = transfer_pool.acquire();
+		if (!transfer)
+		{
+			Err("Too many transfers");
+			return false;
+		}
+		transfer->requested_window_size = 1;
+
+		begin_transfer(command, { server_address, Create_read(command.file_name, Tftp_mode::Octet, { { Tftp_option_tsize, "0" } }) });
+		return true;
+	}
+
+	void fail(const string& reason)
+	{
+		Err(reason);
+		transfer->state = Tftp_transfer::State::Failed;
+	}
+
+	/*
+	 *	All data moved, succeeds unless the checksum disagrees
+	 */
+	void complete()
+	{
+		Tftp_transfer& t = *transfer;
+		if (t.verify && t.checksum.value() != t.expected_checksum)
+		{
+			fail("Checksum mismatch, expected crc32c " + To_checksum_string(t.expected_checksum) +
+				" got " + To_checksum_string(t.checksum.value()));
+			// Nothing of this file is worth resuming
+			t.recording = false;
+			Remove_resume_record(t.command.destination_name);
+			return;
+		}
+		if (t.verify) Log("Checksum verified");
+		t.state = Tftp_transfer::State::Succeeded;
+	}
+
+	/*
+	 *	First response from the server, fixes its transfer ID and
+	 *	the options it accepted (none unless it answered with OACK)
+	 */
+	bool negotiate(const Package& response)
+	{
+		Tftp_transfer& t = *transfer;
+		t.negotiated = true;
+		t.peer = response.address;
+		t.window_size = 1;
+		t.block_size = Tftp_packet_data_size;
+
+		if (response.packet.get_op() != Tftp_operation::Oack) return confirm_range() && confirm_resume();
+
+		Tftp_options options;
+		if (!Get_options(response.packet, 2, options))
+		{
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Malformed OACK"));
+			fail("Malformed OACK received");
+			return false;
+		}
+		for (auto& option : options)
+		{
+			if (option.first == Tftp_option_windowsize)
 			{
-				out.flush();
-				return true;
+				I32 value = std::atoi(option.second.c_str());
+				if (value < 1 || value > t.requested_window_size)
+				{
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad windowsize"));
+					fail("Server answered with windowsize " + option.second);
+					return false;
+				}
+				t.window_size = value;
+				continue;
 			}
-
-			Time quant_time{ 0 };
-			while (quant_time < Tftp_timeout_ms)
+			if (option.first == Tftp_option_blksize)
 			{
-				vector<Package> packages = pull_data_packages(packet_number);
-				if (packages.size() > 0)
+				I32 value = std::atoi(option.second.c_str());
+				if (value < Tftp_blksize_min || value > t.requested_block_size)
 				{
-					response = packages[0];
-					break;
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad blksize"));
+					fail("Server answered with blksize " + option.second);
+					return false;
 				}
-
-				std::this_thread::sleep_for(
-					std::chrono::milliseconds(Tftp_quant_ms));
-				quant_time += Tftp_quant_ms;
+				t.block_size = value;
+				continue;
+			}
+			if (option.first == Tftp_option_tsize &&
+				(t.command.type == Tftp_command::Type::Get_size || t.cache_candidate || t.recording))
+			{
+				char* end = nullptr;
+				t.reported_size = std::strtoull(option.second.c_str(), &end, 10);
+				if (option.second.empty() || *end != 0)
+				{
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad tsize"));
+					fail("Server answered with tsize " + option.second);
+					return false;
+				}
+				t.size_reported = true;
+				if (t.command.type == Tftp_command::Type::Get_size) t.total_size = t.reported_size;
+				continue;
 			}
-			if (quant_time < Tftp_timeout_ms) // Answer received
+			if (option.first == Tftp_option_crc32c && t.cache_candidate)
 			{
-				attempts = Tftp_ack_attempts;
-				request = { response.address, Create_ack(packet_number) };
-				++packet_number;
+				if (!Parse_checksum(option.second, t.reported_checksum))
+				{
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad crc32c"));
+					fail("Server answered with crc32c " + option.second);
+					return false;
+				}
+				t.checksum_reported = true;
+				// Whatever is transferred instead of the cached copy is checked against it
+				if (!t.verify)
+				{
+					t.verify = true;
+					t.expected_checksum = t.reported_checksum;
+				}
+				continue;
+			}
+			if (option.first == Tftp_option_compress && t.compression_requested)
+			{
+				if (option.second != Tftp_compress_deflate)
+				{
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad compress"));
+					fail("Server answered with compress " + option.second);
+					return false;
+				}
+				t.compressed = true;
+				continue;
+			}
+			if ((option.first == Tftp_option_offset || option.first == Tftp_option_length) &&
+				(t.command.ranged || t.resuming))
+			{
+				char* end = nullptr;
+				U64 value = std::strtoull(option.second.c_str(), &end, 10);
+				bool is_offset = option.first == Tftp_option_offset;
+				U64 offset = t.command.ranged ? t.command.offset : t.resumed.offset;
+				// The server may cut the length at the end of the file, never the offset
+				if (option.second.empty() || *end != 0 ||
+					(is_offset ? value != offset : t.command.ranged && value > t.command.length))
+				{
+					send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Bad " + option.first));
+					fail("Server answered with " + option.first + " " + option.second);
+					return false;
+				}
+				if (is_offset) t.offset_confirmed = true;
+				else
+				{
+					t.length_confirmed = true;
+					t.range_length = value;
+				}
+				continue;
+			}
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Unrequested option"));
+			fail("Server answered with unrequested option " + option.first);
+			return false;
+		}
+		if (t.command.type != Tftp_command::Type::Get_size)
+		{
+			Log("Negotiated windowsize " + std::to_string(t.window_size) + ", blksize " + std::to_string(t.block_size) +
+				(t.compressed ? ", deflate" : ""));
+		}
+		if (!confirm_range() || !confirm_resume()) return false;
+		// A compressed get inflates once the cache did not serve it, see on_get_response
+		if (!t.compressed || t.command.type == Tftp_command::Type::Get_file) return true;
+
+		t.deflating.reset(new Deflate_reader());
+		if (!t.deflating->open(t.command.file_name))
+		{
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_0), "Could not read file"));
+			fail("Could not read from file " + t.command.file_name);
+			return false;
+		}
+		return true;
+	}
+
+	/*
+	 *	A ranged get goes on only when the server confirmed both the
+	 *	offset and the length, a server ignoring them sends the whole file
+	 */
+	bool confirm_range()
+	{
+		Tftp_transfer& t = *transfer;
+		if (!t.command.ranged || (t.offset_confirmed && t.length_confirmed)) return true;
+
+		send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Range not served"));
+		fail("Server does not serve byte ranges of " + t.command.file_name);
+		return false;
+	}
+
+	/*
+	 *	A resumed get goes on from the recorded offset if the server took
+	 *	it and the file still has the recorded size. Otherwise the data
+	 *	from block 1 replaces the partial file, or, when the server took
+	 *	the offset of a file which changed since, the get starts anew.
+	 */
+	bool confirm_resume()
+	{
+		Tftp_transfer& t = *transfer;
+		if (!t.resuming) return true;
+		if (t.offset_confirmed && t.size_reported && t.reported_size == t.resumed.size)
+		{
+			t.total_size = t.resumed.offset;
+			t.saved_offset = t.resumed.offset;
+			t.checksum.resume(t.resumed.checksum);
+			Log("Resuming " + t.command.file_name + " at byte " + std::to_string(t.resumed.offset) +
+				" of " + std::to_string(t.resumed.size));
+			return true;
+		}
+
+		t.resuming = false;
+		Remove_resume_record(t.command.destination_name);
+		if (t.offset_confirmed)
+		{
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "File changed"));
+			Log("File " + t.command.file_name + " changed since the interrupted get, getting it anew");
+			t.restarting = true;
+			t.state = Tftp_transfer::State::Failed;
+			return false;
+		}
+		t.out.close();
+		t.out.open(t.command.destination_name, std::ofstream::binary | std::ofstream::trunc);
+		if (!t.out.good())
+		{
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_0), "Could not write file"));
+			fail("Could not write to file " + t.command.destination_name);
+			return false;
+		}
+		Log("Server does not resume " + t.command.file_name + ", getting it whole");
+		return true;
+	}
 
-				string block = response.packet.get_string(4, response.packet.size() - 4);
-				total_size += block.size();
-				out << block;
+	/*
+	 *	Records how much of the get is on disk for a later get to resume
+	 *	from. Only plain gets of a known size are recorded, a compressed
+	 *	stream cannot be entered midway.
+	 */
+	void save_progress()
+	{
+		Tftp_transfer& t = *transfer;
+		if (!t.recording || !t.size_reported || t.compressed || t.total_size == t.saved_offset) return;
+
+		Resume_record record;
+		record.remote_name = t.command.file_name;
+		record.size = t.reported_size;
+		record.offset = t.total_size;
+		record.checksum = t.checksum.value();
+		t.out.flush();
+		if (!t.out.good() || !Sync_file(t.command.destination_name) ||
+			!Write_resume_record(t.command.destination_name, record)) return;
+		t.saved_offset = t.total_size;
+	}
+
+	void send_ack(U64 block)
+	{
+		Tftp_transfer& t = *transfer;
+		t.acked_block = block;
+		t.request = { t.peer, Create_ack(static_cast<Word>(block)) };
+		t.ack_sent_at = Now_us();
+		send_package(t.request);
+		arm_retransmit();
+	}
+
+	void on_get_response(const Package& response)
+	{
+		Tftp_transfer& t = *transfer;
+		Tftp_operation op = response.packet.get_op();
+
+		if (!t.negotiated)
+		{
+			if (op != Tftp_operation::Oack && op != Tftp_operation::Data)
+			{
+				++t.stats.unexpected;
+				return;
+			}
+			if (!negotiate(response)) return;
+			if (t.tuned) start_get_window();
+			if (t.command.type == Tftp_command::Type::Get_size)
+			{
+				// Only the size was wanted, RFC 2347 ends the transfer with error 8
+				send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Size probe only"));
+				if (op == Tftp_operation::Oack) t.state = Tftp_transfer::State::Succeeded;
+				else fail("Server does not report tsize for " + t.command.file_name);
+				return;
+			}
+			if (t.cache_candidate && serve_cached()) return;
+			if (t.compressed) t.inflating.reset(new Inflate_writer(std::move(t.out)));
+			if (op == Tftp_operation::Oack)
+			{
+				// Acknowledge the options, data starts with block 1
+				send_ack(0);
+				return;
+			}
+		}
+		if (op != Tftp_operation::Data || response.packet.size() < 4)
+		{
+			++t.stats.unexpected;
+			return;
+		}
 
-				if (response.packet.size() < Tftp_packet_datagram_size)
+		U64 block = Unwrap_block(response.packet.get_word(2), t.next_block);
+		if (block > t.next_block)
+		{
+			// Gap in the window, ask the sender to go back once
+			++t.stats.out_of_order;
+			if (t.window_size > 1 && !t.recovery_sent)
+			{
+				++t.stats.fast_retransmits;
+				t.recovery_sent = true;
+				if (t.tuned)
 				{
-					// Finished
-					Log("File of size " + std::to_string(total_size) + " bytes received");
-					finished = true;
+					t.congestion.on_loss();
+					update_pacing();
 				}
+				send_ack(t.next_block - 1);
+			}
+			return;
+		}
+		if (block < t.next_block)
+		{
+			/*
+			 * Duplicate, our ACK was lost or is late. In lockstep mode
+			 * answering it could start the Sorcerer's Apprentice cycle, so
+			 * the retransmit timer repeats the ACK instead
+			 */
+			++t.stats.duplicates;
+			if (t.window_size > 1 && !t.recovery_sent)
+			{
+				t.recovery_sent = true;
+				send_ack(t.next_block - 1);
+			}
+			return;
+		}
+
+		if (t.ack_sent_at != 0)
+		{
+			// First block answering our ACK
+			sample_rtt(t.ack_sent_at, response.received_us);
+			t.ack_sent_at = 0;
+		}
+		t.attempts = Tftp_ack_attempts;
+		t.recovery_sent = false;
+		++t.next_block;
+
+		I32 block_size = response.packet.size() - 4;
+		t.total_size += block_size;
+		const Byte* block_data = response.packet.raw_data() + 4;
+		if (t.inflating)
+		{
+			t.inflating->write(block_data, block_size);
+		}
+		else
+		{
+			Trace_scope write_trace(Trace_event::Disk_write, block_size);
+			t.out.write(reinterpret_cast<const char*>(block_data), block_size);
+			t.checksum.update(block_data, block_size);
+			if (t.total_size - t.saved_offset >= Tftp_resume_interval_bytes) save_progress();
+		}
+		consume_rate(response.packet.size());
+
+		bool finished = response.packet.size() < Tftp_packet_header_size + t.block_size;
+		if (finished)
+		{
+			send_ack(block);
+		}
+		else if (block - t.acked_block >= static_cast<U64>(t.window_size))
+		{
+			if (t.tuned) tune_get_window(block - t.acked_block);
+			if (rate_ready())
+			{
+				send_ack(block);
 			}
 			else
 			{
-				--attempts;
-				Log("Timeout passed, resending package: " + To_string(request));
+				// Over the rate, hold the sender back by withholding the ACK
+				t.deferred_ack = block;
+				timers.cancel(t.retransmit_timer);
+				t.retransmit_timer = Timer_wheel::No_timer;
+				arm_pace();
 			}
+		}
+		else
+		{
+			arm_retransmit();
+		}
 
+		if (finished)
+		{
+			if (t.inflating && !inflated()) return;
+			Log("File of size " + std::to_string(t.total_size) + " bytes received, crc32c " +
+				To_checksum_string(t.checksum.value()));
+			t.out.flush();
+			if (t.command.ranged && t.total_size != t.range_length)
+			{
+				fail("Range of " + std::to_string(t.range_length) + " bytes ended after " + std::to_string(t.total_size));
+				return;
+			}
+			complete();
+		}
+	}
 
+	/*
+	 *	Completes the get from the cache when the entry matches what
+	 *	the server reported, counts a miss otherwise
+	 */
+	bool serve_cached()
+	{
+		Tftp_transfer& t = *transfer;
+		U64 size{ 0 };
+		U32 checksum{ 0 };
+		// A file changed in place keeps its size, only the server's crc32c tells
+		bool valid = t.size_reported && t.checksum_reported && cache.find(t.cache_key, size, checksum) &&
+			size == t.reported_size && checksum == t.reported_checksum && (!t.verify || checksum == t.expected_checksum);
+		if (!valid)
+		{
+			cache.miss();
+			return false;
 		}
-		return false;
+		if (!cache.fetch(t.cache_key, t.out) || !t.out.flush())
+		{
+			cache.miss();
+			// A failed fetch may have written part of the file
+			t.out.close();
+			t.out.open(t.command.destination_name, std::ofstream::binary | std::ofstream::trunc);
+			if (t.out.good()) return false;
+			send_package(t.peer, Create_error(To_word(Tftp_error::Error_0), "Could not write file"));
+			fail("Could not write to file " + t.command.destination_name);
+			return true;
+		}
+
+		send_package(t.peer, Create_error(To_word(Tftp_error::Error_8), "Cached"));
+		t.total_size = size;
+		t.cache_key.clear();
+		Log("File of size " + std::to_string(size) + " bytes served from cache, crc32c " + To_checksum_string(checksum));
+		if (t.verify) Log("Checksum verified");
+		t.state = Tftp_transfer::State::Succeeded;
+		return true;
 	}
 
-	bool execute_put(string file_name, string destination_name)
+	/*
+	 *	Waits for the inflater to write the rest of the file
+	 */
+	bool inflated()
 	{
-		Byte buffer[Tftp_packet_datagram_size - 4];
-		Word packet_number{ 0 };
-		Log("Putting file " + file_name + " into " + destination_name);
-		std::ifstream in(file_name, std::ofstream::binary);
-		if (!in.good())
+		Tftp_transfer& t = *transfer;
+		bool good = t.inflating->close();
+		U64 compressed_size = t.total_size;
+		t.total_size = t.inflating->raw_size();
+		t.checksum = t.inflating->checksum();
+		if (!good)
 		{
-			Err("Could not read from file " + file_name);
+			fail("Could not inflate " + t.command.file_name + " into " + t.command.destination_name);
 			return false;
 		}
-		I32 total_size{ 0 };
-		I32 last_size{ Tftp_packet_data_size };
+		Log("Inflated " + std::to_string(compressed_size) + " bytes received");
+		return true;
+	}
 
-		I32 attempts = Tftp_ack_attempts;
+	void send_block(U64 block, bool retransmission)
+	{
+		Tftp_transfer& t = *transfer;
+		size_t slot = block % t.window.size();
+		// Karn: retransmitted blocks give no RTT samples
+		t.sent_at[slot] = retransmission ? 0 : Now_us();
+		if (retransmission) Trace(Trace_event::Retransmit, block);
+		consume_rate(t.window[slot].size());
+		if (!offload || replaying)
+		{
+			send_package(t.peer, t.window[slot]);
+			return;
+		}
+		batch.add(t.window[slot].raw_data(), t.window[slot].size());
+		batched.push_back(&t.window[slot]);
+		if (batch.full()) send_batch();
+	}
 
-		Package request = { server_address, Create_write(file_name, mode) };
-		Package response;
+	/*
+	 *	Sends the blocks collected by send_block, the window slots they
+	 *	point to stay untouched until then
+	 */
+	void send_batch()
+	{
+		if (batch.empty()) return;
+		Tftp_transfer& t = *transfer;
+		size_t sent = batch.send(socket_descriptor, t.peer, true);
+		if (sent < batched.size()) Err("Failed to send " + std::to_string(batched.size() - sent) + " blocks to " + To_string(t.peer));
+		for (auto packet : batched)
+		{
+			if (verbose) Log("Sending package: " + To_string(*packet));
+			Trace(Trace_event::Package_sent, packet->size());
+			if (capture.is_open()) capture.sent(socket_descriptor, t.peer, *packet);
+		}
+		t.stats.sent += sent;
+		batched.clear();
+	}
 
-		while (attempts > 0)
+	void send_window(U64 from)
+	{
+		Tftp_transfer& t = *transfer;
+		for (U64 block = from; block < t.next_block; ++block)
 		{
-			/*
-			 * Send out request / data
-			 */
-			send_package(request);
+			send_block(block, true);
+		}
+		send_batch();
+	}
 
-			Time quant_time{ 0 };
-			while (quant_time < Tftp_timeout_ms)
+	/*
+	 *	Retransmission is only due while blocks are in flight, a put
+	 *	held back by the rate limit waits for its pace timer instead
+	 */
+	void arm_put_retransmit()
+	{
+		Tftp_transfer& t = *transfer;
+		if (t.next_block > t.acked_block + 1)
+		{
+			arm_retransmit();
+			return;
+		}
+		timers.cancel(t.retransmit_timer);
+		t.retransmit_timer = Timer_wheel::No_timer;
+	}
+
+	/*
+	 *	Reads and sends blocks until the window is in flight or the
+	 *	pacing / rate limit is reached
+	 */
+	void fill_window()
+	{
+		Byte buffer[Tftp_packet_blksize_max];
+		Tftp_transfer& t = *transfer;
+
+		while (t.final_block == 0 &&
+			t.next_block <= t.acked_block + static_cast<U64>(t.window_size))
+		{
+			if (!rate_ready())
 			{
-				vector<Package> packages = pull_ack_packages(packet_number);
-				if (packages.size() > 0)
+				arm_pace();
+				break;
+			}
+
+			I32 size{ 0 };
+			if (t.deflating)
+			{
+				size_t taken{ 0 };
+				if (t.deflating->is_failed())
+				{
+					fail("Could not read from file " + t.command.file_name);
+					return;
+				}
+				if (!t.deflating->read(buffer, t.block_size, taken))
 				{
-					response = packages[0];
+					// The compressor fell behind, look again on the next tick
+					arm_pace();
 					break;
 				}
+				size = static_cast<I32>(taken);
+			}
+			else
+			{
+				Trace_scope read_trace(Trace_event::Disk_read);
+				t.in.read((char*)&buffer[0], t.block_size);
+				size = static_cast<I32>(t.in.gcount());
+				t.checksum.update(buffer, size);
+			}
+			t.total_size += size;
+
+			Tftp_packet& packet = t.window[t.next_block % t.window.size()];
+			packet = Create_data(static_cast<Word>(t.next_block), buffer, size);
+			if (size < t.block_size) t.final_block = t.next_block;
+
+			send_block(t.next_block, false);
+			++t.next_block;
+		}
+		send_batch();
+	}
+
+	void on_put_response(const Package& response)
+	{
+		Tftp_transfer& t = *transfer;
+		Tftp_operation op = response.packet.get_op();
 
-				std::this_thread::sleep_for(
-					std::chrono::milliseconds(Tftp_quant_ms));
-				quant_time += Tftp_quant_ms;
+		if (!t.negotiated)
+		{
+			bool ack_zero = op == Tftp_operation::Ack &&
+				response.packet.size() >= 4 &&
+				response.packet.get_word(2) == 0;
+			if (op != Tftp_operation::Oack && !ack_zero)
+			{
+				++t.stats.unexpected;
+				return;
 			}
-			if (quant_time < Tftp_timeout_ms) // Answer received
+			if (!negotiate(response)) return;
+
+			t.attempts = Tftp_ack_attempts;
+			t.window.assign(t.window_size, Tftp_packet());
+			t.sent_at.assign(t.window_size, 0);
+			t.congestion.reset(t.window_size);
+			fill_window();
+			arm_put_retransmit();
+			return;
+		}
+		if (op != Tftp_operation::Ack || response.packet.size() < 4)
+		{
+			++t.stats.unexpected;
+			return;
+		}
+
+		U64 block = Unwrap_block(response.packet.get_word(2), t.acked_block);
+		if (block < t.acked_block || block >= t.next_block)
+		{
+			++t.stats.unexpected;
+			return;
+		}
+		if (block == t.acked_block)
+		{
+			/*
+			 * Duplicate ACK: never resend on it in lockstep mode (Sorcerer's
+			 * Apprentice), in windowed mode it reports a lost block, resend once
+			 */
+			++t.stats.duplicates;
+			if (t.window_size > 1 && !t.recovery_sent)
 			{
-				if (last_size < Tftp_packet_data_size)
-				{
-					Log("File of size " + std::to_string(total_size) + " bytes transmitted");
-					return true;
-				}
+				++t.stats.fast_retransmits;
+				t.recovery_sent = true;
+				t.congestion.on_loss();
+				update_pacing();
+				send_window(t.acked_block + 1);
+				arm_retransmit();
+			}
+			return;
+		}
 
-				attempts = Tftp_ack_attempts;
+		Time sent_us = t.sent_at[block % t.window.size()];
+		if (sent_us != 0) sample_rtt(sent_us, response.received_us);
+		t.congestion.on_ack(block - t.acked_block);
+		update_pacing();
+		t.acked_block = block;
+		t.attempts = Tftp_ack_attempts;
+		t.recovery_sent = false;
 
-				in.read((char*)&buffer[0], Tftp_packet_data_size);
+		if (t.final_block != 0 && block == t.final_block)
+		{
+			if (t.deflating)
+			{
+				Log("Deflated into " + std::to_string(t.total_size) + " bytes sent");
+				t.total_size = t.deflating->raw_size();
+				t.checksum = t.deflating->checksum();
+			}
+			Log("File of size " + std::to_string(t.total_size) + " bytes transmitted, crc32c " +
+				To_checksum_string(t.checksum.value()));
+			complete();
+			return;
+		}
+		if (block + 1 < t.next_block)
+		{
+			// Partial window acknowledged, the receiver lost block + 1
+			++t.stats.fast_retransmits;
+			t.recovery_sent = true;
+			t.congestion.on_loss();
+			update_pacing();
+			send_window(block + 1);
+		}
+		fill_window();
+		arm_put_retransmit();
+	}
 
-				last_size = static_cast<I32>(in.gcount());
-				++packet_number;
-				request = { response.address, Create_data(packet_number, buffer, last_size) };
+	void dispatch_packages()
+	{
+		pull_packages(pulled);
+		if (!transfer)
+		{
+			// remove old data
+			pulled.clear();
+			return;
+		}
 
-				total_size += last_size;
-								
+		Tftp_transfer& t = *transfer;
+		bool get = t.command.type != Tftp_command::Type::Send_file;
+		for (auto& package : pulled)
+		{
+			if (t.state != Tftp_transfer::State::Active) break;
+			if (verbose) Log("Pulled package " + To_string(package->packet));
+			++t.stats.received;
+			Time now_us = Now_us();
+			t.stats.queue_delay.record(now_us > package->received_us ? now_us - package->received_us : 0);
+
+			// Late packages of the previous transfer must not be taken as the answer
+			if ((t.negotiated && package->address != t.peer) ||
+				(!t.negotiated && package->address == previous_peer))
+			{
+				++t.stats.unexpected;
+				send_package(package->address, Create_error(To_word(Tftp_error::Error_5), "Unknown transfer ID"));
+				continue;
 			}
-			else
+			if (package->packet.size() < 2)
+			{
+				++t.stats.unexpected;
+				continue;
+			}
+			if (package->packet.get_op() == Tftp_operation::Error)
 			{
-				--attempts;
-				Log("Timeout passed, resending package: " + To_string(request));
+				const Tftp_packet& packet = package->packet;
+				string reason = packet.size() >= 4 ?
+					To_string(static_cast<Tftp_error>(packet.get_word(2))) : "malformed error";
+				if (packet.size() > 5) reason += ": " + packet.get_string(4, packet.size() - 5);
+				fail("Server error, " + reason);
+				break;
 			}
 
+			t.last_activity = Now_ms();
+			if (get) on_get_response(*package);
+			else on_put_response(*package);
+		}
+		pulled.clear();
+	}
+
+	void on_timer(U64 timer_cookie)
+	{
+		if (!transfer || transfer->id != (timer_cookie >> 2)) return;
+		if (transfer->state != Tftp_transfer::State::Active) return;
 
+		Tftp_transfer& t = *transfer;
+		auto timer = static_cast<Tftp_timer>(timer_cookie & 3);
+		Trace(Trace_event::Timer_fire, static_cast<U64>(timer));
+		if (timer == Tftp_timer::Retransmit)
+		{
+			t.retransmit_timer = Timer_wheel::No_timer;
+			// Backoff retries below the full timeout do not count as attempts
+			if (t.rto_ms >= Tftp_timeout_ms && --t.attempts <= 0)
+			{
+				t.unreachable = true;
+				fail("No response after " + std::to_string(Tftp_ack_attempts) + " attempts");
+				return;
+			}
+			t.rto_ms = std::min(t.rto_ms * 2, Tftp_timeout_ms);
+			++t.stats.timeouts;
+			t.recovery_sent = false;
+			if (t.negotiated && t.command.type == Tftp_command::Type::Send_file)
+			{
+				Log("Timeout passed, resending window from block " + std::to_string(t.acked_block + 1));
+				t.congestion.on_timeout();
+				update_pacing();
+				send_window(t.acked_block + 1);
+			}
+			else
+			{
+				Log("Timeout passed, resending package: " + To_string(t.request));
+				if (t.negotiated && t.tuned)
+				{
+					t.congestion.on_timeout();
+					update_pacing();
+				}
+				t.ack_sent_at = 0;
+				send_package(t.request);
+			}
+			arm_retransmit();
 		}
-		return false;
+		else if (timer == Tftp_timer::Pace)
+		{
+			t.pace_timer = Timer_wheel::No_timer;
+			if (t.command.type == Tftp_command::Type::Send_file)
+			{
+				fill_window();
+				arm_put_retransmit();
+			}
+			else if (t.deferred_ack != 0)
+			{
+				if (!rate_ready())
+				{
+					arm_pace();
+					return;
+				}
+				send_ack(t.deferred_ack);
+				t.deferred_ack = 0;
+			}
+		}
+		else if (timer == Tftp_timer::Idle)
+		{
+			t.idle_timer = Timer_wheel::No_timer;
+			if (Now_ms() - t.last_activity >= Tftp_idle_ms)
+			{
+				t.unreachable = true;
+				fail("Transfer idle for " + std::to_string(Tftp_idle_ms) + " ms, expiring");
+				return;
+			}
+			// Activity since arming, push the deadline instead of rearming per package
+			arm_idle();
+		}
+	}
+
+	void finish_transfer()
+	{
+		if (!transfer || transfer->state == Tftp_transfer::State::Active) return;
+
+		timers.cancel(transfer->retransmit_timer);
+		timers.cancel(transfer->idle_timer);
+		timers.cancel(transfer->pace_timer);
+		transfer->stats.srtt_us = transfer->rtt.srtt_us();
+		transfer->stats.window = transfer->command.type == Tftp_command::Type::Send_file || transfer->tuned ?
+			transfer->congestion.window() : transfer->window_size;
+		transfer->stats.block_size = transfer->block_size;
+		transfer->stats.path_mtu = transfer->path_mtu;
+		tune_path();
+		if (transfer->command.type != Tftp_command::Type::Get_size)
+		{
+			Log("Transfer stats: " + To_string(transfer->stats));
+		}
+		bool succeeded = transfer->state == Tftp_transfer::State::Succeeded;
+		if (transfer->recording)
+		{
+			if (succeeded) Remove_resume_record(transfer->command.destination_name);
+			else if (!transfer->restarting) save_progress();
+		}
+		if (transfer->restarting)
+		{
+			requeue(transfer->command);
+			transfer.reset();
+			return;
+		}
+		if (succeeded && !transfer->cache_key.empty())
+		{
+			transfer->out.close();
+			cache.store(transfer->cache_key, transfer->command.destination_name,
+				transfer->total_size, transfer->checksum.value());
+		}
+		if (transfer->negotiated) previous_peer = transfer->peer;
+		if (succeeded) servers.mark_ok(server_address);
+		if (!succeeded && transfer->unreachable && fail_over(transfer->command))
+		{
+			transfer.reset();
+			return;
+		}
+		if (!succeeded)
+		{
+			Err("Failed to execute command: " + To_string(transfer->command));
+		}
+		if (transfer->command.done) transfer->command.done(transfer->command, succeeded, transfer->total_size);
+		transfer.reset();
+	}
+
+	/*
+	 *	The server stopped answering, the command is retried first thing
+	 *	on the next mirror in line, each mirror is tried once
+	 */
+	bool fail_over(Tftp_command command)
+	{
+		servers.mark_failed(server_address);
+		vector<Address> ranking = servers.ranking(server_address.family());
+		if (command.failovers + 1 >= ranking.size()) return false;
+
+		auto next = std::find(ranking.begin(), ranking.end(), server_address);
+		server_address = next == ranking.end() || next + 1 == ranking.end() ? ranking.front() : *(next + 1);
+		++command.failovers;
+		Log("Server not responding, failing over to " + To_string(server_address));
+		requeue(command);
+		return true;
+	}
+
+	/*
+	 *	Runs command again before any other
+	 */
+	void requeue(const Tftp_command& command)
+	{
+		Mutex_guard gate_out(commands_mutex);
+
+		commands.insert(commands.begin(), command);
+		ordered.store(true, std::memory_order_release);
+	}
+
+	/*
+	 *	Moves to the fastest healthy mirror before a new command when
+	 *	the current one is known to be down
+	 */
+	void choose_server()
+	{
+		if (servers.is_healthy(server_address)) return;
+		vector<Address> ranking = servers.ranking(server_address.family());
+		if (ranking.empty() || !servers.is_healthy(ranking.front())) return;
+		server_address = ranking.front();
+		Log("Using server " + To_string(server_address));
 	}
 
 	bool execute(const Tftp_command& command)
 	{
 		// remove old data
-		pull_packages();
+		pull_packages(pulled);
+		pulled.clear();
+		if (command.failovers == 0) choose_server();
 		
 		if (command.type == Tftp_command::Type::Get_file)
 		{
-			return execute_get(command.file_name, command.destination_name);
+			return execute_get(command);
 		}
 		else if (command.type == Tftp_command::Type::Send_file)
 		{
-			return execute_put(command.file_name, command.destination_name);
+			return execute_put(command);
+		}
+		else if (command.type == Tftp_command::Type::Get_size)
+		{
+			return execute_size(command);
 		}
 		else if (command.type == Tftp_command::Type::Quit)
 		{
@@ -405,77 +1964,181 @@ private:
 		return false;
 	}
 
+	/*
+	 *	Event loop: one transfer is active at a time as all of them share
+	 *	the client socket, timeouts are driven by the timer wheel
+	 */
 	void execute_thread()
 	{
+		Trace_thread("execute");
 		while (running)
 		{
-			std::this_thread::sleep_for(
-				std::chrono::milliseconds(Tftp_quant_ms));
+			wait_for_events();
 
-			vector<Tftp_command> commands_copy;
-			{
-				Mutex_guard gate_in(commands_mutex);
-
-				commands_copy = commands;
-				commands.clear();
-			}
-			for (auto& command : commands_copy)
+			Tftp_command command;
+			if (!transfer && pop_command(command))
 			{
 				if (!execute(command))
 				{
 					Err("Failed to execute command: " + To_string(command));
+					if (command.done) command.done(command, false, 0);
 				}
 			}
+
+			dispatch_packages();
+			timers.advance(Now_ms(), [this](U64 timer_cookie) { on_timer(timer_cookie); });
+			finish_transfer();
 		}
 	}
 
 	void listen_thread()
 	{
+		Trace_thread("listen");
 		while (running)
 		{
-			Address from;
-			Package package;
-			bool good = receive_package(package);
+			if (!receiving)
+			{
+				receiving = package_pool.acquire();
+				if (!receiving)
+				{
+					// Queue is full, let the datagram wait in the socket buffer
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					continue;
+				}
+			}
+			if (coalescing)
+			{
+				auto receive = [this](bool wait) { return receive_coalesced(wait); };
+				if (!(busy_poll_us > 0 ? spin_receive(receive) : receive(true))) break;
+				queue_coalesced();
+				continue;
+			}
+
+			auto receive = [this](bool wait) { return receive_package(*receiving, wait); };
+			bool good = busy_poll_us > 0 ? spin_receive(receive) : receive(true);
 			if (!good) break;
+			Trace(Trace_event::Package_received, receiving->packet.size());
+			if (capture.is_open()) capture.received(socket_descriptor, receiving->address, receiving->packet);
 
 			{
+				Trace_scope lock_trace(Trace_event::Lock);
 				Mutex_guard gate_out(packages_mutex);
+				lock_trace.close();
 
-				Log("Received package " + To_string(package.packet));
+				if (verbose) Log("Received package " + To_string(receiving->packet));
 
-				packages.push_back(package);
+				packages.push_back(std::move(receiving));
+				queued.store(true, std::memory_order_release);
+				Trace(Trace_event::Package_queued, packages.size());
 			}
+			events.notify_one();
 		}
 
 		terminate();
 	}
 
-	bool receive_package(Package& out)
+	/*
+	 *	Without wait, fails with errno EAGAIN when nothing is queued
+	 */
+	bool receive_package(Package& out, bool wait)
 	{
-		out.packet.clear();
-		sockaddr_in addr = { 0 };
-		U32 addr_size = sizeof(addr);
+		size_t segment_size{ 0 };
+		U64 received_ns{ 0 };
+		ssize_t received = Receive_segments(socket_descriptor, out.packet.raw_data(),
+			sizeof(Byte) * Tftp_packet::capacity(), wait ? 0 : MSG_DONTWAIT,
+			out.address, segment_size, received_ns);
+		if (received <= 0) return false;
+		out.received_us = Arrival_us(received_ns);
 
-		vector<Byte> data;
-		data.resize(Tftp_packet_datagram_size);
-		ssize_t received = recvfrom(
-			socket_descriptor,
-			&data[0],
-			sizeof(Byte) * Tftp_packet_datagram_size,
-			0,
-			(sockaddr*)&addr,
-			&addr_size);
+		return out.packet.resize(static_cast<I32>(received));
+	}
 
+	/*
+	 *	Receives a run of datagrams coalesced by the kernel (or a single
+	 *	one) into the coalescing buffer
+	 */
+	bool receive_coalesced(bool wait)
+	{
+		U64 received_ns{ 0 };
+		ssize_t received = Receive_segments(socket_descriptor, coalesced.data(), coalesced.size(),
+			wait ? 0 : MSG_DONTWAIT, coalesced_from, coalesced_segment, received_ns);
 		if (received <= 0) return false;
+		coalesced_size = static_cast<size_t>(received);
+		coalesced_us = Arrival_us(received_ns);
+		return true;
+	}
+
+	/*
+	 *	Cuts the coalescing buffer into packages and queues them at once,
+	 *	datagrams beyond the pool are dropped like those of a full queue
+	 */
+	void queue_coalesced()
+	{
+		Trace(Trace_event::Package_received, coalesced_size);
+		for (size_t offset = 0; offset < coalesced_size; offset += coalesced_segment)
+		{
+			I32 size = static_cast<I32>(std::min(coalesced_segment, coalesced_size - offset));
+			Package_ptr package = package_pool.acquire();
+			if (!package) break;
+			if (!package->packet.resize(size)) continue;
+			memcpy(package->packet.raw_data(), coalesced.data() + offset, size);
+			package->address = coalesced_from;
+			package->received_us = coalesced_us;
+			if (capture.is_open()) capture.received(socket_descriptor, package->address, package->packet);
+			split.push_back(std::move(package));
+		}
+		if (split.empty()) return;
 
-		bool good = out.packet.add(data.data(), static_cast<I32>(received), false);
-		if (!good) return false;
+		{
+			Trace_scope lock_trace(Trace_event::Lock);
+			Mutex_guard gate_out(packages_mutex);
+			lock_trace.close();
 
-		out.address.ip = inet_ntop(AF_INET, &addr.sin_addr, (char*)&data[0], INET_ADDRSTRLEN);
-		out.address.port = ntohs(addr.sin_port);
-		return true;
+			for (auto& package : split)
+			{
+				if (verbose) Log("Received package " + To_string(package->packet));
+				packages.push_back(std::move(package));
+			}
+			queued.store(true, std::memory_order_release);
+			Trace(Trace_event::Package_queued, packages.size());
+		}
+		split.clear();
+		events.notify_one();
 	}
 
+	/*
+	 *	Arrival on the Now_us clock, kernel stamps are wall clock time so
+	 *	only their age carries over
+	 */
+	static Time Arrival_us(U64 received_ns)
+	{
+		Time now_us = Now_us();
+		if (received_ns == 0) return now_us;
+
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		U64 now_ns = static_cast<U64>(now.tv_sec) * 1000000000 + static_cast<U64>(now.tv_nsec);
+		Time age_us = now_ns > received_ns ? (now_ns - received_ns) / 1000 : 0;
+		return now_us - std::min(now_us, age_us);
+	}
+
+	/*
+	 *	Retries non-blocking receives for up to the spin budget, then
+	 *	blocks in the kernel until the next package
+	 */
+	template <typename Receive>
+	bool spin_receive(Receive receive)
+	{
+		Time until_us = Now_us() + busy_poll_us;
+		while (running)
+		{
+			if (receive(false)) return true;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+			if (Now_us() >= until_us) return receive(true);
+			Spin_pause();
+		}
+		return false;
+	}
 
 	void terminate()
 	{
@@ -483,20 +2146,65 @@ private:
 		shutdown(socket_descriptor, 2);
 		close(socket_descriptor);
 		running = false;
+		events.notify_all();
 	}
 
-	bool running{ false };
-
-	Tftp_mode mode{ Tftp_mode::Netascii };
+	std::atomic<bool> running{ false };
+	std::atomic<bool> verbose{ true };
+
+	// Settings are written by the command thread while the execute
+	// thread reads them, the shared bucket follows total_rate_limit
+	// on the execute thread
+	std::atomic<Tftp_mode> mode{ Tftp_mode::Netascii };
+	std::atomic<I32> window_size{ 1 };
+	std::atomic<I32> block_size{ Tftp_packet_data_size };
+	std::atomic<bool> tuning{ false };
+	std::unordered_map<string, Path_tuning> tunings;
+	std::atomic<U64> rate_limit{ 0 };
+	std::atomic<U64> total_rate_limit{ 0 };
+	Token_bucket total_rate;
 
 	Address server_address;
+	Server_list servers;
+	Address previous_peer;
 	Socket socket_descriptor{ 0 };
-
-	vector<Package> packages;
+	Packet_capture capture;
+	Content_cache cache;
+	bool replaying{ false };
+	vector<Tftp_packet> replay_sent;
+
+	// Pools are declared first so they outlive everything they hand out
+	Package_pool package_pool{ Tftp_package_pool_size };
+	Pool<Tftp_transfer> transfer_pool{ Tftp_transfer_pool_size };
+
+	vector<Package_ptr> packages;
+	std::atomic<bool> queued{ false };
+	std::atomic<bool> ordered{ false };
+	std::atomic<Time> busy_poll_us{ 0 };
+	std::atomic<bool> offload{ false };
+	std::atomic<bool> compress{ false };
+	std::atomic<bool> resume{ false };
+	std::atomic<bool> coalescing{ false };
+	vector<Byte> coalesced = vector<Byte>(Udp_gro_buffer_size);
+	size_t coalesced_size{ 0 };
+	size_t coalesced_segment{ 0 };
+	Address coalesced_from;
+	Time coalesced_us{ 0 };
+	vector<Package_ptr> split;
 	Mutex packages_mutex;
+	Condition events;
 	vector<Tftp_command> commands;
 	Mutex commands_mutex;
 
+	Package_ptr receiving;
+	vector<Package_ptr> pulled;
+
+	Timer_wheel timers;
+	Pool<Tftp_transfer>::Pointer transfer;
+	Datagram_batch batch;
+	vector<const Tftp_packet*> batched;
+	U64 transfer_counter{ 0 };
+
 
 };
 
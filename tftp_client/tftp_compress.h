@@ -0,0 +1,275 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_checksum.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <zlib.h>
+
+namespace tftp
+{
+
+/*
+ *	Compression extension: "compress" requested with the algorithm in
+ *	RRQ / WRQ and echoed in the OACK when the peer takes it, DATA then
+ *	carries the compressed stream. Peers which ignore the option send
+ *	and expect plain octets. Only octet transfers are compressed.
+ */
+const string Tftp_option_compress = "compress";
+const string Tftp_compress_deflate = "deflate";
+
+constexpr size_t Tftp_compress_chunk_bytes = 64 * 1024;
+constexpr size_t Tftp_compress_buffered_max = 1 << 20;
+constexpr I32 Tftp_compress_level = 6;
+
+/*
+ *	Streaming deflate / inflate (zlib format), appends its output
+ */
+class Deflate_stream
+{
+public:
+	explicit Deflate_stream(bool inflate)
+		: inflating(inflate)
+	{
+		good = (inflating ? inflateInit(&stream) : deflateInit(&stream, Tftp_compress_level)) == Z_OK;
+	}
+	~Deflate_stream()
+	{
+		if (inflating) inflateEnd(&stream);
+		else deflateEnd(&stream);
+	}
+	Deflate_stream(const Deflate_stream& other) = delete;
+
+	/*
+	 *	finish flushes everything still held back (deflate) or checks
+	 *	the stream really ended (inflate). Returns false on corrupt input.
+	 */
+	bool update(const Byte* data, size_t size, vector<Byte>& out, bool finish)
+	{
+		if (!good) return false;
+		stream.next_in = const_cast<Byte*>(data);
+		stream.avail_in = static_cast<uInt>(size);
+		Byte chunk[16 * 1024];
+		while (true)
+		{
+			stream.next_out = chunk;
+			stream.avail_out = sizeof(chunk);
+			I32 result = inflating ? inflate(&stream, Z_NO_FLUSH) : deflate(&stream, finish ? Z_FINISH : Z_NO_FLUSH);
+			out.insert(out.end(), chunk, chunk + (sizeof(chunk) - stream.avail_out));
+
+			if (result == Z_STREAM_END)
+			{
+				ended = true;
+				return !inflating || stream.avail_in == 0;
+			}
+			if (result != Z_OK && result != Z_BUF_ERROR)
+			{
+				good = false;
+				return false;
+			}
+			if (stream.avail_out != 0 && stream.avail_in == 0) break;
+		}
+		return !finish || !inflating || ended;
+	}
+
+	bool is_ended() const { return ended; }
+
+private:
+	z_stream stream{};
+	bool inflating;
+	bool good{ false };
+	bool ended{ false };
+};
+
+/*
+ *	Deflates a file on a thread of its own ahead of the sender, which
+ *	takes the compressed stream block by block without ever waiting
+ *	for the compressor. At most Tftp_compress_buffered_max bytes are
+ *	held ahead of the sender.
+ */
+class Deflate_reader
+{
+public:
+	Deflate_reader() = default;
+	~Deflate_reader()
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			stopping = true;
+		}
+		condition.notify_one();
+		if (worker.joinable()) worker.join();
+	}
+	Deflate_reader(const Deflate_reader& other) = delete;
+
+	bool open(const string& file_name)
+	{
+		in.open(file_name, std::ifstream::binary);
+		if (!in.good()) return false;
+		worker = Thread([this]() { run(); });
+		return true;
+	}
+
+	/*
+	 *	Copies size bytes of the compressed stream, fewer only at its
+	 *	end. Returns false while they are not ready yet.
+	 */
+	bool read(Byte* out, size_t size, size_t& taken)
+	{
+		{
+			std::lock_guard<std::mutex> gate_in(mutex);
+
+			size_t available = buffered.size() - offset;
+			if (available < size && !finished) return false;
+			taken = std::min(size, available);
+			memcpy(out, buffered.data() + offset, taken);
+			offset += taken;
+			if (offset < buffered.size() / 2) return true;
+			buffered.erase(buffered.begin(), buffered.begin() + offset);
+			offset = 0;
+		}
+		condition.notify_one();
+		return true;
+	}
+
+	bool is_failed() const { return failed; }
+	/*
+	 *	Of the file as read, valid once the whole stream was taken
+	 */
+	Crc32c checksum() const { return raw_checksum; }
+	U64 raw_size() const { return raw_bytes; }
+
+private:
+	void run()
+	{
+		Deflate_stream deflater(false);
+		vector<Byte> raw(Tftp_compress_chunk_bytes);
+		vector<Byte> compressed;
+		bool last = false;
+		while (!last)
+		{
+			in.read(reinterpret_cast<char*>(raw.data()), raw.size());
+			size_t size = static_cast<size_t>(in.gcount());
+			last = size < raw.size();
+			if (in.bad())
+			{
+				failed = true;
+				last = true;
+			}
+			raw_checksum.update(raw.data(), size);
+			raw_bytes += size;
+
+			compressed.clear();
+			if (!deflater.update(raw.data(), size, compressed, last)) failed = true;
+
+			std::unique_lock<std::mutex> gate_out(mutex);
+			condition.wait(gate_out, [this]() { return stopping || buffered.size() - offset < Tftp_compress_buffered_max; });
+			if (stopping) return;
+			buffered.insert(buffered.end(), compressed.begin(), compressed.end());
+			finished = last;
+		}
+	}
+
+	std::ifstream in;
+	std::mutex mutex;
+	std::condition_variable condition;
+	vector<Byte> buffered;
+	size_t offset{ 0 };
+	bool finished{ false };
+	bool stopping{ false };
+	std::atomic<bool> failed{ false };
+	Crc32c raw_checksum;
+	U64 raw_bytes{ 0 };
+	Thread worker;
+};
+
+/*
+ *	Inflates a received stream into a file on a thread of its own, the
+ *	receiver hands over blocks without waiting for the decompressor
+ */
+class Inflate_writer
+{
+public:
+	explicit Inflate_writer(std::ofstream out)
+		: out(std::move(out))
+	{
+		worker = Thread([this]() { run(); });
+	}
+	~Inflate_writer() { close(); }
+	Inflate_writer(const Inflate_writer& other) = delete;
+
+	void write(const Byte* data, size_t size)
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			pending.insert(pending.end(), data, data + size);
+		}
+		condition.notify_one();
+	}
+
+	/*
+	 *	Waits for the rest of the stream to be written, false when it was
+	 *	corrupt, incomplete or could not be written
+	 */
+	bool close()
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			closing = true;
+		}
+		condition.notify_one();
+		if (worker.joinable()) worker.join();
+		return good;
+	}
+
+	/*
+	 *	Of the inflated data, valid after close
+	 */
+	Crc32c checksum() const { return raw_checksum; }
+	U64 raw_size() const { return raw_bytes; }
+
+private:
+	void run()
+	{
+		Deflate_stream inflater(true);
+		vector<Byte> taken;
+		vector<Byte> raw;
+		bool last = false;
+		while (!last)
+		{
+			{
+				std::unique_lock<std::mutex> gate_in(mutex);
+				condition.wait(gate_in, [this]() { return closing || !pending.empty(); });
+				std::swap(taken, pending);
+				last = closing;
+			}
+
+			raw.clear();
+			if (good && !inflater.update(taken.data(), taken.size(), raw, last)) good = false;
+			taken.clear();
+			raw_checksum.update(raw.data(), raw.size());
+			raw_bytes += raw.size();
+			out.write(reinterpret_cast<const char*>(raw.data()), raw.size());
+		}
+		out.flush();
+		if (!out.good()) good = false;
+	}
+
+	std::ofstream out;
+	std::mutex mutex;
+	std::condition_variable condition;
+	vector<Byte> pending;
+	bool closing{ false };
+	bool good{ true };
+	Crc32c raw_checksum;
+	U64 raw_bytes{ 0 };
+	Thread worker;
+};
+
+}
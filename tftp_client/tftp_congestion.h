@@ -0,0 +1,261 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_timer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace tftp
+{
+
+constexpr Time Tftp_rto_min_ms = 20;
+constexpr Time Tftp_rto_initial_ms = 1000;
+
+/*
+ *	Smoothed round trip time and retransmission timeout (RFC 6298),
+ *	samples must come from blocks which were not retransmitted (Karn)
+ */
+class Rtt_estimator
+{
+public:
+	void sample(Time rtt_us)
+	{
+		double rtt = static_cast<double>(rtt_us);
+		if (!valid)
+		{
+			srtt = rtt;
+			rttvar = rtt / 2;
+			valid = true;
+			return;
+		}
+		rttvar = 0.75 * rttvar + 0.25 * std::abs(srtt - rtt);
+		srtt = 0.875 * srtt + 0.125 * rtt;
+	}
+
+	Time rto_ms(Time max_ms) const
+	{
+		if (!valid) return std::min(Tftp_rto_initial_ms, max_ms);
+		Time rto = static_cast<Time>((srtt + std::max(1000.0, 4 * rttvar)) / 1000);
+		return std::min(std::max(rto, Tftp_rto_min_ms), max_ms);
+	}
+
+	bool has_sample() const { return valid; }
+	Time srtt_us() const { return static_cast<Time>(srtt); }
+
+private:
+	double srtt{ 0 };
+	double rttvar{ 0 };
+	bool valid{ false };
+};
+
+/*
+ *	Latency distribution in power of two microsecond buckets, bucket i
+ *	counts samples below 2^i us, so percentiles are upper bounds within
+ *	a factor of two and recording is a count leading zeros
+ */
+class Latency_histogram
+{
+public:
+	static constexpr size_t Buckets = 32;
+
+	void record(Time us)
+	{
+		size_t bucket = us == 0 ? 0 : static_cast<size_t>(64 - __builtin_clzll(us));
+		++counts[std::min(bucket, Buckets - 1)];
+		++total;
+	}
+
+	U64 count() const { return total; }
+
+	Time percentile(U32 percent) const
+	{
+		if (total == 0) return 0;
+		U64 rank = (total * percent + 99) / 100;
+		U64 seen = 0;
+		for (size_t i = 0; i < Buckets; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank) return Time{ 1 } << i;
+		}
+		return Time{ 1 } << (Buckets - 1);
+	}
+
+private:
+	U64 counts[Buckets]{};
+	U64 total{ 0 };
+};
+
+inline string To_string(const Latency_histogram& histogram)
+{
+	if (histogram.count() == 0) return "none";
+	return "p50 < " + std::to_string(histogram.percentile(50)) + " us, p99 < " +
+		std::to_string(histogram.percentile(99)) + " us";
+}
+
+/*
+ *	AIMD congestion window in blocks, bounded by the negotiated window.
+ *	Slow start grows it by a block per acknowledged block up to the
+ *	threshold, congestion avoidance by a block per round trip after
+ *	that. A detected loss halves it, a timeout drops it to one block.
+ *
+ *	RFC 7440 receivers only acknowledge complete windows, so the window
+ *	is enforced as a pacing rate of window blocks per round trip rather
+ *	than by keeping fewer blocks in flight.
+ */
+class Congestion_window
+{
+public:
+	explicit Congestion_window(I32 max_window = 1)
+	{
+		reset(max_window);
+	}
+
+	void reset(I32 new_max_window)
+	{
+		max_window = std::max(1, new_max_window);
+		cwnd = std::min(2.0, static_cast<double>(max_window));
+		ssthresh = max_window;
+	}
+
+	/*
+	 *	Continues from a window learned earlier, in congestion avoidance
+	 */
+	void restart(I32 window)
+	{
+		cwnd = std::min(static_cast<double>(max_window), static_cast<double>(std::max(1, window)));
+		ssthresh = cwnd;
+	}
+
+	I32 window() const
+	{
+		return std::min(max_window, std::max(1, static_cast<I32>(cwnd)));
+	}
+
+	void on_ack(U64 blocks)
+	{
+		for (U64 i = 0; i < blocks; ++i)
+		{
+			if (cwnd < ssthresh) cwnd += 1.0;
+			else cwnd += 1.0 / cwnd;
+		}
+		cwnd = std::min(cwnd, static_cast<double>(max_window));
+	}
+
+	void on_loss()
+	{
+		ssthresh = std::max(1.0, cwnd / 2);
+		cwnd = ssthresh;
+	}
+
+	/*
+	 *	Round trips grew with the window, back off by a quarter
+	 */
+	void on_delay()
+	{
+		cwnd = std::max(1.0, cwnd * 3 / 4);
+		ssthresh = cwnd;
+	}
+
+	void on_timeout()
+	{
+		ssthresh = std::max(1.0, cwnd / 2);
+		cwnd = 1.0;
+	}
+
+	/*
+	 *	Bytes per second to pace at, 0 when the full window may be sent
+	 */
+	U64 pacing_rate(const Rtt_estimator& rtt, I32 block_bytes) const
+	{
+		if (window() >= max_window || !rtt.has_sample()) return 0;
+		Time srtt_us = std::max<Time>(rtt.srtt_us(), 1);
+		return std::max<U64>(1, static_cast<U64>(cwnd * block_bytes * 1000000.0 / srtt_us));
+	}
+
+private:
+	I32 max_window{ 1 };
+	double cwnd{ 1.0 };
+	double ssthresh{ 1.0 };
+};
+
+/*
+ *	Bandwidth cap in bytes per second, a rate of 0 disables it.
+ *	Tokens may go negative so blocks are never split, the debt
+ *	delays whatever is sent next instead.
+ */
+class Token_bucket
+{
+public:
+	Token_bucket(U64 rate = 0, U64 burst = 0)
+	{
+		set_rate(rate, burst);
+	}
+
+	void set_rate(U64 new_rate, U64 new_burst = 0)
+	{
+		rate = new_rate;
+		burst = static_cast<double>(new_burst > 0 ? new_burst : std::max<U64>(new_rate / 10, 4 * Tftp_packet_data_size));
+		tokens = burst;
+		last_us = Now_us();
+	}
+
+	/*
+	 *	Changes the rate keeping the tokens (or debt) accumulated so far
+	 */
+	void update_rate(U64 new_rate, U64 new_burst, Time now_us)
+	{
+		if (!limited())
+		{
+			set_rate(new_rate, new_burst);
+			return;
+		}
+		refill(now_us);
+		rate = new_rate;
+		burst = static_cast<double>(new_burst);
+		tokens = std::min(tokens, burst);
+	}
+
+	bool limited() const { return rate > 0; }
+	U64 get_rate() const { return rate; }
+
+	bool ready(Time now_us)
+	{
+		if (!limited()) return true;
+		refill(now_us);
+		return tokens >= 0;
+	}
+
+	void consume(U64 bytes, Time now_us)
+	{
+		if (!limited()) return;
+		refill(now_us);
+		tokens -= static_cast<double>(bytes);
+	}
+
+	/*
+	 *	Time at which the bucket is out of debt again
+	 */
+	Time ready_at_us(Time now_us)
+	{
+		if (!limited()) return now_us;
+		refill(now_us);
+		if (tokens >= 0) return now_us;
+		return now_us + static_cast<Time>(-tokens * 1000000.0 / rate) + 1;
+	}
+
+private:
+	void refill(Time now_us)
+	{
+		if (now_us <= last_us) return;
+		tokens = std::min(burst, tokens + (now_us - last_us) * static_cast<double>(rate) / 1000000.0);
+		last_us = now_us;
+	}
+
+	U64 rate{ 0 };
+	double burst{ 0 };
+	double tokens{ 0 };
+	Time last_us{ 0 };
+};
+
+}
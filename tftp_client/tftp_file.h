@@ -0,0 +1,696 @@
+#pragma once
+
+#include "common.h"
+#include "tftp_compress.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tftp
+{
+
+/*
+ *	A file name taken relative to a root: a leading slash, empty and
+ *	"." components are dropped, a ".." component or a backslash makes
+ *	it refused since it could lead out of the root
+ */
+inline bool Relative_name(const string& file_name, string& relative)
+{
+	relative.clear();
+	if (file_name.find('\\') != string::npos) return false;
+	for (auto& component : Split(file_name, '/'))
+	{
+		if (component == "..") return false;
+		if (component.empty() || component == ".") continue;
+		if (!relative.empty()) relative += '/';
+		relative += component;
+	}
+	return !relative.empty();
+}
+
+/*
+ *	Read only mapping of a served file. DATA blocks are sliced straight
+ *	out of the mapping into the datagram, so file contents are never
+ *	copied in user space, and one mapping is shared by every session
+ *	reading the same file.
+ *
+ *	Files must be replaced by rename rather than rewritten in place
+ *	while they are served, the old mapping stays valid until its last
+ *	session ends. A file rewritten in place is sent as it is on disk
+ *	block by block, a mix of old and new contents. One truncated makes
+ *	sends from past its new end fail, see is_truncated.
+ */
+class Mapped_file
+{
+public:
+	~Mapped_file()
+	{
+		if (map) munmap(map, file_size);
+		if (descriptor >= 0) close(descriptor);
+	}
+	Mapped_file(const Mapped_file& other) = delete;
+
+	/*
+	 *	Returns an empty pointer and sets errno when the file cannot be
+	 *	served, EISDIR for anything but a regular file
+	 */
+	static std::shared_ptr<Mapped_file> Open(const string& path)
+	{
+		std::shared_ptr<Mapped_file> file(new Mapped_file());
+		file->descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (file->descriptor < 0) return nullptr;
+
+		struct stat status;
+		if (fstat(file->descriptor, &status) != 0) return nullptr;
+		if (!S_ISREG(status.st_mode))
+		{
+			errno = EISDIR;
+			return nullptr;
+		}
+		file->file_size = static_cast<size_t>(status.st_size);
+		file->inode = status.st_ino;
+		file->modified = status.st_mtim;
+
+		// Sessions read front to back, let the page cache read ahead aggressively
+		posix_fadvise(file->descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (file->file_size == 0) return file;
+
+		void* map = mmap(nullptr, file->file_size, PROT_READ, MAP_SHARED, file->descriptor, 0);
+		if (map == MAP_FAILED) return nullptr;
+		file->map = static_cast<Byte*>(map);
+		madvise(file->map, file->file_size, MADV_SEQUENTIAL);
+		return file;
+	}
+
+	const Byte* data() const { return map; }
+	size_t size() const { return file_size; }
+	I32 get_descriptor() const { return descriptor; }
+
+	/*
+	 *	Whether path still names the file that was mapped
+	 */
+	bool is_current(const string& path) const
+	{
+		struct stat status;
+		if (stat(path.c_str(), &status) != 0) return false;
+		return status.st_ino == inode &&
+			static_cast<size_t>(status.st_size) == file_size &&
+			status.st_mtim.tv_sec == modified.tv_sec &&
+			status.st_mtim.tv_nsec == modified.tv_nsec;
+	}
+
+	/*
+	 *	CRC32C of the contents mapped, read with pread on first use and
+	 *	kept. False when the file shrank meanwhile.
+	 */
+	bool checksum(U32& out)
+	{
+		if (!checksummed)
+		{
+			vector<Byte> buffer(Tftp_compress_chunk_bytes);
+			Crc32c crc;
+			for (size_t offset = 0; offset < file_size;)
+			{
+				size_t size = std::min(buffer.size(), file_size - offset);
+				if (pread(descriptor, buffer.data(), size, static_cast<off_t>(offset)) != static_cast<ssize_t>(size)) return false;
+				crc.update(buffer.data(), size);
+				offset += size;
+			}
+			crc32c = crc.value();
+			checksummed = true;
+		}
+		out = crc32c;
+		return true;
+	}
+
+	/*
+	 *	Whether the file shrank below the mapping since it was opened
+	 */
+	bool is_truncated() const
+	{
+		struct stat status;
+		return fstat(descriptor, &status) != 0 || static_cast<size_t>(status.st_size) < file_size;
+	}
+
+	/*
+	 *	Starts reading [offset, offset + length) into the page cache so
+	 *	sends do not stall on page faults
+	 */
+	void read_ahead(size_t offset, size_t length) const
+	{
+		if (!map || offset >= file_size) return;
+		size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		size_t begin = offset & ~(page - 1);
+		size_t end = std::min(file_size, offset + length);
+		madvise(map + begin, end - begin, MADV_WILLNEED);
+	}
+
+private:
+	Mapped_file() = default;
+
+	I32 descriptor{ -1 };
+	Byte* map{ nullptr };
+	size_t file_size{ 0 };
+	ino_t inode{ 0 };
+	timespec modified{};
+	bool checksummed{ false };
+	U32 crc32c{ 0 };
+};
+
+/*
+ *	How uploads reach stable storage before they replace the target
+ *	None		renamed as soon as received, lost on a crash before writeback
+ *	Batched		synced together with every upload finishing within a short window
+ *	Immediate	synced on its own as soon as it finished
+ */
+enum class Tftp_durability : I32
+{
+	None = 0,
+	Batched = 1,
+	Immediate = 2,
+};
+
+inline string To_string(Tftp_durability durability)
+{
+	switch (durability)
+	{
+	case Tftp_durability::None:
+		return "none";
+	case Tftp_durability::Batched:
+		return "batched";
+	case Tftp_durability::Immediate:
+		return "immediate";
+	}
+	return "";
+}
+
+constexpr Time Tftp_commit_batch_ms = 10;
+constexpr size_t Tftp_commit_batch_max = 256;
+constexpr size_t Tftp_upload_buffer_bytes = 64 * 1024;
+
+/*
+ *	File being uploaded. Data goes to a temporary file next to the
+ *	target in page aligned chunks of Tftp_upload_buffer_bytes, the
+ *	target only appears once the File_committer renames it, so an
+ *	aborted or crashed upload never leaves a partial file in place.
+ */
+class Upload_file
+{
+public:
+	Upload_file() = default;
+	~Upload_file() { abort(); }
+	Upload_file(const Upload_file& other) = delete;
+
+	/*
+	 *	Returns false and sets errno when the temporary file cannot be created
+	 */
+	bool open(const string& path)
+	{
+		size_t slash = path.rfind('/');
+		string directory = slash == string::npos ? "." : path.substr(0, slash);
+		string name = slash == string::npos ? path : path.substr(slash + 1);
+
+		final_path = path;
+		temp_path = directory + "/." + name + ".XXXXXX";
+		descriptor = mkostemp(&temp_path[0], O_CLOEXEC);
+		if (descriptor < 0) return false;
+		fchmod(descriptor, 0644);
+		buffer.reserve(Tftp_upload_buffer_bytes);
+		return true;
+	}
+
+	bool append(const Byte* data, size_t size)
+	{
+		while (size > 0)
+		{
+			size_t part = std::min(size, Tftp_upload_buffer_bytes - buffer.size());
+			buffer.insert(buffer.end(), data, data + part);
+			data += part;
+			size -= part;
+			if (buffer.size() == Tftp_upload_buffer_bytes && !flush()) return false;
+		}
+		return true;
+	}
+
+	bool flush()
+	{
+		const Byte* data = buffer.data();
+		size_t size = buffer.size();
+		while (size > 0)
+		{
+			ssize_t written = write(descriptor, data, size);
+			if (written < 0)
+			{
+				if (errno == EINTR) continue;
+				return false;
+			}
+			data += written;
+			size -= static_cast<size_t>(written);
+		}
+		buffer.clear();
+		return true;
+	}
+
+	/*
+	 *	Removes the temporary file unless it was handed to the committer
+	 */
+	void abort()
+	{
+		if (descriptor < 0) return;
+		close(descriptor);
+		unlink(temp_path.c_str());
+		descriptor = -1;
+	}
+
+	/*
+	 *	Gives up ownership of the descriptor for committing
+	 */
+	I32 release()
+	{
+		I32 result = descriptor;
+		descriptor = -1;
+		return result;
+	}
+
+	const string& get_temp_path() const { return temp_path; }
+	const string& get_final_path() const { return final_path; }
+
+private:
+	I32 descriptor{ -1 };
+	string temp_path;
+	string final_path;
+	vector<Byte> buffer;
+};
+
+/*
+ *	Finished uploads waiting for (or done with) their commit
+ */
+struct Commit
+{
+	U64 id{ 0 };
+	I32 descriptor{ -1 };
+	string temp_path;
+	string final_path;
+	/*
+	 *	The temporary file holds the deflated stream as received
+	 */
+	bool compressed{ false };
+	bool succeeded{ false };
+};
+
+/*
+ *	Syncs and renames finished uploads on a thread of its own so the
+ *	server loop never blocks on the disk. A batch first starts the
+ *	writeback of every file, then waits for each, renames them and
+ *	syncs every directory touched once, so uploads finishing together
+ *	share the cost of reaching the disk.
+ */
+class File_committer
+{
+public:
+	explicit File_committer(std::function<void()> on_done)
+		: on_done(std::move(on_done))
+	{}
+	~File_committer() { stop(); }
+	File_committer(const File_committer& other) = delete;
+
+	void start()
+	{
+		running = true;
+		worker = Thread([this]() { run(); });
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			running = false;
+		}
+		condition.notify_one();
+		if (worker.joinable()) worker.join();
+	}
+
+	Tftp_durability get_durability() const { return durability; }
+	void set_durability(Tftp_durability new_durability) { durability = new_durability; }
+
+	void submit(Commit commit)
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			pending.push_back(std::move(commit));
+		}
+		condition.notify_one();
+	}
+
+	/*
+	 *	Swaps the finished commits into result
+	 */
+	void take_done(vector<Commit>& result)
+	{
+		result.clear();
+		std::lock_guard<std::mutex> gate_in(mutex);
+
+		std::swap(result, done);
+	}
+
+private:
+	void run()
+	{
+		vector<Commit> batch;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> gate_in(mutex);
+				condition.wait(gate_in, [this]() { return !running || !pending.empty(); });
+				if (!running && pending.empty()) return;
+				if (running && durability == Tftp_durability::Batched)
+				{
+					condition.wait_for(gate_in, std::chrono::milliseconds(Tftp_commit_batch_ms),
+						[this]() { return !running || pending.size() >= Tftp_commit_batch_max; });
+				}
+				std::swap(batch, pending);
+			}
+
+			commit(batch);
+			{
+				std::lock_guard<std::mutex> gate_out(mutex);
+
+				std::move(batch.begin(), batch.end(), std::back_inserter(done));
+			}
+			batch.clear();
+			on_done();
+		}
+	}
+
+	/*
+	 *	Replaces the compressed temporary file by an inflated one
+	 */
+	static bool Inflate_upload(Commit& entry)
+	{
+		Upload_file inflated;
+		if (lseek(entry.descriptor, 0, SEEK_SET) != 0 || !inflated.open(entry.final_path)) return false;
+
+		Deflate_stream inflater(true);
+		vector<Byte> chunk(Tftp_compress_chunk_bytes);
+		vector<Byte> raw;
+		bool good = true;
+		while (good)
+		{
+			ssize_t size = read(entry.descriptor, chunk.data(), chunk.size());
+			if (size < 0 && errno == EINTR) continue;
+			if (size < 0) return false;
+			raw.clear();
+			good = inflater.update(chunk.data(), static_cast<size_t>(size), raw, size == 0) &&
+				inflated.append(raw.data(), raw.size());
+			if (size == 0) break;
+		}
+		if (!good || !inflated.flush()) return false;
+
+		close(entry.descriptor);
+		unlink(entry.temp_path.c_str());
+		entry.temp_path = inflated.get_temp_path();
+		entry.descriptor = inflated.release();
+		return true;
+	}
+
+	void commit(vector<Commit>& batch)
+	{
+		for (auto& entry : batch)
+		{
+			entry.succeeded = !entry.compressed || Inflate_upload(entry);
+		}
+
+		bool sync = durability != Tftp_durability::None;
+		if (sync)
+		{
+			for (auto& entry : batch) sync_file_range(entry.descriptor, 0, 0, SYNC_FILE_RANGE_WRITE);
+		}
+
+		std::set<string> directories;
+		for (auto& entry : batch)
+		{
+			if (entry.succeeded) entry.succeeded = !sync || fdatasync(entry.descriptor) == 0;
+			if (entry.succeeded) entry.succeeded = rename(entry.temp_path.c_str(), entry.final_path.c_str()) == 0;
+			if (!entry.succeeded) unlink(entry.temp_path.c_str());
+			close(entry.descriptor);
+			entry.descriptor = -1;
+
+			size_t slash = entry.final_path.rfind('/');
+			if (entry.succeeded && sync) directories.insert(slash == string::npos ? "." : entry.final_path.substr(0, slash));
+		}
+
+		// The renames themselves are only durable once their directories are
+		for (auto& directory : directories)
+		{
+			I32 descriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (descriptor < 0) continue;
+			fsync(descriptor);
+			close(descriptor);
+		}
+	}
+
+	std::function<void()> on_done;
+	std::mutex mutex;
+	std::condition_variable condition;
+	vector<Commit> pending;
+	vector<Commit> done;
+	std::atomic<Tftp_durability> durability{ Tftp_durability::Batched };
+	bool running{ false };
+	Thread worker;
+};
+
+/*
+ *	Deflated stream of a served file for one session. The compressor
+ *	reads the file with pread, never through the mapping, so a file
+ *	truncated meanwhile fails the stream instead of faulting the
+ *	server. It stays at most Tftp_compress_buffered_max bytes ahead of
+ *	what the client acknowledged, the rest of the window is kept for
+ *	retransmits.
+ */
+class Compressed_stream
+{
+public:
+	explicit Compressed_stream(std::shared_ptr<Mapped_file> source)
+		: source(std::move(source))
+	{}
+	Compressed_stream(const Compressed_stream& other) = delete;
+
+	/*
+	 *	Copies [offset, offset + size) of the stream, fewer bytes only at
+	 *	its end. Returns false while they are not ready yet.
+	 */
+	bool copy(U64 offset, size_t size, Byte* out, size_t& taken)
+	{
+		std::lock_guard<std::mutex> gate_in(mutex);
+
+		U64 end = base + buffered.size();
+		if (offset < base || (end < offset + size && !finished))
+		{
+			starved = true;
+			return false;
+		}
+		taken = offset < end ? static_cast<size_t>(std::min<U64>(size, end - offset)) : 0;
+		memcpy(out, buffered.data() + (offset - base), taken);
+		return true;
+	}
+
+	/*
+	 *	Drops the stream before offset, the client has it. Returns true
+	 *	when that makes room for the compressor to go on.
+	 */
+	bool release(U64 offset)
+	{
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		if (offset <= released) return false;
+		bool full = is_full();
+		released = offset;
+		if (released - base >= buffered.size() / 2)
+		{
+			size_t dropped = static_cast<size_t>(std::min<U64>(released - base, buffered.size()));
+			buffered.erase(buffered.begin(), buffered.begin() + dropped);
+			base += dropped;
+		}
+		return full && !is_full();
+	}
+
+	bool is_failed() const
+	{
+		std::lock_guard<std::mutex> gate_in(mutex);
+
+		return failed;
+	}
+
+	/*
+	 *	Compressor side: deflates the next chunk of the file unless the
+	 *	stream is done or far enough ahead. Sets wanted when the server
+	 *	was waiting for it.
+	 */
+	bool advance(bool& wanted)
+	{
+		{
+			std::lock_guard<std::mutex> gate_in(mutex);
+
+			if (finished || failed || is_full()) return false;
+		}
+
+		size_t size = static_cast<size_t>(std::min<U64>(raw.size(), source->size() - read_offset));
+		ssize_t got = size > 0 ? pread(source->get_descriptor(), raw.data(), size, static_cast<off_t>(read_offset)) : 0;
+		// Only the size mapped is sent, as tsize announced
+		bool good = got == static_cast<ssize_t>(size);
+		read_offset += size;
+		bool last = read_offset >= source->size();
+		compressed.clear();
+		if (good) good = deflater.update(raw.data(), size, compressed, last);
+
+		std::lock_guard<std::mutex> gate_out(mutex);
+
+		buffered.insert(buffered.end(), compressed.begin(), compressed.end());
+		failed = !good;
+		finished = last;
+		wanted = starved;
+		starved = false;
+		return true;
+	}
+
+	bool is_done() const
+	{
+		std::lock_guard<std::mutex> gate_in(mutex);
+
+		return finished || failed;
+	}
+
+private:
+	bool is_full() const { return base + buffered.size() - std::max(base, released) >= Tftp_compress_buffered_max; }
+
+	std::shared_ptr<Mapped_file> source;
+	mutable std::mutex mutex;
+	// Stream from offset base on, released and before are not needed any more
+	vector<Byte> buffered;
+	U64 base{ 0 };
+	U64 released{ 0 };
+	bool finished{ false };
+	bool failed{ false };
+	bool starved{ false };
+
+	// Used by the compressor thread only
+	Deflate_stream deflater{ false };
+	vector<Byte> raw = vector<Byte>(Tftp_compress_chunk_bytes);
+	vector<Byte> compressed;
+	U64 read_offset{ 0 };
+};
+
+/*
+ *	Deflates the streams of every session asking for compression on a
+ *	thread of its own, a chunk of each in turn, so the server loop never
+ *	waits for zlib. Wakes the server when a stream it was waiting for
+ *	moved on.
+ */
+class File_compressor
+{
+public:
+	explicit File_compressor(std::function<void()> on_ready)
+		: on_ready(std::move(on_ready))
+	{}
+	~File_compressor() { stop(); }
+	File_compressor(const File_compressor& other) = delete;
+
+	void start()
+	{
+		running = true;
+		worker = Thread([this]() { run(); });
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			running = false;
+		}
+		condition.notify_one();
+		if (worker.joinable()) worker.join();
+	}
+
+	/*
+	 *	The stream is dropped once its session let go of it
+	 */
+	void add(const std::shared_ptr<Compressed_stream>& stream)
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			added.push_back(stream);
+			signaled = true;
+		}
+		condition.notify_one();
+	}
+
+	/*
+	 *	A stream made room, see Compressed_stream::release
+	 */
+	void poke()
+	{
+		{
+			std::lock_guard<std::mutex> gate_out(mutex);
+
+			signaled = true;
+		}
+		condition.notify_one();
+	}
+
+private:
+	void run()
+	{
+		vector<std::weak_ptr<Compressed_stream>> streams;
+		bool progressed = false;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> gate_in(mutex);
+				if (!progressed) condition.wait(gate_in, [this]() { return !running || signaled; });
+				if (!running) return;
+				signaled = false;
+				std::move(added.begin(), added.end(), std::back_inserter(streams));
+				added.clear();
+			}
+
+			progressed = false;
+			bool wanted = false;
+			for (auto it = streams.begin(); it != streams.end();)
+			{
+				auto stream = it->lock();
+				if (!stream || stream->is_done())
+				{
+					it = streams.erase(it);
+					continue;
+				}
+				bool waited = false;
+				if (stream->advance(waited)) progressed = true;
+				wanted = wanted || waited;
+				++it;
+			}
+			if (wanted) on_ready();
+		}
+	}
+
+	std::function<void()> on_ready;
+	std::mutex mutex;
+	std::condition_variable condition;
+	vector<std::weak_ptr<Compressed_stream>> added;
+	bool signaled{ false };
+	bool running{ false };
+	Thread worker;
+};
+
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "common.h"
+#include "tftp_file.h"
+#include "tftp_timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+namespace tftp
+{
+
+/*
+ *	Directories are listed by up to this many threads while the index
+ *	is built, a tree on a slow or network disk is mostly latency
+ */
+constexpr size_t Tftp_index_scan_threads_max = 8;
+constexpr size_t Tftp_index_event_buffer = 64 * 1024;
+constexpr U32 Tftp_index_watch_events = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+	IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+struct Index_stats
+{
+	std::atomic<U64> files{ 0 };
+	std::atomic<U64> directories{ 0 };
+	std::atomic<U64> events{ 0 };
+	std::atomic<U64> rebuilds{ 0 };
+	std::atomic<U64> build_ms{ 0 };
+};
+
+inline string To_string(const Index_stats& stats)
+{
+	return "files " + std::to_string(stats.files) +
+		", directories " + std::to_string(stats.directories) +
+		", events " + std::to_string(stats.events) +
+		", rebuilds " + std::to_string(stats.rebuilds) +
+		", built in " + std::to_string(stats.build_ms) + " ms";
+}
+
+/*
+ *	A served file as last seen on disk, with the mapping its sessions
+ *	share while one is open
+ */
+struct Index_entry
+{
+	U64 size{ 0 };
+	ino_t inode{ 0 };
+	timespec modified{};
+	std::weak_ptr<Mapped_file> mapped;
+	// Of this version of the file, kept once a client asked for it
+	bool checksummed{ false };
+	U32 checksum{ 0 };
+};
+
+/*
+ *	Every regular file below the served root, keyed by its path
+ *	relative to the root. A request is a single hash probe: no path
+ *	walk, no stat, and tsize is known before the file is opened.
+ *
+ *	The tree is listed once at start by several threads, afterwards
+ *	inotify watches on every directory keep the index current. Events
+ *	are read by the server thread from its poll loop, which is also
+ *	the only thread looking files up, so nothing is locked. A file
+ *	whose entry changed loses its mapping, the next request maps the
+ *	new contents. Symbolic links to files are indexed as their target,
+ *	links to directories are not followed.
+ *
+ *	When the watches cannot be set up (fs.inotify.max_user_watches
+ *	reached, no inotify) the index stays inactive and the server
+ *	resolves names on the filesystem as before. A lost event queue
+ *	(IN_Q_OVERFLOW) lists the tree again.
+ */
+class File_index
+{
+public:
+	File_index() = default;
+	~File_index() { close(); }
+	File_index(const File_index& other) = delete;
+
+	bool build(const string& root_directory)
+	{
+		close();
+		root = root_directory;
+		descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (descriptor < 0) return false;
+
+		Time started = Now_ms();
+		if (!scan())
+		{
+			close();
+			return false;
+		}
+		stats.build_ms = Now_ms() - started;
+		count();
+		return true;
+	}
+
+	void close()
+	{
+		if (descriptor >= 0) ::close(descriptor);
+		descriptor = -1;
+		entries.clear();
+		directories.clear();
+		count();
+	}
+
+	bool is_active() const { return descriptor >= 0; }
+	/*
+	 *	Polled by the server, readable when events are waiting
+	 */
+	I32 get_descriptor() const { return descriptor; }
+
+	/*
+	 *	Null when no regular file has that relative path
+	 */
+	Index_entry* find(const string& relative)
+	{
+		auto found = entries.find(relative);
+		return found == entries.end() ? nullptr : &found->second;
+	}
+	const Index_entry* find(const string& relative) const
+	{
+		auto found = entries.find(relative);
+		return found == entries.end() ? nullptr : &found->second;
+	}
+
+	/*
+	 *	Applies every event waiting, lists the tree again when the
+	 *	kernel dropped some
+	 */
+	void update()
+	{
+		if (descriptor < 0) return;
+		alignas(inotify_event) char buffer[Tftp_index_event_buffer];
+		bool overflowed = false;
+		while (true)
+		{
+			ssize_t length = read(descriptor, buffer, sizeof(buffer));
+			if (length <= 0) break;
+			for (char* at = buffer; at < buffer + length;)
+			{
+				auto event = reinterpret_cast<const inotify_event*>(at);
+				if (event->mask & IN_Q_OVERFLOW) overflowed = true;
+				else handle(*event);
+				at += sizeof(inotify_event) + event->len;
+			}
+		}
+		if (overflowed)
+		{
+			Log("Index events were lost, listing " + root + " again");
+			++stats.rebuilds;
+			string root_directory = root;
+			if (!build(root_directory)) Err("Could not index " + root_directory + ", serving without an index");
+		}
+		count();
+	}
+
+	const Index_stats& get_stats() const { return stats; }
+
+private:
+	/*
+	 *	One directory listed: its watch, the files in it and the
+	 *	directories below it
+	 */
+	struct Listing
+	{
+		I32 watch{ -1 };
+		string relative;
+		vector<std::pair<string, Index_entry>> files;
+		vector<string> subdirectories;
+	};
+
+	static string Join(const string& directory, const string& name)
+	{
+		return directory.empty() ? name : directory + "/" + name;
+	}
+
+	static Index_entry To_entry(const struct stat& status)
+	{
+		Index_entry entry;
+		entry.size = static_cast<U64>(status.st_size);
+		entry.inode = status.st_ino;
+		entry.modified = status.st_mtim;
+		return entry;
+	}
+
+	string full_path(const string& relative) const
+	{
+		return relative.empty() ? root : root + "/" + relative;
+	}
+
+	/*
+	 *	The watch goes on before the directory is read, so a file
+	 *	created meanwhile is either listed or reported
+	 */
+	bool list(const string& relative, Listing& listing) const
+	{
+		listing.relative = relative;
+		string path = full_path(relative);
+		listing.watch = inotify_add_watch(descriptor, path.c_str(), Tftp_index_watch_events);
+		if (listing.watch < 0) return errno == ENOENT || errno == ENOTDIR;
+
+		DIR* directory = opendir(path.c_str());
+		if (!directory) return true;
+		I32 directory_descriptor = dirfd(directory);
+		while (dirent* found = readdir(directory))
+		{
+			string name = found->d_name;
+			if (name == "." || name == "..") continue;
+			if (found->d_type == DT_DIR)
+			{
+				listing.subdirectories.push_back(Join(relative, name));
+				continue;
+			}
+
+			struct stat status;
+			if (fstatat(directory_descriptor, name.c_str(), &status, 0) != 0) continue;
+			if (S_ISREG(status.st_mode)) listing.files.emplace_back(Join(relative, name), To_entry(status));
+			else if (S_ISDIR(status.st_mode) && found->d_type == DT_UNKNOWN) listing.subdirectories.push_back(Join(relative, name));
+		}
+		closedir(directory);
+		return true;
+	}
+
+	void add(Listing& listing)
+	{
+		if (listing.watch < 0) return;
+		directories[listing.watch] = listing.relative;
+		for (auto& file : listing.files) entries[file.first] = std::move(file.second);
+	}
+
+	/*
+	 *	Workers take directories off a shared list and put back the
+	 *	ones found below, the listings are merged once all are done
+	 */
+	bool scan()
+	{
+		std::mutex mutex;
+		std::condition_variable condition;
+		vector<string> pending{ "" };
+		vector<Listing> listed;
+		size_t busy = 0;
+		bool failed = false;
+
+		auto work = [&]()
+		{
+			std::unique_lock<std::mutex> gate_out(mutex);
+			while (true)
+			{
+				condition.wait(gate_out, [&]() { return failed || !pending.empty() || busy == 0; });
+				if (failed || pending.empty()) break;
+				string relative = std::move(pending.back());
+				pending.pop_back();
+				++busy;
+				gate_out.unlock();
+
+				Listing listing;
+				bool good = list(relative, listing);
+
+				gate_out.lock();
+				--busy;
+				if (!good) failed = true;
+				pending.insert(pending.end(), listing.subdirectories.begin(), listing.subdirectories.end());
+				listed.push_back(std::move(listing));
+				condition.notify_all();
+			}
+			condition.notify_all();
+		};
+
+		size_t threads = std::max<size_t>(1, std::min<size_t>(Tftp_index_scan_threads_max, std::thread::hardware_concurrency()));
+		vector<Thread> workers;
+		for (size_t i = 1; i < threads; ++i) workers.emplace_back(work);
+		work();
+		for (auto& worker : workers) worker.join();
+		if (failed) return false;
+
+		for (auto& listing : listed) add(listing);
+		return true;
+	}
+
+	/*
+	 *	A directory created or moved in below the root, listed on the
+	 *	server thread since it is small next to the whole tree
+	 */
+	void add_tree(const string& relative)
+	{
+		vector<string> pending{ relative };
+		while (!pending.empty())
+		{
+			Listing listing;
+			bool good = list(pending.back(), listing);
+			pending.pop_back();
+			if (!good)
+			{
+				Err("Could not watch " + full_path(listing.relative) + ", files below it are not served");
+				continue;
+			}
+			pending.insert(pending.end(), listing.subdirectories.begin(), listing.subdirectories.end());
+			add(listing);
+		}
+	}
+
+	void remove_tree(const string& relative)
+	{
+		string prefix = relative + "/";
+		for (auto it = entries.begin(); it != entries.end();)
+		{
+			if (it->first.compare(0, prefix.size(), prefix) == 0) it = entries.erase(it);
+			else ++it;
+		}
+		for (auto it = directories.begin(); it != directories.end();)
+		{
+			if (it->second == relative || it->second.compare(0, prefix.size(), prefix) == 0)
+			{
+				inotify_rm_watch(descriptor, it->first);
+				it = directories.erase(it);
+			}
+			else ++it;
+		}
+	}
+
+	/*
+	 *	Keeps the entry, and the mapping with it, when the file is
+	 *	still the same
+	 */
+	void refresh(const string& relative)
+	{
+		struct stat status;
+		if (stat(full_path(relative).c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+		{
+			entries.erase(relative);
+			return;
+		}
+		Index_entry& entry = entries[relative];
+		if (entry.inode == status.st_ino &&
+			entry.size == static_cast<U64>(status.st_size) &&
+			entry.modified.tv_sec == status.st_mtim.tv_sec &&
+			entry.modified.tv_nsec == status.st_mtim.tv_nsec) return;
+		entry = To_entry(status);
+	}
+
+	void handle(const inotify_event& event)
+	{
+		auto directory = directories.find(event.wd);
+		if (directory == directories.end()) return;
+		if (event.mask & IN_IGNORED)
+		{
+			directories.erase(directory);
+			return;
+		}
+		// Events on the watched directory itself are covered by its parent
+		if (event.len == 0) return;
+
+		++stats.events;
+		string relative = Join(directory->second, event.name);
+		if (event.mask & IN_ISDIR)
+		{
+			if (event.mask & (IN_DELETE | IN_MOVED_FROM)) remove_tree(relative);
+			else if (event.mask & (IN_CREATE | IN_MOVED_TO)) add_tree(relative);
+			return;
+		}
+		if (event.mask & (IN_DELETE | IN_MOVED_FROM)) entries.erase(relative);
+		else refresh(relative);
+	}
+
+	void count()
+	{
+		stats.files = entries.size();
+		stats.directories = directories.size();
+	}
+
+	string root;
+	I32 descriptor{ -1 };
+	std::unordered_map<string, Index_entry> entries;
+	// Watch descriptor to the directory it watches, relative to the root
+	std::unordered_map<I32, string> directories;
+	Index_stats stats;
+};
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "tftp_client.h"
+#include "tftp_server.h"
+#include "tftp_bench.h"
+
+#include <stdlib.h>
+
+namespace tftp
+{
+
+constexpr I32 Bench_latency_gets = 2000;
+constexpr I32 Bench_latency_warmup = 100;
+constexpr size_t Bench_latency_file_bytes = 300;
+constexpr Time Bench_latency_spin_us = 1000;
+
+struct Latency_result
+{
+	string name;
+	U64 operations{ 0 };
+	U64 failed{ 0 };
+	Time p50_us{ 0 };
+	Time p99_us{ 0 };
+	Time max_us{ 0 };
+};
+
+inline string To_string(const Latency_result& result)
+{
+	return result.name + ": p50 " + std::to_string(result.p50_us) + " us, p99 " +
+		std::to_string(result.p99_us) + " us, max " + std::to_string(result.max_us) + " us (" +
+		std::to_string(result.operations) + " gets, " + std::to_string(result.failed) + " failed)";
+}
+
+/*
+ *	Gets the file one at a time, timing each from order to completion
+ */
+inline Latency_result Bench_get_latency(Tftp_client& client, const string& name, const string& file_name, I32 gets)
+{
+	Latency_result result;
+	result.name = name;
+	vector<Time> latencies;
+	latencies.reserve(gets);
+	std::mutex mutex;
+	std::condition_variable condition;
+	I32 finished{ 0 };
+	bool succeeded{ false };
+
+	for (I32 i = 0; i < gets; ++i)
+	{
+		Tftp_command command;
+		command.type = Tftp_command::Type::Get_file;
+		command.file_name = file_name;
+		command.destination_name = "/dev/null";
+		command.done = [&](const Tftp_command&, bool good, U64)
+		{
+			{
+				std::lock_guard<std::mutex> gate_out(mutex);
+
+				succeeded = good;
+				++finished;
+			}
+			condition.notify_one();
+		};
+
+		Time start = Now_us();
+		client.order(command);
+		std::unique_lock<std::mutex> gate_in(mutex);
+		condition.wait(gate_in, [&]() { return finished > i; });
+		latencies.push_back(Now_us() - start);
+		if (!succeeded) ++result.failed;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	result.operations = latencies.size();
+	if (latencies.empty()) return result;
+	result.p50_us = latencies[(latencies.size() - 1) / 2];
+	result.p99_us = latencies[(latencies.size() - 1) * 99 / 100];
+	result.max_us = latencies.back();
+	return result;
+}
+
+/*
+ *	Small gets over loopback from an in-process server, with the client
+ *	blocking in the kernel and then busy polling. Loopback has no NAPI
+ *	to poll, so the difference comes from the spinning threads alone.
+ */
+inline void Run_latency_benchmark()
+{
+	char root[] = "/tmp/tftp-latency.XXXXXX";
+	if (!mkdtemp(root))
+	{
+		Err("Could not create a directory to serve");
+		return;
+	}
+	const string file_name = "config";
+	const string path = string(root) + "/" + file_name;
+	{
+		std::ofstream out(path, std::ofstream::binary);
+		out << string(Bench_latency_file_bytes, 'c');
+	}
+
+	vector<Latency_result> results;
+	{
+		Tftp_server server;
+		if (!server.start(root, 0)) return;
+		Thread server_thread([&server]() { server.run(); });
+
+		Address address;
+		Resolve("127.0.0.1", server.get_port(), address);
+		Tftp_client client;
+		client.set_verbose(false);
+		client.set_mode(Tftp_mode::Octet);
+
+		// The client logs every transfer, keep it out of the measurement
+		std::streambuf* log = std::clog.rdbuf(nullptr);
+		if (client.connect_to_server(address))
+		{
+			Thread client_thread([&client]() { client.run_daemon(); });
+
+			Bench_get_latency(client, "warmup", file_name, Bench_latency_warmup);
+			results.push_back(Bench_get_latency(client, "get latency blocking", file_name, Bench_latency_gets));
+			client.set_busy_poll(Bench_latency_spin_us);
+			Bench_get_latency(client, "warmup", file_name, Bench_latency_warmup);
+			results.push_back(Bench_get_latency(client, "get latency busy poll " +
+				std::to_string(Bench_latency_spin_us) + " us", file_name, Bench_latency_gets));
+
+			Tftp_command quit;
+			quit.type = Tftp_command::Type::Quit;
+			client.order(quit);
+			client_thread.join();
+		}
+		std::clog.clear();
+		std::clog.rdbuf(log);
+
+		server.stop();
+		server_thread.join();
+	}
+	unlink(path.c_str());
+	rmdir(root);
+
+	for (auto& result : results) Log(To_string(result));
+}
+
+}
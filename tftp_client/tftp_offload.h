@@ -0,0 +1,208 @@
+#pragma once
+
+#include "tftp_address.h"
+
+#include <atomic>
+#include <netinet/udp.h>
+#include <sys/uio.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace tftp
+{
+
+/*
+ *	UDP segmentation offload (Linux 4.18) and receive coalescing (5.0).
+ *	A window of equally sized DATA datagrams to one peer goes down the
+ *	stack as one buffer and is cut into datagrams by the kernel or the
+ *	NIC, datagrams arriving back to back are handed up as one buffer
+ *	with the size they have to be cut at.
+ */
+constexpr size_t Udp_gso_segments_max = 64;
+// The segmented buffer must fit a single UDP datagram
+constexpr size_t Udp_gso_bytes_max = 65507;
+constexpr size_t Udp_gro_buffer_size = 65536;
+
+/*
+ *	Cleared for good by the first send the kernel refuses to segment
+ */
+inline std::atomic<bool>& Udp_gso_supported()
+{
+	static std::atomic<bool> supported{ true };
+	return supported;
+}
+
+/*
+ *	Returns false when the kernel does not coalesce for this socket
+ */
+inline bool Enable_udp_gro(I32 socket, bool enable)
+{
+	I32 value = enable ? 1 : 0;
+	return setsockopt(socket, IPPROTO_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+/*
+ *	Datagrams to one peer collected for a single send, each made of
+ *	up to two parts (header and payload) which must outlive send()
+ */
+class Datagram_batch
+{
+public:
+	Datagram_batch()
+	{
+		parts.reserve(2 * Udp_gso_segments_max);
+		sizes.reserve(Udp_gso_segments_max);
+	}
+	Datagram_batch(const Datagram_batch& other) = delete;
+
+	bool empty() const { return sizes.empty(); }
+	/*
+	 *	Full once another datagram the size of the first might not fit
+	 */
+	bool full() const
+	{
+		return sizes.size() >= Udp_gso_segments_max || (!sizes.empty() && bytes + sizes[0] > Udp_gso_bytes_max);
+	}
+	size_t size() const { return sizes.size(); }
+
+	void add(const void* header, size_t header_size, const void* payload = nullptr, size_t payload_size = 0)
+	{
+		parts.push_back({ const_cast<void*>(header), header_size });
+		if (payload_size > 0) parts.push_back({ const_cast<void*>(payload), payload_size });
+		sizes.push_back(header_size + payload_size);
+		bytes += header_size + payload_size;
+		counts.push_back(payload_size > 0 ? 2 : 1);
+	}
+
+	/*
+	 *	Segments the batch in one sendmsg when offload is wanted and the
+	 *	datagrams allow it (all the size of the first, the last may be
+	 *	shorter), sends them one by one otherwise. Returns the number of
+	 *	datagrams handed to the kernel, the batch is emptied either way.
+	 */
+	size_t send(I32 socket, const Address& to, bool offload)
+	{
+		size_t sent = 0;
+		if (offload && sizes.size() > 1 && Udp_gso_supported().load(std::memory_order_relaxed) && segmentable())
+		{
+			if (send_segmented(socket, to)) sent = sizes.size();
+			else if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+			{
+				// Segmentation unavailable for good, fall back below
+				Udp_gso_supported().store(false, std::memory_order_relaxed);
+			}
+		}
+		if (sent == 0) sent = send_each(socket, to);
+		clear();
+		return sent;
+	}
+
+	void clear()
+	{
+		parts.clear();
+		sizes.clear();
+		counts.clear();
+		bytes = 0;
+	}
+
+private:
+	bool segmentable() const
+	{
+		for (size_t i = 1; i + 1 < sizes.size(); ++i)
+		{
+			if (sizes[i] != sizes[0]) return false;
+		}
+		return sizes.back() <= sizes[0];
+	}
+
+	bool send_segmented(I32 socket, const Address& to)
+	{
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(U16))] = {};
+		msghdr message{};
+		message.msg_name = const_cast<sockaddr*>(to.data());
+		message.msg_namelen = to.length;
+		message.msg_iov = parts.data();
+		message.msg_iovlen = parts.size();
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_UDP;
+		header->cmsg_type = UDP_SEGMENT;
+		header->cmsg_len = CMSG_LEN(sizeof(U16));
+		U16 segment = static_cast<U16>(sizes[0]);
+		memcpy(CMSG_DATA(header), &segment, sizeof(segment));
+		return sendmsg(socket, &message, 0) >= 0;
+	}
+
+	size_t send_each(I32 socket, const Address& to)
+	{
+		size_t sent = 0;
+		size_t part = 0;
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			msghdr message{};
+			message.msg_name = const_cast<sockaddr*>(to.data());
+			message.msg_namelen = to.length;
+			message.msg_iov = &parts[part];
+			message.msg_iovlen = counts[i];
+			part += counts[i];
+			if (sendmsg(socket, &message, 0) >= 0) ++sent;
+		}
+		return sent;
+	}
+
+	vector<iovec> parts;
+	vector<size_t> sizes;
+	vector<size_t> counts;
+	size_t bytes{ 0 };
+};
+
+/*
+ *	Receives one datagram or a coalesced run of them. segment_size is
+ *	the size to cut the buffer at, the whole size when not coalesced.
+ *	received_ns is the kernel arrival stamp (CLOCK_REALTIME) or 0.
+ */
+inline ssize_t Receive_segments(I32 socket, Byte* buffer, size_t capacity, I32 flags,
+	Address& from, size_t& segment_size, U64& received_ns)
+{
+	iovec part{ buffer, capacity };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(I32)) + CMSG_SPACE(sizeof(timespec))];
+	msghdr message{};
+	message.msg_name = from.data();
+	message.msg_namelen = sizeof(from.storage);
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(socket, &message, flags);
+	if (received <= 0) return received;
+	from.length = message.msg_namelen;
+	segment_size = static_cast<size_t>(received);
+	received_ns = 0;
+
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+		{
+			I32 size;
+			memcpy(&size, CMSG_DATA(header), sizeof(size));
+			if (size > 0) segment_size = static_cast<size_t>(size);
+		}
+		else if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			timespec stamp;
+			memcpy(&stamp, CMSG_DATA(header), sizeof(stamp));
+			received_ns = static_cast<U64>(stamp.tv_sec) * 1000000000 + static_cast<U64>(stamp.tv_nsec);
+		}
+	}
+	return received;
+}
+
+}
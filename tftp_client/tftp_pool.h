@@ -0,0 +1,205 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <assert.h>
+
+namespace tftp
+{
+
+constexpr size_t Pool_slab_objects = 64;
+constexpr I32 Pool_cache_size = 32;
+
+/*
+ *	Fixed size object pool
+ *
+ *	Objects live in slabs allocated on demand up to max_objects, freed
+ *	slots go to an intrusive free list and are never returned to the heap,
+ *	so memory is bounded and steady state performs no allocations.
+ *
+ *	Every thread keeps a small cache of free slots for the first pool of
+ *	a type it uses, moving them to and from the shared free list
+ *	in batches. Pools must outlive the threads which acquire from them.
+ */
+template<typename T>
+class Pool
+{
+public:
+	struct Deleter
+	{
+		Pool* pool{ nullptr };
+
+		void operator()(T* object) const
+		{
+			pool->release(object);
+		}
+	};
+
+	using Pointer = std::unique_ptr<T, Deleter>;
+
+	Pool(size_t max_objects, size_t slab_objects = Pool_slab_objects)
+		: max_objects(max_objects), slab_objects(slab_objects)
+	{
+		assert(max_objects > 0 && slab_objects > 0);
+		slabs.reserve((max_objects + slab_objects - 1) / slab_objects);
+		Lock gate(mutex);
+		grow();
+	}
+	~Pool()
+	{
+		assert(in_use == 0);
+		Cache& cache = thread_cache();
+		if (cache.owner == this)
+		{
+			cache.owner = nullptr;
+			cache.count = 0;
+		}
+	}
+	Pool(const Pool& other) = delete;
+
+	/*
+	 *	Returns an empty pointer when the pool is exhausted
+	 */
+	template<typename... Args>
+	Pointer acquire(Args&&... args)
+	{
+		Slot* slot = take();
+		if (!slot) return Pointer(nullptr, Deleter{ this });
+
+		++in_use;
+		T* object = new (slot->storage) T(std::forward<Args>(args)...);
+		return Pointer(object, Deleter{ this });
+	}
+
+	size_t size() const { return in_use; }
+	size_t capacity() const { return allocated; }
+	size_t max_size() const { return max_objects; }
+
+private:
+	union Slot
+	{
+		Slot* next;
+		alignas(T) Byte storage[sizeof(T)];
+	};
+
+	struct Cache
+	{
+		Pool* owner{ nullptr };
+		Slot* slots[Pool_cache_size];
+		I32 count{ 0 };
+
+		~Cache()
+		{
+			if (owner) owner->flush(*this, count);
+		}
+	};
+
+	using Lock = std::lock_guard<std::mutex>;
+
+	static Cache& thread_cache()
+	{
+		static thread_local Cache cache;
+		return cache;
+	}
+
+	Slot* take()
+	{
+		Cache& cache = thread_cache();
+		if (cache.owner == nullptr) cache.owner = this;
+		if (cache.owner != this)
+		{
+			Lock gate(mutex);
+			return pop();
+		}
+
+		if (cache.count == 0)
+		{
+			Lock gate(mutex);
+			while (cache.count < Pool_cache_size / 2)
+			{
+				Slot* slot = pop();
+				if (!slot) break;
+				cache.slots[cache.count++] = slot;
+			}
+		}
+		if (cache.count == 0) return nullptr;
+		return cache.slots[--cache.count];
+	}
+
+	void release(T* object)
+	{
+		object->~T();
+		--in_use;
+
+		Slot* slot = reinterpret_cast<Slot*>(object);
+		Cache& cache = thread_cache();
+		if (cache.owner == nullptr) cache.owner = this;
+		if (cache.owner != this)
+		{
+			Lock gate(mutex);
+			push(slot);
+			return;
+		}
+
+		if (cache.count == Pool_cache_size) flush(cache, Pool_cache_size / 2);
+		cache.slots[cache.count++] = slot;
+	}
+
+	void flush(Cache& cache, I32 slots)
+	{
+		Lock gate(mutex);
+		for (I32 i = 0; i < slots && cache.count > 0; ++i)
+		{
+			push(cache.slots[--cache.count]);
+		}
+	}
+
+	Slot* pop()
+	{
+		if (!free_list && !grow()) return nullptr;
+
+		Slot* slot = free_list;
+		free_list = slot->next;
+		return slot;
+	}
+
+	void push(Slot* slot)
+	{
+		slot->next = free_list;
+		free_list = slot;
+	}
+
+	bool grow()
+	{
+		if (allocated >= max_objects) return false;
+
+		size_t count = std::min(slab_objects, max_objects - allocated);
+		slabs.emplace_back(new Slot[count]);
+		Slot* slab = slabs.back().get();
+		for (size_t i = 0; i < count; ++i)
+		{
+			push(&slab[i]);
+		}
+		allocated += count;
+		return true;
+	}
+
+	size_t max_objects;
+	size_t slab_objects;
+	std::atomic<size_t> allocated{ 0 };
+	std::atomic<size_t> in_use{ 0 };
+
+	std::mutex mutex;
+	Slot* free_list{ nullptr };
+	vector<std::unique_ptr<Slot[]>> slabs;
+
+
+};
+
+}
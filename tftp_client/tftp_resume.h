@@ -0,0 +1,84 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_checksum.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace tftp
+{
+
+/*
+ *	Progress is recorded once this much more of a get is on disk
+ */
+constexpr U64 Tftp_resume_interval_bytes = 4 << 20;
+const string Tftp_resume_suffix = ".resume";
+
+/*
+ *	Durable progress of an interrupted get, kept next to the partial
+ *	file: what it is a part of (remote path and the size the server
+ *	reported) and how many bytes of it are on disk with their CRC32C
+ */
+struct Resume_record
+{
+	string remote_name;
+	U64 size{ 0 };
+	U64 offset{ 0 };
+	U32 checksum{ 0 };
+};
+
+inline string Resume_path(const string& file_name)
+{
+	return file_name + Tftp_resume_suffix;
+}
+
+inline bool Read_resume_record(const string& file_name, Resume_record& record)
+{
+	std::ifstream in(Resume_path(file_name));
+	string checksum;
+	if (!std::getline(in, record.remote_name) || !(in >> record.size >> record.offset >> checksum)) return false;
+	return record.offset <= record.size && Parse_checksum(checksum, record.checksum);
+}
+
+/*
+ *	Written aside and renamed, a crash leaves the old record or the new
+ */
+inline bool Write_resume_record(const string& file_name, const Resume_record& record)
+{
+	string path = Resume_path(file_name);
+	string temp_path = path + ".part";
+	{
+		std::ofstream out(temp_path, std::ofstream::trunc);
+		out << record.remote_name << "\n" << record.size << " " << record.offset << " " <<
+			To_checksum_string(record.checksum) << "\n";
+		if (!out.good()) return false;
+	}
+	if (rename(temp_path.c_str(), path.c_str()) != 0)
+	{
+		unlink(temp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+inline void Remove_resume_record(const string& file_name)
+{
+	unlink(Resume_path(file_name).c_str());
+}
+
+/*
+ *	Forces what was written to file_name to the disk, a record must
+ *	never claim bytes which a crash could still lose
+ */
+inline bool Sync_file(const string& file_name)
+{
+	I32 descriptor = open(file_name.c_str(), O_WRONLY);
+	if (descriptor < 0) return false;
+	bool good = fdatasync(descriptor) == 0;
+	close(descriptor);
+	return good;
+}
+
+}
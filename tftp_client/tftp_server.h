@@ -0,0 +1,1499 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_address.h"
+#include "tftp_timer.h"
+#include "tftp_pool.h"
+#include "tftp_file.h"
+#include "tftp_index.h"
+#include "tftp_trace.h"
+#include "tftp_offload.h"
+#include "tftp_congestion.h"
+
+#include <atomic>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace tftp
+{
+
+constexpr U16 Tftp_server_port = 69;
+constexpr Time Tftp_server_timeout_ms = 1000;
+constexpr I32 Tftp_server_attempts = 5;
+constexpr I32 Tftp_server_window_max = 64;
+constexpr size_t Tftp_server_session_pool_size = 1024;
+constexpr size_t Tftp_server_read_ahead_bytes = 1 << 20;
+constexpr Time Tftp_server_dally_ms = 2000;
+/*
+ *	Admission: sessions served at once and requests waiting for one.
+ *	A request waiting longer than a client waits for an answer is
+ *	turned away, one waiting half as long goes ahead of the others.
+ */
+constexpr size_t Tftp_server_active_default = 64;
+constexpr size_t Tftp_server_waiting_default = 512;
+constexpr Time Tftp_server_wait_max_ms = 4000;
+constexpr Time Tftp_server_wait_check_ms = 250;
+
+struct Tftp_server_stats
+{
+	std::atomic<U64> sessions{ 0 };
+	std::atomic<U64> completed{ 0 };
+	std::atomic<U64> failed{ 0 };
+	std::atomic<U64> rejected{ 0 };
+	std::atomic<U64> blocks{ 0 };
+	std::atomic<U64> retransmits{ 0 };
+	std::atomic<U64> bytes{ 0 };
+	std::atomic<U64> uploads{ 0 };
+	std::atomic<U64> bytes_received{ 0 };
+	std::atomic<U64> queued{ 0 };
+	std::atomic<U64> expired{ 0 };
+};
+
+inline string To_string(const Tftp_server_stats& stats)
+{
+	return "sessions " + std::to_string(stats.sessions) +
+		", completed " + std::to_string(stats.completed) +
+		", failed " + std::to_string(stats.failed) +
+		", rejected " + std::to_string(stats.rejected) +
+		", blocks " + std::to_string(stats.blocks) +
+		", retransmits " + std::to_string(stats.retransmits) +
+		", bytes " + std::to_string(stats.bytes) +
+		", uploads " + std::to_string(stats.uploads) +
+		", bytes received " + std::to_string(stats.bytes_received) +
+		", queued " + std::to_string(stats.queued) +
+		", expired " + std::to_string(stats.expired);
+}
+
+/*
+ *	Request waiting for a session, the key orders the queue: the
+ *	smallest transfer first, which keeps the summed completion time
+ *	of a storm lowest, equal sizes in order of arrival
+ */
+struct Waiting_request
+{
+	Address from;
+	Tftp_packet request;
+	Time queued_ms{ 0 };
+	bool aged{ false };
+};
+using Waiting_key = std::pair<U64, U64>;
+
+/*
+ *	One RRQ or WRQ being served from its own socket (the server side TID).
+ *	Blocks are absolute numbers. Reading, window_size blocks after
+ *	acked_block are in flight and next_block is sent once the window
+ *	slides. Writing, received_block is the last block in order and
+ *	acked_block the last one acknowledged, reply is resent on timeout.
+ */
+struct Tftp_server_session
+{
+	~Tftp_server_session()
+	{
+		if (socket >= 0) close(socket);
+	}
+
+	U64 id{ 0 };
+	I32 socket{ -1 };
+	Address peer;
+	// Peer and request bytes, see Tftp_server::Request_key
+	string request_key;
+	string file_name;
+	std::shared_ptr<Mapped_file> file;
+	// Deflated as the client goes, blocks are copied out of it into
+	// window slots of their own for the send
+	std::shared_ptr<Compressed_stream> compressed;
+	vector<Byte> compressed_window;
+	vector<size_t> compressed_lengths;
+	bool starved{ false };
+
+	I32 window_size{ 1 };
+	I32 block_size{ Tftp_packet_data_size };
+	bool oack_pending{ false };
+	Tftp_options accepted;
+	Tftp_packet oack;
+	U64 next_block{ 1 };
+	U64 acked_block{ 0 };
+	U64 final_block{ 0 };
+	size_t read_ahead_offset{ 0 };
+	// Byte range served, the whole file unless offset / length were taken
+	size_t range_offset{ 0 };
+	size_t range_end{ 0 };
+
+	bool writing{ false };
+	Upload_file upload;
+	bool upload_compressed{ false };
+	U64 received_block{ 0 };
+	U64 reacked_block{ 0 };
+	Tftp_packet reply;
+	bool committing{ false };
+	bool dallying{ false };
+
+	I32 attempts{ Tftp_server_attempts };
+	Timer_wheel::Timer_id retransmit_timer{ Timer_wheel::No_timer };
+	// Share of the server bandwidth, unlimited unless one is set
+	Token_bucket pacing;
+	Timer_wheel::Timer_id pace_timer{ Timer_wheel::No_timer };
+	bool finished{ false };
+};
+
+/*
+ *	Serves files below a root directory. A single thread polls the
+ *	request socket and every session socket, retransmissions run on
+ *	the timer wheel.
+ *
+ *	DATA datagrams are gathered from a 4 byte header and a slice of
+ *	the mapped file (sendmsg with two iovecs), so serving costs no user
+ *	space copy per byte. MSG_ZEROCOPY is not used, for datagrams of a
+ *	few hundred bytes its completion handling costs more than the
+ *	kernel copy it saves.
+ *
+ *	With offload on, a window goes out as one UDP_SEGMENT send and
+ *	uploads arrive coalesced by UDP_GRO, both cut at datagram size.
+ *
+ *	blksize (RFC 2348) is taken up to the largest block a packet holds,
+ *	larger requests are answered with that.
+ *
+ *	Uploads are written to a temporary file next to the target, the
+ *	directories missing on the way are created. The file is handed to
+ *	the File_committer once the last block arrived, the final ACK is
+ *	only sent after it was synced (as configured) and renamed.
+ *
+ *	At most active_max sessions transfer at once (see Is_transferring),
+ *	requests beyond that wait in a queue of waiting_max (smallest
+ *	transfer first, see Waiting_request) and are started as transfers
+ *	end, so a boot storm is served a bounded number at a time instead
+ *	of all timing out together. Requests which found the queue full, or waited past
+ *	Tftp_server_wait_max_ms, are turned away with "Server busy". With
+ *	a bandwidth set, every session sending data gets an equal share.
+ *
+ *	Octet transfers may negotiate "compress": files read are deflated
+ *	for each session by the File_compressor, a bounded stretch ahead of
+ *	the client, uploads are inflated by the committer.
+ *
+ *	Names are looked up in a File_index of the root kept current by
+ *	inotify, a request costs neither a path walk nor a stat. Without
+ *	the index they are resolved on the filesystem.
+ *
+ *	Served files have to be replaced by rename (copy to a temporary
+ *	name, then mv). A file rewritten in place while a session reads
+ *	it reaches that client as a mix of old and new contents, one
+ *	truncated ends the session with an ERROR.
+ */
+class Tftp_server
+{
+public:
+	using Session_pool = Pool<Tftp_server_session>;
+
+	Tftp_server() = default;
+	~Tftp_server()
+	{
+		committer.stop();
+		compressor.stop();
+		sessions.clear();
+		if (listen_socket >= 0) close(listen_socket);
+		if (wake_pipe[0] >= 0) close(wake_pipe[0]);
+		if (wake_pipe[1] >= 0) close(wake_pipe[1]);
+	}
+	Tftp_server(const Tftp_server& other) = delete;
+
+	/*
+	 *	Binds the request port, IPv6 and IPv4 on one socket when the
+	 *	host has IPv6, IPv4 only otherwise
+	 */
+	bool start(const string& root_directory, U16 port = Tftp_server_port)
+	{
+		root = root_directory;
+		while (root.size() > 1 && root.back() == '/') root.pop_back();
+
+		Address address;
+		listen_socket = open_socket(port, address);
+		if (listen_socket < 0)
+		{
+			Err("Could not bind port " + std::to_string(port));
+			return false;
+		}
+		family = address.family();
+		if (pipe(wake_pipe) != 0)
+		{
+			Err("Could not create wake pipe");
+			return false;
+		}
+		Log("Serving " + root + " on " + To_string(address) + ", replace files there by rename");
+		if (index.build(root))
+		{
+			Log("Indexed " + root + ": " + To_string(index.get_stats()));
+		}
+		else
+		{
+			Err("Could not index " + root + ", serving without an index");
+		}
+		committer.start();
+		compressor.start();
+		running = true;
+		return true;
+	}
+
+	void run()
+	{
+		Trace_thread("server");
+		vector<pollfd> descriptors;
+		vector<U64> ids;
+		while (running)
+		{
+			descriptors.clear();
+			ids.clear();
+			descriptors.push_back({ listen_socket, POLLIN, 0 });
+			descriptors.push_back({ wake_pipe[0], POLLIN, 0 });
+			// Ignored by poll while there is no index
+			descriptors.push_back({ index.get_descriptor(), POLLIN, 0 });
+			for (auto& entry : sessions)
+			{
+				descriptors.push_back({ entry.second->socket, POLLIN, 0 });
+				ids.push_back(entry.first);
+			}
+
+			I32 timeout = -1;
+			Time deadline = timers.next_expiry();
+			if (deadline != Time_never)
+			{
+				Time now = Now_ms();
+				timeout = deadline > now ? static_cast<I32>(deadline - now) : 0;
+			}
+			{
+				Trace_scope wait_trace(Trace_event::Wait, timeout < 0 ? 0 : timeout);
+				if (poll(descriptors.data(), descriptors.size(), timeout) < 0 && errno != EINTR)
+				{
+					Err("Server poll failed");
+					break;
+				}
+			}
+
+			if (descriptors[1].revents & POLLIN)
+			{
+				char drained[16];
+				while (read(wake_pipe[0], drained, sizeof(drained)) == sizeof(drained)) {}
+				receive_commits();
+				receive_compressions();
+			}
+			// Before requests, so they see files changed up to now
+			if (descriptors[2].revents & POLLIN) index.update();
+			// Before requests too, a session aborted by its client (a tsize
+			// probe) then no longer holds back the request following it
+			for (size_t i = 3; i < descriptors.size(); ++i)
+			{
+				if (!(descriptors[i].revents & (POLLIN | POLLERR))) continue;
+				auto found = sessions.find(ids[i - 3]);
+				if (found != sessions.end()) receive_session(*found->second);
+			}
+			if (descriptors[0].revents & POLLIN) receive_requests();
+			timers.advance(Now_ms(), [this](U64 id) { on_timer(id); });
+			reap();
+			admit_waiting();
+			share_bandwidth();
+		}
+	}
+
+	void stop()
+	{
+		running = false;
+		wake();
+	}
+
+	bool is_running() const { return running; }
+
+	/*
+	 *	Port requests are taken on, the one chosen by the system when
+	 *	started on port 0
+	 */
+	U16 get_port() const
+	{
+		Address address;
+		address.length = sizeof(address.storage);
+		if (getsockname(listen_socket, address.data(), &address.length) != 0) return 0;
+		return address.port();
+	}
+
+	bool is_verbose() const { return verbose; }
+	void set_verbose(bool new_verbose) { verbose = new_verbose; }
+	/*
+	 *	Segmentation offload for windows sent and coalescing of uploads
+	 *	received, without kernel support datagrams go one by one
+	 */
+	bool is_offload() const { return offload; }
+	void set_offload(bool new_offload) { offload = new_offload; }
+
+	/*
+	 *	Sessions served at once and requests queued beyond them
+	 */
+	size_t get_active_max() const { return active_max; }
+	size_t get_waiting_max() const { return waiting_max; }
+	bool set_admission(size_t new_active_max, size_t new_waiting_max)
+	{
+		if (new_active_max < 1 || new_active_max > Tftp_server_session_pool_size) return false;
+		active_max = new_active_max;
+		waiting_max = new_waiting_max;
+		return true;
+	}
+
+	/*
+	 *	Bytes per second shared equally by the sessions sending data,
+	 *	0 means unlimited
+	 */
+	U64 get_bandwidth() const { return bandwidth; }
+	void set_bandwidth(U64 bytes_per_second) { bandwidth = bytes_per_second; }
+
+	Tftp_durability get_durability() const { return committer.get_durability(); }
+	void set_durability(Tftp_durability durability) { committer.set_durability(durability); }
+	const Tftp_server_stats& get_stats() const { return stats; }
+	const Index_stats& get_index_stats() const { return index.get_stats(); }
+
+private:
+	void wake()
+	{
+		if (wake_pipe[1] < 0) return;
+		char wake = 0;
+		if (write(wake_pipe[1], &wake, 1) < 0) Err("Could not wake server");
+	}
+
+	I32 open_socket(U16 port, Address& address)
+	{
+		I32 descriptor = socket(AF_INET6, SOCK_DGRAM, 0);
+		if (descriptor >= 0)
+		{
+			I32 v6_only{ 0 };
+			setsockopt(descriptor, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+			auto any = reinterpret_cast<sockaddr_in6*>(&address.storage);
+			any->sin6_family = AF_INET6;
+			any->sin6_addr = in6addr_any;
+			any->sin6_port = htons(port);
+			address.length = sizeof(sockaddr_in6);
+			if (bind(descriptor, address.data(), address.length) == 0) return descriptor;
+			close(descriptor);
+		}
+
+		address = Address();
+		descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+		if (descriptor < 0) return -1;
+		auto any = reinterpret_cast<sockaddr_in*>(&address.storage);
+		any->sin_family = AF_INET;
+		any->sin_addr.s_addr = htonl(INADDR_ANY);
+		any->sin_port = htons(port);
+		address.length = sizeof(sockaddr_in);
+		if (bind(descriptor, address.data(), address.length) == 0) return descriptor;
+		close(descriptor);
+		return -1;
+	}
+
+	/*
+	 *	Session sockets take any free port, it becomes the transfer ID
+	 */
+	I32 open_session_socket()
+	{
+		Address address;
+		I32 descriptor = -1;
+		if (family == AF_INET6)
+		{
+			descriptor = socket(AF_INET6, SOCK_DGRAM, 0);
+			I32 v6_only{ 0 };
+			if (descriptor >= 0) setsockopt(descriptor, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+			auto any = reinterpret_cast<sockaddr_in6*>(&address.storage);
+			any->sin6_family = AF_INET6;
+			any->sin6_addr = in6addr_any;
+			address.length = sizeof(sockaddr_in6);
+		}
+		else
+		{
+			descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+			auto any = reinterpret_cast<sockaddr_in*>(&address.storage);
+			any->sin_family = AF_INET;
+			any->sin_addr.s_addr = htonl(INADDR_ANY);
+			address.length = sizeof(sockaddr_in);
+		}
+		if (descriptor < 0) return -1;
+		if (bind(descriptor, address.data(), address.length) != 0)
+		{
+			close(descriptor);
+			return -1;
+		}
+		return descriptor;
+	}
+
+	bool receive(I32 descriptor, Address& from, Tftp_packet& packet)
+	{
+		from.length = sizeof(from.storage);
+		ssize_t received = recvfrom(descriptor, packet.raw_data(), Tftp_packet::capacity(),
+			MSG_DONTWAIT, from.data(), &from.length);
+		if (received < 0) return false;
+		Trace(Trace_event::Package_received, static_cast<U64>(received));
+		return packet.resize(static_cast<I32>(received));
+	}
+
+	void send_packet(I32 descriptor, const Address& to, const Tftp_packet& packet)
+	{
+		if (verbose) Log("Sending package: " + To_string(packet) + " to " + To_string(to));
+		if (sendto(descriptor, packet.raw_data(), packet.size(), 0, to.data(), to.length) <= 0)
+		{
+			Err("Failed to send a package to " + To_string(to));
+			return;
+		}
+		Trace(Trace_event::Package_sent, packet.size());
+	}
+
+	void reject(I32 descriptor, const Address& to, Tftp_error error, const string& message)
+	{
+		++stats.rejected;
+		send_packet(descriptor, to, Create_error(To_word(error), message));
+	}
+
+	/*
+	 *	Names are taken relative to the root (see Relative_name),
+	 *	relative is the name as the index keys it
+	 */
+	bool resolve_path(const string& file_name, string& relative, string& path) const
+	{
+		if (!Relative_name(file_name, relative)) return false;
+		path = root + "/" + relative;
+		return true;
+	}
+
+	/*
+	 *	Creates the directories an upload to relative lands in that do
+	 *	not exist yet, false when one cannot be created
+	 */
+	bool make_directories(const string& relative) const
+	{
+		string directory = root;
+		vector<string> components = Split(relative, '/');
+		for (size_t i = 0; i + 1 < components.size(); ++i)
+		{
+			directory += "/" + components[i];
+			if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) return false;
+		}
+		return true;
+	}
+
+	/*
+	 *	Shares the mapping of a file between its sessions as long as
+	 *	the file on disk is still the one mapped. The index says so
+	 *	without asking the filesystem.
+	 */
+	std::shared_ptr<Mapped_file> open_file(const string& relative, const string& path)
+	{
+		if (index.is_active())
+		{
+			Index_entry* entry = index.find(relative);
+			if (!entry)
+			{
+				errno = ENOENT;
+				return nullptr;
+			}
+			auto file = entry->mapped.lock();
+			if (file) return file;
+			file = Mapped_file::Open(path);
+			if (file) entry->mapped = file;
+			return file;
+		}
+
+		auto found = files.find(path);
+		if (found != files.end())
+		{
+			auto file = found->second.lock();
+			if (file && file->is_current(path)) return file;
+		}
+		if (files.size() > 2 * sessions.size() + 16)
+		{
+			for (auto it = files.begin(); it != files.end();)
+			{
+				if (it->second.expired()) it = files.erase(it);
+				else ++it;
+			}
+		}
+		auto file = Mapped_file::Open(path);
+		if (file) files[path] = file;
+		return file;
+	}
+
+	/*
+	 *	Read once per version of a file, the index keeps it while the
+	 *	file is unchanged even after its mapping was let go
+	 */
+	bool file_checksum(const string& relative, Mapped_file& file, U32& checksum)
+	{
+		Index_entry* entry = index.is_active() ? index.find(relative) : nullptr;
+		if (entry && entry->checksummed && entry->mapped.lock().get() == &file)
+		{
+			checksum = entry->checksum;
+			return true;
+		}
+		if (!file.checksum(checksum)) return false;
+		if (entry && entry->mapped.lock().get() == &file)
+		{
+			entry->checksummed = true;
+			entry->checksum = checksum;
+		}
+		return true;
+	}
+
+	void receive_requests()
+	{
+		Address from;
+		Tftp_packet packet;
+		while (receive(listen_socket, from, packet))
+		{
+			if (verbose) Log("Received request " + To_string(packet) + " from " + To_string(from));
+			admit(from, packet);
+		}
+	}
+
+	/*
+	 *	Starts the request while there is room for another session,
+	 *	queues it otherwise. A repeat of a request (same client port,
+	 *	name, mode and options) still waiting or being served is
+	 *	dropped, see Is_serving.
+	 */
+	void admit(const Address& from, const Tftp_packet& request)
+	{
+		string request_key = Request_key(from, request);
+		if (waiting_requests.count(request_key) != 0) return;
+		for (auto& entry : sessions)
+		{
+			if (entry.second->request_key == request_key && Is_serving(*entry.second)) return;
+		}
+		if (waiting.empty() && transferring() < active_max)
+		{
+			start_session(from, request);
+			return;
+		}
+
+		Waiting_key key(request_size(request), ++waiting_counter);
+		if (waiting.size() >= waiting_max)
+		{
+			// Full, the largest transfer waiting makes room for a smaller one
+			if (waiting.empty() || std::prev(waiting.end())->first.first <= key.first)
+			{
+				reject(listen_socket, from, Tftp_error::Error_0, "Server busy");
+				return;
+			}
+			turn_away(std::prev(waiting.end()));
+		}
+
+		Waiting_request entry;
+		entry.from = from;
+		entry.request = request;
+		entry.queued_ms = Now_ms();
+		waiting_requests.insert(request_key);
+		waiting.emplace(key, std::move(entry));
+		++stats.queued;
+		if (wait_timer == Timer_wheel::No_timer)
+		{
+			wait_timer = timers.schedule(Now_ms() + Tftp_server_wait_check_ms, Wait_timer_id);
+		}
+	}
+
+	/*
+	 *	Bytes the request will move: the size of the file read, the
+	 *	tsize announced for a write. Unknown sizes go last.
+	 */
+	U64 request_size(const Tftp_packet& request) const
+	{
+		string file_name;
+		string mode;
+		Tftp_options options;
+		string relative;
+		string path;
+		if (request.size() < 4 || !Get_request(request, file_name, mode, options) ||
+			!resolve_path(file_name, relative, path)) return 0;
+		if (request.get_op() == Tftp_operation::Write)
+		{
+			const string* size = Find_option(options, Tftp_option_tsize);
+			return size ? std::strtoull(size->c_str(), nullptr, 10) : std::numeric_limits<U64>::max();
+		}
+		if (index.is_active())
+		{
+			const Index_entry* entry = index.find(relative);
+			return entry ? entry->size : 0;
+		}
+		struct stat file;
+		if (stat(path.c_str(), &file) != 0) return 0;
+		return static_cast<U64>(file.st_size);
+	}
+
+	static string Request_key(const Address& from, const Tftp_packet& request)
+	{
+		return string(reinterpret_cast<const char*>(&from.storage), from.length) +
+			string(reinterpret_cast<const char*>(request.raw_data()), request.size());
+	}
+
+	/*
+	 *	Whether the session still serves its request, so a repeat of
+	 *	it is the client retransmitting. Not once it ended, while its
+	 *	OACK is unacknowledged (the client may have aborted a tsize
+	 *	probe and asked again) or once only its last block or ACK is
+	 *	resent (the client may be done and asking again).
+	 */
+	static bool Is_serving(const Tftp_server_session& s)
+	{
+		if (s.finished || s.dallying) return false;
+		if (s.writing) return true;
+		return !s.oack_pending && s.next_block <= s.final_block;
+	}
+
+	/*
+	 *	Whether the session holds one of the active_max places. Not
+	 *	once it ended, is dallying or committing, or only waits for the
+	 *	ACK of its last block.
+	 */
+	static bool Is_transferring(const Tftp_server_session& s)
+	{
+		if (s.finished || s.dallying || s.committing) return false;
+		return s.writing || s.next_block <= s.final_block;
+	}
+
+	size_t transferring() const
+	{
+		size_t count = 0;
+		for (auto& entry : sessions)
+		{
+			if (Is_transferring(*entry.second)) ++count;
+		}
+		return count;
+	}
+
+	void turn_away(std::map<Waiting_key, Waiting_request>::iterator entry)
+	{
+		reject(listen_socket, entry->second.from, Tftp_error::Error_0, "Server busy");
+		waiting_requests.erase(Request_key(entry->second.from, entry->second.request));
+		waiting.erase(entry);
+	}
+
+	/*
+	 *	Starts waiting requests while sessions are free
+	 */
+	void admit_waiting()
+	{
+		if (waiting.empty()) return;
+		size_t active = transferring();
+		while (!waiting.empty() && active < active_max)
+		{
+			auto next = waiting.begin();
+			Waiting_request entry = std::move(next->second);
+			waiting_requests.erase(Request_key(entry.from, entry.request));
+			waiting.erase(next);
+			start_session(entry.from, entry.request);
+			++active;
+		}
+	}
+
+	/*
+	 *	Turns away what waited too long for the client to still be
+	 *	there, moves what waited half as long to the front
+	 */
+	void check_waiting()
+	{
+		wait_timer = Timer_wheel::No_timer;
+		Time now = Now_ms();
+		vector<std::pair<Waiting_key, Waiting_request>> aged;
+		for (auto it = waiting.begin(); it != waiting.end();)
+		{
+			Time waited = now - it->second.queued_ms;
+			if (waited >= Tftp_server_wait_max_ms)
+			{
+				++stats.expired;
+				auto expired = it++;
+				turn_away(expired);
+				continue;
+			}
+			if (waited >= Tftp_server_wait_max_ms / 2 && !it->second.aged)
+			{
+				it->second.aged = true;
+				aged.emplace_back(Waiting_key(0, it->first.second), std::move(it->second));
+				it = waiting.erase(it);
+				continue;
+			}
+			++it;
+		}
+		for (auto& entry : aged) waiting.emplace(entry.first, std::move(entry.second));
+		if (!waiting.empty()) wait_timer = timers.schedule(now + Tftp_server_wait_check_ms, Wait_timer_id);
+	}
+
+	/*
+	 *	Splits the bandwidth equally between the sessions sending data,
+	 *	a burst lets a whole window go at once
+	 */
+	void share_bandwidth()
+	{
+		U64 total = bandwidth;
+		size_t senders = 0;
+		for (auto& entry : sessions)
+		{
+			if (!entry.second->writing && !entry.second->finished) ++senders;
+		}
+		if (total == shared_bandwidth && senders == sharing_sessions) return;
+		shared_bandwidth = total;
+		sharing_sessions = senders;
+
+		U64 share = senders > 0 ? std::max<U64>(total / senders, 1) : total;
+		Time now = Now_us();
+		for (auto& entry : sessions)
+		{
+			Tftp_server_session& s = *entry.second;
+			if (s.writing || s.finished) continue;
+			if (total == 0)
+			{
+				s.pacing.set_rate(0);
+				continue;
+			}
+			U64 burst = static_cast<U64>(s.window_size) * (Tftp_packet_header_size + s.block_size);
+			s.pacing.update_rate(share, burst, now);
+		}
+	}
+
+	void start_session(const Address& from, const Tftp_packet& request)
+	{
+		string file_name;
+		string mode;
+		Tftp_options options;
+		if (request.size() < 4 || !Get_request(request, file_name, mode, options))
+		{
+			reject(listen_socket, from, Tftp_error::Error_4, "Malformed request");
+			return;
+		}
+		if (request.get_op() != Tftp_operation::Read && request.get_op() != Tftp_operation::Write)
+		{
+			reject(listen_socket, from, Tftp_error::Error_4, "Expected RRQ or WRQ");
+			return;
+		}
+
+		string relative;
+		string path;
+		if (!resolve_path(file_name, relative, path))
+		{
+			reject(listen_socket, from, Tftp_error::Error_2, "Access violation");
+			return;
+		}
+		if (request.get_op() == Tftp_operation::Write)
+		{
+			start_upload(from, request, file_name, relative, path, mode, options);
+			return;
+		}
+		auto file = open_file(relative, path);
+		if (!file)
+		{
+			bool missing = errno == ENOENT || errno == ENOTDIR;
+			reject(listen_socket, from, missing ? Tftp_error::Error_1 : Tftp_error::Error_2,
+				missing ? "File not found" : "Access violation");
+			return;
+		}
+
+		auto session = session_pool.acquire();
+		if (!session)
+		{
+			reject(listen_socket, from, Tftp_error::Error_0, "Server busy");
+			return;
+		}
+		session->socket = open_session_socket();
+		if (session->socket < 0)
+		{
+			reject(listen_socket, from, Tftp_error::Error_0, "Server busy");
+			return;
+		}
+		session->id = ++session_counter;
+		session->peer = from;
+		session->request_key = Request_key(from, request);
+		session->file_name = file_name;
+		session->file = file;
+		bool ranged = false;
+		if (!Parse_range(options, file->size(), session->range_offset, session->range_end, ranged))
+		{
+			reject(listen_socket, from, Tftp_error::Error_8, "Bad range");
+			return;
+		}
+		session->read_ahead_offset = session->range_offset;
+		++stats.sessions;
+		if (verbose) Log("Serving " + file_name + " to " + To_string(from));
+
+		Tftp_options accepted;
+		if (ranged)
+		{
+			accepted.emplace_back(Tftp_option_offset, std::to_string(session->range_offset));
+			accepted.emplace_back(Tftp_option_length, std::to_string(session->range_end - session->range_offset));
+		}
+		for (auto& option : options)
+		{
+			if (option.first == Tftp_option_windowsize)
+			{
+				I32 value = std::atoi(option.second.c_str());
+				if (value < 1) continue;
+				session->window_size = std::min(value, Tftp_server_window_max);
+				accepted.emplace_back(option.first, std::to_string(session->window_size));
+			}
+			else if (option.first == Tftp_option_blksize)
+			{
+				I32 value = std::atoi(option.second.c_str());
+				if (value < Tftp_blksize_min) continue;
+				session->block_size = std::min(value, Tftp_packet_blksize_max);
+				accepted.emplace_back(option.first, std::to_string(session->block_size));
+			}
+			else if (option.first == Tftp_option_tsize)
+			{
+				accepted.emplace_back(option.first, std::to_string(file->size()));
+			}
+			else if (option.first == Tftp_option_crc32c && !ranged)
+			{
+				U32 checksum{ 0 };
+				if (file_checksum(relative, *file, checksum)) accepted.emplace_back(option.first, To_checksum_string(checksum));
+			}
+			else if (option.first == Tftp_option_compress && !ranged && Is_compressible(mode, option.second))
+			{
+				accepted.emplace_back(option.first, Tftp_compress_deflate);
+				session->compressed = std::make_shared<Compressed_stream>(file);
+			}
+		}
+
+		if (session->compressed)
+		{
+			// Known once the stream ended, see take_compressed
+			session->final_block = Block_unknown;
+			session->compressed_window.resize(static_cast<size_t>(session->window_size) * session->block_size);
+			session->compressed_lengths.resize(session->window_size);
+			compressor.add(session->compressed);
+		}
+		else
+		{
+			session->final_block = (session->range_end - session->range_offset) / session->block_size + 1;
+		}
+
+		Tftp_server_session& s = *session;
+		sessions.emplace(s.id, std::move(session));
+		if (!accepted.empty())
+		{
+			// Data starts once the client acknowledged the options with ACK 0
+			s.oack = Create_oack(accepted);
+			s.oack_pending = true;
+			send_packet(s.socket, s.peer, s.oack);
+		}
+		else
+		{
+			send_window(s);
+		}
+		arm_retransmit(s);
+	}
+
+	static bool Is_compressible(string mode, const string& algorithm)
+	{
+		std::transform(mode.begin(), mode.end(), mode.begin(), [](char c) { return static_cast<char>(std::tolower(c)); });
+		return mode == To_string(Tftp_mode::Octet) && algorithm == Tftp_compress_deflate;
+	}
+
+	/*
+	 *	Copies the block out of the session's stream into its window
+	 *	slot. False while the compressor has not got that far, the
+	 *	session goes on once it has (receive_compressions), or when the
+	 *	stream failed and the session ended.
+	 */
+	bool take_compressed(Tftp_server_session& s, U64 block)
+	{
+		size_t slot = static_cast<size_t>((block - 1) % s.window_size);
+		size_t& length = s.compressed_lengths[slot];
+		if (s.compressed->is_failed())
+		{
+			bool changed = s.file->is_truncated();
+			Err((changed ? s.file_name + " was truncated while compressed for " : "Could not compress " + s.file_name + " for ") +
+				To_string(s.peer));
+			send_packet(s.socket, s.peer, Create_error(To_word(Tftp_error::Error_0),
+				changed ? "File changed while being read" : "Could not compress file"));
+			finish(s, false);
+			return false;
+		}
+		if (!s.compressed->copy((block - 1) * s.block_size, s.block_size, &s.compressed_window[slot * s.block_size], length))
+		{
+			s.starved = true;
+			return false;
+		}
+		// A short block ends the stream
+		if (length < static_cast<size_t>(s.block_size)) s.final_block = block;
+		return true;
+	}
+
+	/*
+	 *	Sessions which ran out of compressed data go on where the
+	 *	compressor got to
+	 */
+	void receive_compressions()
+	{
+		for (auto& entry : sessions)
+		{
+			Tftp_server_session& s = *entry.second;
+			if (!s.starved || s.finished || s.oack_pending) continue;
+			s.starved = false;
+			send_window(s);
+		}
+	}
+
+	void start_upload(const Address& from, const Tftp_packet& request, const string& file_name,
+		const string& relative, const string& path, const string& mode, const Tftp_options& options)
+	{
+		auto session = session_pool.acquire();
+		if (!session)
+		{
+			reject(listen_socket, from, Tftp_error::Error_0, "Server busy");
+			return;
+		}
+		// Directories below the root are created as uploads need them
+		bool opened = session->upload.open(path);
+		if (!opened && errno == ENOENT && make_directories(relative)) opened = session->upload.open(path);
+		if (!opened)
+		{
+			bool full = errno == ENOSPC || errno == EDQUOT;
+			reject(listen_socket, from, full ? Tftp_error::Error_3 : Tftp_error::Error_2,
+				full ? "Disk full" : "Access violation");
+			return;
+		}
+		session->socket = open_session_socket();
+		if (session->socket < 0)
+		{
+			reject(listen_socket, from, Tftp_error::Error_0, "Server busy");
+			return;
+		}
+		session->id = ++session_counter;
+		session->peer = from;
+		session->request_key = Request_key(from, request);
+		session->file_name = file_name;
+		session->writing = true;
+		++stats.sessions;
+		if (verbose) Log("Receiving " + file_name + " from " + To_string(from));
+
+		Tftp_options accepted;
+		for (auto& option : options)
+		{
+			if (option.first == Tftp_option_windowsize)
+			{
+				I32 value = std::atoi(option.second.c_str());
+				if (value < 1) continue;
+				session->window_size = std::min(value, Tftp_server_window_max);
+				accepted.emplace_back(option.first, std::to_string(session->window_size));
+			}
+			else if (option.first == Tftp_option_blksize)
+			{
+				I32 value = std::atoi(option.second.c_str());
+				if (value < Tftp_blksize_min) continue;
+				session->block_size = std::min(value, Tftp_packet_blksize_max);
+				accepted.emplace_back(option.first, std::to_string(session->block_size));
+			}
+			else if (option.first == Tftp_option_tsize)
+			{
+				accepted.emplace_back(option.first, option.second);
+			}
+			else if (option.first == Tftp_option_compress && Is_compressible(mode, option.second))
+			{
+				accepted.emplace_back(option.first, Tftp_compress_deflate);
+				session->upload_compressed = true;
+			}
+		}
+
+		if (offload) Enable_udp_gro(session->socket, true);
+
+		Tftp_server_session& s = *session;
+		sessions.emplace(s.id, std::move(session));
+		// The OACK stands in for ACK 0
+		s.reply = accepted.empty() ? Create_ack(0) : Create_oack(accepted);
+		send_packet(s.socket, s.peer, s.reply);
+		arm_retransmit(s);
+	}
+
+	/*
+	 *	Session sockets may hand up coalesced runs of datagrams, each is
+	 *	taken out into a packet of its own
+	 */
+	void receive_session(Tftp_server_session& s)
+	{
+		Address from;
+		Tftp_packet packet;
+		while (!s.finished)
+		{
+			size_t segment_size{ 0 };
+			U64 received_ns{ 0 };
+			ssize_t received = Receive_segments(s.socket, coalesced.data(), coalesced.size(),
+				MSG_DONTWAIT, from, segment_size, received_ns);
+			if (received < 0) break;
+			Trace(Trace_event::Package_received, static_cast<U64>(received));
+
+			for (size_t offset = 0; offset < static_cast<size_t>(received) && !s.finished; offset += segment_size)
+			{
+				I32 size = static_cast<I32>(std::min(segment_size, static_cast<size_t>(received) - offset));
+				if (!packet.resize(size)) continue;
+				memcpy(packet.raw_data(), coalesced.data() + offset, size);
+				receive_datagram(s, from, packet);
+			}
+		}
+	}
+
+	void receive_datagram(Tftp_server_session& s, const Address& from, const Tftp_packet& packet)
+	{
+		if (from != s.peer)
+		{
+			send_packet(s.socket, from, Create_error(To_word(Tftp_error::Error_5), "Unknown transfer ID"));
+			return;
+		}
+		if (packet.size() < 4) return;
+		if (verbose) Log("Received package " + To_string(packet));
+
+		Tftp_operation op = packet.get_op();
+		if (op == Tftp_operation::Error)
+		{
+			// Also how clients end a transfer after reading the OACK only
+			if (s.dallying) s.finished = true;
+			else finish(s, false);
+			return;
+		}
+		if (op == Tftp_operation::Ack && !s.writing) on_ack(s, packet.get_word(2));
+		if (op == Tftp_operation::Data && s.writing) on_data(s, packet);
+	}
+
+	void on_ack(Tftp_server_session& s, Word number)
+	{
+		if (s.oack_pending)
+		{
+			if (number != 0) return;
+			s.oack_pending = false;
+			s.attempts = Tftp_server_attempts;
+			send_window(s);
+			arm_retransmit(s);
+			return;
+		}
+
+		U64 block = Unwrap_block(number, s.acked_block);
+		// Duplicates and ACKs of unsent blocks never trigger a send (RFC 1123 4.2.3.1)
+		if (block <= s.acked_block || block >= s.next_block) return;
+
+		s.acked_block = block;
+		s.attempts = Tftp_server_attempts;
+		if (s.compressed && s.compressed->release(block * s.block_size)) compressor.poke();
+		if (block == s.final_block)
+		{
+			finish(s, true);
+			return;
+		}
+		if (block + 1 < s.next_block)
+		{
+			// The client acknowledged part of the window, resend from its gap
+			stats.retransmits += s.next_block - block - 1;
+			s.next_block = block + 1;
+		}
+		send_window(s);
+		arm_retransmit(s);
+	}
+
+	/*
+	 *	Blocks in order are buffered and acknowledged once per window.
+	 *	A gap or a duplicate is answered with a single ACK of the last
+	 *	block in order per progress made, so a burst of out of order
+	 *	blocks does not turn into a burst of ACKs.
+	 */
+	void on_data(Tftp_server_session& s, const Tftp_packet& packet)
+	{
+		if (s.committing) return;
+		U64 block = Unwrap_block(packet.get_word(2), s.received_block);
+		if (s.dallying)
+		{
+			// The final ACK was lost
+			if (block == s.received_block) send_packet(s.socket, s.peer, s.reply);
+			return;
+		}
+		if (block != s.received_block + 1)
+		{
+			if (s.reacked_block == s.received_block) return;
+			s.reacked_block = s.received_block;
+			acknowledge(s);
+			return;
+		}
+
+		size_t size = static_cast<size_t>(packet.size() - 4);
+		{
+			Trace_scope write_trace(Trace_event::Disk_write, size);
+			if (!s.upload.append(packet.raw_data() + 4, size))
+			{
+				fail_upload(s);
+				return;
+			}
+		}
+		s.received_block = block;
+		s.attempts = Tftp_server_attempts;
+		stats.bytes_received += size;
+
+		if (size < static_cast<size_t>(s.block_size))
+		{
+			commit_upload(s);
+			return;
+		}
+		if (s.received_block - s.acked_block >= static_cast<U64>(s.window_size)) acknowledge(s);
+		arm_retransmit(s);
+	}
+
+	void acknowledge(Tftp_server_session& s)
+	{
+		s.acked_block = s.received_block;
+		s.reply = Create_ack(static_cast<Word>(s.received_block & 0xffff));
+		send_packet(s.socket, s.peer, s.reply);
+	}
+
+	void fail_upload(Tftp_server_session& s)
+	{
+		bool full = errno == ENOSPC || errno == EDQUOT;
+		Err("Could not write " + s.upload.get_temp_path());
+		send_packet(s.socket, s.peer, Create_error(To_word(full ? Tftp_error::Error_3 : Tftp_error::Error_0),
+			full ? "Disk full" : "Write failed"));
+		finish(s, false);
+	}
+
+	/*
+	 *	The last block is acknowledged by receive_commits, once the
+	 *	file is where the client expects it
+	 */
+	void commit_upload(Tftp_server_session& s)
+	{
+		if (!s.upload.flush())
+		{
+			fail_upload(s);
+			return;
+		}
+		timers.cancel(s.retransmit_timer);
+		s.retransmit_timer = Timer_wheel::No_timer;
+		s.committing = true;
+
+		Commit commit;
+		commit.id = s.id;
+		commit.temp_path = s.upload.get_temp_path();
+		commit.final_path = s.upload.get_final_path();
+		commit.compressed = s.upload_compressed;
+		commit.descriptor = s.upload.release();
+		committer.submit(std::move(commit));
+	}
+
+	void receive_commits()
+	{
+		committer.take_done(commits);
+		for (auto& commit : commits)
+		{
+			auto found = sessions.find(commit.id);
+			if (found == sessions.end()) continue;
+
+			Tftp_server_session& s = *found->second;
+			s.committing = false;
+			// The client gave up while the file was committed
+			if (s.finished) continue;
+			if (!commit.succeeded)
+			{
+				Err("Could not commit " + commit.final_path);
+				send_packet(s.socket, s.peer, Create_error(To_word(Tftp_error::Error_0), "Could not store file"));
+				finish(s, false);
+				continue;
+			}
+
+			acknowledge(s);
+			++stats.uploads;
+			finish(s, true);
+			// Stay around to answer the last DATA again should the ACK be lost
+			s.finished = false;
+			s.dallying = true;
+			timers.cancel(s.retransmit_timer);
+			s.retransmit_timer = timers.schedule(Now_ms() + Tftp_server_dally_ms, s.id);
+		}
+	}
+
+	void send_window(Tftp_server_session& s)
+	{
+		Time now = Now_us();
+		while (s.next_block <= s.final_block &&
+			s.next_block <= s.acked_block + static_cast<U64>(s.window_size))
+		{
+			if (!s.pacing.ready(now))
+			{
+				arm_pace(s);
+				break;
+			}
+			if (s.compressed && !take_compressed(s, s.next_block)) break;
+			size_t length = offload ? queue_block(s, s.next_block) : send_block(s, s.next_block);
+			s.pacing.consume(Tftp_packet_header_size + length, now);
+			++s.next_block;
+			if (batch.full()) send_batch(s);
+			if (s.finished) break;
+		}
+		send_batch(s);
+	}
+
+	void arm_pace(Tftp_server_session& s)
+	{
+		if (s.pace_timer != Timer_wheel::No_timer) return;
+		Time ready_us = s.pacing.ready_at_us(Now_us());
+		s.pace_timer = timers.schedule((ready_us + 999) / 1000, s.id | Pace_timer_bit);
+	}
+
+	/*
+	 *	Slice of the mapped file (or the window slot take_compressed
+	 *	filled) a block carries, reads ahead once the session nears the
+	 *	end of what was read ahead before
+	 */
+	const Byte* block_data(Tftp_server_session& s, U64 block, size_t& length)
+	{
+		size_t offset = (block - 1) * s.block_size;
+		if (s.compressed)
+		{
+			size_t slot = static_cast<size_t>((block - 1) % s.window_size);
+			length = s.compressed_lengths[slot];
+			return &s.compressed_window[slot * s.block_size];
+		}
+
+		const Mapped_file& file = *s.file;
+		offset += s.range_offset;
+		length = offset < s.range_end ?
+			std::min<size_t>(s.block_size, s.range_end - offset) : 0;
+
+		if (offset + Tftp_server_read_ahead_bytes / 2 >= s.read_ahead_offset)
+		{
+			file.read_ahead(s.read_ahead_offset, Tftp_server_read_ahead_bytes);
+			s.read_ahead_offset += Tftp_server_read_ahead_bytes;
+		}
+		return file.data() + offset;
+	}
+
+	/*
+	 *	Range an RRQ asks for with offset / length, the whole file when
+	 *	it has neither. A length past the end is cut at the end, an
+	 *	offset past it is refused.
+	 */
+	static bool Parse_range(const Tftp_options& options, size_t file_size, size_t& begin, size_t& end, bool& ranged)
+	{
+		U64 offset = 0;
+		U64 length = file_size;
+		ranged = false;
+		for (auto& option : options)
+		{
+			bool is_offset = option.first == Tftp_option_offset;
+			if (!is_offset && option.first != Tftp_option_length) continue;
+			char* last = nullptr;
+			U64 value = std::strtoull(option.second.c_str(), &last, 10);
+			if (option.second.empty() || *last != '\0') return false;
+			(is_offset ? offset : length) = value;
+			ranged = true;
+		}
+		if (offset > file_size) return false;
+		begin = static_cast<size_t>(offset);
+		end = static_cast<size_t>(offset + std::min<U64>(length, file_size - offset));
+		return true;
+	}
+
+	static void Fill_header(Byte* header, U64 block)
+	{
+		header[0] = 0;
+		header[1] = static_cast<Byte>(Tftp_operation::Data);
+		header[2] = static_cast<Byte>((block >> 8) & 0xff);
+		header[3] = static_cast<Byte>(block & 0xff);
+	}
+
+	size_t queue_block(Tftp_server_session& s, U64 block)
+	{
+		size_t length{ 0 };
+		const Byte* data = block_data(s, block, length);
+		Byte* header = batch_headers[batch.size()];
+		Fill_header(header, block);
+		batch.add(header, 4, data, length);
+		batch_bytes += length;
+		return length;
+	}
+
+	void send_batch(Tftp_server_session& s)
+	{
+		if (batch.empty()) return;
+		size_t count = batch.size();
+		size_t sent = batch.send(s.socket, s.peer, true);
+		if (sent < count)
+		{
+			Err("Failed to send " + std::to_string(count - sent) + " blocks to " + To_string(s.peer));
+			abort_truncated(s);
+		}
+		Trace(Trace_event::Package_sent, batch_bytes + 4 * count);
+		stats.blocks += sent;
+		stats.bytes += batch_bytes;
+		batch_bytes = 0;
+	}
+
+	/*
+	 *	2 bytes = opcode
+	 *	2 bytes = block_number
+	 *	n bytes	= slice of the mapped file
+	 */
+	size_t send_block(Tftp_server_session& s, U64 block)
+	{
+		size_t length{ 0 };
+		const Byte* data = block_data(s, block, length);
+		Byte header[4];
+		Fill_header(header, block);
+		iovec parts[2];
+		parts[0].iov_base = header;
+		parts[0].iov_len = sizeof(header);
+		parts[1].iov_base = const_cast<Byte*>(data);
+		parts[1].iov_len = length;
+
+		msghdr message{};
+		message.msg_name = const_cast<sockaddr*>(s.peer.data());
+		message.msg_namelen = s.peer.length;
+		message.msg_iov = parts;
+		message.msg_iovlen = length > 0 ? 2 : 1;
+		if (sendmsg(s.socket, &message, 0) < 0)
+		{
+			Err("Failed to send block " + std::to_string(block) + " to " + To_string(s.peer));
+			abort_truncated(s);
+			return length;
+		}
+		Trace(Trace_event::Package_sent, sizeof(header) + length);
+		++stats.blocks;
+		stats.bytes += length;
+		return length;
+	}
+
+	/*
+	 *	Sending from past the end of a file truncated while it is served
+	 *	fails with EFAULT, as would every retransmit, so the client is
+	 *	told and the session ends
+	 */
+	void abort_truncated(Tftp_server_session& s)
+	{
+		if (s.finished || s.compressed || !s.file || !s.file->is_truncated()) return;
+		Err(s.file_name + " was truncated while served to " + To_string(s.peer));
+		send_packet(s.socket, s.peer, Create_error(To_word(Tftp_error::Error_0), "File changed while being read"));
+		finish(s, false);
+	}
+
+	void arm_retransmit(Tftp_server_session& s)
+	{
+		timers.cancel(s.retransmit_timer);
+		s.retransmit_timer = timers.schedule(Now_ms() + Tftp_server_timeout_ms, s.id);
+	}
+
+	void on_timer(U64 id)
+	{
+		if (id == Wait_timer_id)
+		{
+			check_waiting();
+			return;
+		}
+		auto found = sessions.find(id & ~Pace_timer_bit);
+		if (found == sessions.end()) return;
+
+		Tftp_server_session& s = *found->second;
+		if (id & Pace_timer_bit)
+		{
+			s.pace_timer = Timer_wheel::No_timer;
+			if (!s.finished && !s.writing && !s.oack_pending) send_window(s);
+			return;
+		}
+		s.retransmit_timer = Timer_wheel::No_timer;
+		if (s.finished) return;
+		Trace(Trace_event::Timer_fire, id);
+		if (s.dallying)
+		{
+			s.finished = true;
+			return;
+		}
+		if (--s.attempts <= 0)
+		{
+			if (verbose) Log("No response from " + To_string(s.peer) + ", dropping " + s.file_name);
+			finish(s, false);
+			return;
+		}
+		if (s.writing)
+		{
+			++stats.retransmits;
+			send_packet(s.socket, s.peer, s.reply);
+		}
+		else if (s.oack_pending)
+		{
+			send_packet(s.socket, s.peer, s.oack);
+		}
+		else if (s.starved && s.next_block == s.acked_block + 1)
+		{
+			// Everything sent was acknowledged, waiting for the compressor is no retry
+			++s.attempts;
+		}
+		else
+		{
+			stats.retransmits += s.next_block - s.acked_block - 1;
+			s.next_block = s.acked_block + 1;
+			Trace(Trace_event::Retransmit, s.next_block);
+			send_window(s);
+		}
+		arm_retransmit(s);
+	}
+
+	void finish(Tftp_server_session& s, bool succeeded)
+	{
+		s.finished = true;
+		if (succeeded) ++stats.completed;
+		else ++stats.failed;
+		if (!verbose) return;
+		if (s.writing) Log((succeeded ? "Stored " : "Aborted ") + s.file_name + " from " + To_string(s.peer));
+		else Log((succeeded ? "Served " : "Aborted ") + s.file_name + " to " + To_string(s.peer));
+	}
+
+	void reap()
+	{
+		for (auto it = sessions.begin(); it != sessions.end();)
+		{
+			// Committing sessions own nothing on disk any more but wait for their result
+			if (!it->second->finished || it->second->committing)
+			{
+				++it;
+				continue;
+			}
+			timers.cancel(it->second->retransmit_timer);
+			timers.cancel(it->second->pace_timer);
+			it = sessions.erase(it);
+		}
+	}
+
+	// Session ids start at 1, timer cookies are session ids
+	static constexpr U64 Wait_timer_id = 0;
+	static constexpr U64 Pace_timer_bit = 1ull << 63;
+	static constexpr U64 Block_unknown = ~0ull;
+
+	Session_pool session_pool{ Tftp_server_session_pool_size };
+	std::map<Waiting_key, Waiting_request> waiting;
+	std::unordered_set<string> waiting_requests;
+	U64 waiting_counter{ 0 };
+	Timer_wheel::Timer_id wait_timer{ Timer_wheel::No_timer };
+	std::atomic<size_t> active_max{ Tftp_server_active_default };
+	std::atomic<size_t> waiting_max{ Tftp_server_waiting_default };
+	std::atomic<U64> bandwidth{ 0 };
+	U64 shared_bandwidth{ 0 };
+	size_t sharing_sessions{ 0 };
+	std::unordered_map<U64, Session_pool::Pointer> sessions;
+	File_index index;
+	// Mappings shared while serving without an index
+	std::unordered_map<string, std::weak_ptr<Mapped_file>> files;
+	Timer_wheel timers;
+	U64 session_counter{ 0 };
+	File_committer committer{ [this]() { wake(); } };
+	vector<Commit> commits;
+	File_compressor compressor{ [this]() { wake(); } };
+	vector<Byte> coalesced = vector<Byte>(Udp_gro_buffer_size);
+	Datagram_batch batch;
+	Byte batch_headers[Udp_gso_segments_max][4];
+	size_t batch_bytes{ 0 };
+
+	string root;
+	I32 family{ AF_INET };
+	I32 listen_socket{ -1 };
+	I32 wake_pipe[2]{ -1, -1 };
+	std::atomic<bool> running{ false };
+	std::atomic<bool> verbose{ false };
+	std::atomic<bool> offload{ false };
+	Tftp_server_stats stats;
+};
+
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_address.h"
+#include "tftp_congestion.h"
+
+#include <algorithm>
+#include <mutex>
+#include <poll.h>
+
+namespace tftp
+{
+
+constexpr Time Tftp_probe_timeout_ms = 500;
+const string Tftp_probe_file_name = ".tftp-probe";
+
+struct Server_status
+{
+	Address address;
+	bool healthy{ true };
+	bool probed{ false };
+	Time rtt_us{ 0 };
+	U32 failures{ 0 };
+};
+
+inline string To_string(const Server_status& status)
+{
+	string result = To_string(status.address) + (status.healthy ? " healthy" : " down");
+	if (status.probed && status.healthy) result += ", rtt " + std::to_string(status.rtt_us) + " us";
+	if (status.failures > 0) result += ", failures " + std::to_string(status.failures);
+	return result;
+}
+
+/*
+ *	Round trip to a server without transferring anything: an RRQ for
+ *	a probe file, answered by the server with an error (or an OACK,
+ *	which is declined with error 8 so the server session ends)
+ */
+inline bool Probe_server(const Address& server, Time timeout_ms, Time& rtt_us)
+{
+	I32 probe = socket(server.family(), SOCK_DGRAM, 0);
+	if (probe < 0) return false;
+
+	Tftp_packet request = Create_read(Tftp_probe_file_name, Tftp_mode::Octet, { { Tftp_option_tsize, "0" } });
+	Time start = Now_us();
+	if (sendto(probe, request.raw_data(), request.size(), 0, server.data(), server.length) <= 0)
+	{
+		close(probe);
+		return false;
+	}
+
+	bool answered = false;
+	Time deadline = start + timeout_ms * 1000;
+	for (Time now = start; !answered && now < deadline; now = Now_us())
+	{
+		pollfd descriptor{ probe, POLLIN, 0 };
+		if (poll(&descriptor, 1, static_cast<int>((deadline - now + 999) / 1000)) <= 0) break;
+
+		Tftp_packet response;
+		Address from;
+		from.length = sizeof(from.storage);
+		ssize_t received = recvfrom(probe, response.raw_data(), Tftp_packet::capacity(), 0, from.data(), &from.length);
+		if (received < 4 || !response.resize(static_cast<I32>(received))) continue;
+
+		// The answer comes from a new port of the same host
+		Address host = from;
+		host.set_port(server.port());
+		if (host != server) continue;
+
+		rtt_us = Now_us() - start;
+		answered = true;
+		if (response.get_op() != Tftp_operation::Error)
+		{
+			Tftp_packet decline = Create_error(To_word(Tftp_error::Error_8), "Probe only");
+			sendto(probe, decline.raw_data(), decline.size(), 0, from.data(), from.length);
+		}
+	}
+	close(probe);
+	return answered;
+}
+
+/*
+ *	Mirrors to transfer from, ranked by health and measured round trip.
+ *	Shared by the command and execute threads, so every access locks.
+ */
+class Server_list
+{
+public:
+	Server_list() = default;
+	explicit Server_list(const vector<Address>& addresses)
+	{
+		for (auto& address : addresses)
+		{
+			Server_status status;
+			status.address = address;
+			servers.push_back(status);
+		}
+	}
+	Server_list(const Server_list& other)
+	{
+		Guard gate_in(other.mutex);
+		servers = other.servers;
+	}
+	Server_list& operator=(const Server_list& other)
+	{
+		if (this == &other) return *this;
+		vector<Server_status> copy = other.statuses();
+		Guard gate_out(mutex);
+		servers = std::move(copy);
+		return *this;
+	}
+
+	size_t size() const
+	{
+		Guard gate_in(mutex);
+		return servers.size();
+	}
+
+	vector<Server_status> statuses() const
+	{
+		Guard gate_in(mutex);
+		return servers;
+	}
+
+	/*
+	 *	Measures every server at once, the slowest one bounds the time
+	 */
+	void probe(Time timeout_ms = Tftp_probe_timeout_ms)
+	{
+		vector<Server_status> probed = statuses();
+		vector<Thread> probes;
+		for (auto& status : probed)
+		{
+			probes.emplace_back([&status, timeout_ms]()
+			{
+				status.probed = true;
+				status.healthy = Probe_server(status.address, timeout_ms, status.rtt_us);
+			});
+		}
+		for (auto& probe : probes) probe.join();
+
+		Guard gate_out(mutex);
+		for (auto& status : probed)
+		{
+			for (auto& server : servers)
+			{
+				if (server.address != status.address) continue;
+				server.probed = true;
+				server.healthy = status.healthy;
+				server.rtt_us = status.rtt_us;
+			}
+		}
+	}
+
+	/*
+	 *	Servers of family in order of preference: healthy ones fastest
+	 *	first, then those which are down in case they came back
+	 */
+	vector<Address> ranking(I32 family) const
+	{
+		vector<Server_status> ranked;
+		for (auto& status : statuses())
+		{
+			if (family == AF_UNSPEC || status.address.family() == family) ranked.push_back(status);
+		}
+		std::stable_sort(ranked.begin(), ranked.end(), [](const Server_status& a, const Server_status& b)
+		{
+			if (a.healthy != b.healthy) return a.healthy;
+			if (a.probed != b.probed) return a.probed;
+			return a.rtt_us < b.rtt_us;
+		});
+		vector<Address> result;
+		for (auto& status : ranked) result.push_back(status.address);
+		return result;
+	}
+
+	bool is_healthy(const Address& address) const
+	{
+		Guard gate_in(mutex);
+		for (auto& server : servers)
+		{
+			if (server.address == address) return server.healthy;
+		}
+		return false;
+	}
+
+	void mark_failed(const Address& address)
+	{
+		Guard gate_out(mutex);
+		for (auto& server : servers)
+		{
+			if (server.address != address) continue;
+			server.healthy = false;
+			++server.failures;
+		}
+	}
+
+	void mark_ok(const Address& address)
+	{
+		Guard gate_out(mutex);
+		for (auto& server : servers)
+		{
+			if (server.address == address) server.healthy = true;
+		}
+	}
+
+private:
+	using Guard = std::lock_guard<std::mutex>;
+
+	mutable std::mutex mutex;
+	vector<Server_status> servers;
+};
+
+}
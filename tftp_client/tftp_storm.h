@@ -0,0 +1,534 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_address.h"
+#include "tftp_timer.h"
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <poll.h>
+#include <sys/resource.h>
+
+namespace tftp
+{
+
+/*
+ *	Boot clients are given up on like a PXE ROM: a request or ACK is
+ *	sent Storm_attempts times a Storm_timeout_ms apart, a file which
+ *	failed is asked for again Storm_retry_ms per failure later,
+ *	Storm_step_tries in all before the client counts as failed to boot
+ */
+constexpr Time Storm_timeout_ms = 1000;
+constexpr Time Storm_retry_ms = 1000;
+constexpr I32 Storm_attempts = 5;
+constexpr I32 Storm_step_tries = 3;
+constexpr size_t Storm_clients_default = 100;
+constexpr Time Storm_ramp_ms_default = 1000;
+constexpr Time Storm_think_ms_default = 100;
+// What most PXE ROMs ask for, a block fits a 1500 byte MTU
+constexpr I32 Storm_blksize_default = 1456;
+// Files prefixed with this may be missing, as configs probed by name are
+const char Storm_optional_prefix = '?';
+
+struct Storm_settings
+{
+	Address server;
+	size_t clients{ Storm_clients_default };
+	// Got in order by every client, e.g. loader, configs, kernel, initrd
+	vector<string> files;
+	// Clients power on spread evenly over the ramp
+	Time ramp_ms{ Storm_ramp_ms_default };
+	// Pause before each file, drawn from [think / 2, think * 3 / 2]
+	Time think_ms{ Storm_think_ms_default };
+	// Share of datagrams dropped, each way
+	double loss{ 0.0 };
+	I32 block_size{ Storm_blksize_default };
+	I32 window{ 1 };
+	// The first file is asked for its tsize and aborted first, as PXE ROMs do
+	bool probe{ true };
+	U32 seed{ 1 };
+};
+
+struct Storm_report
+{
+	size_t clients{ 0 };
+	size_t booted{ 0 };
+	size_t failed{ 0 };
+	U64 transfers{ 0 };
+	U64 transfer_failures{ 0 };
+	U64 missing{ 0 };
+	U64 bytes{ 0 };
+	U64 requests{ 0 };
+	U64 retransmits{ 0 };
+	U64 timeouts{ 0 };
+	U64 dropped{ 0 };
+	Time elapsed_ms{ 0 };
+	// Server errors by code and message
+	std::map<string, U64> errors;
+	vector<Time> boot_ms;
+	vector<Time> transfer_ms;
+};
+
+/*
+ *	Percentiles of samples in ms
+ */
+inline string To_distribution_string(vector<Time> samples)
+{
+	if (samples.empty()) return "none";
+	std::sort(samples.begin(), samples.end());
+	auto at = [&samples](size_t percent) { return std::to_string(samples[(samples.size() - 1) * percent / 100]); };
+	return "p50 " + at(50) + " ms, p90 " + at(90) + " ms, p99 " + at(99) + " ms, max " +
+		std::to_string(samples.back()) + " ms";
+}
+
+inline string To_string(const Storm_report& report)
+{
+	U64 attempted = report.transfers + report.transfer_failures;
+	double seconds = std::max<Time>(1, report.elapsed_ms) / 1000.0;
+	std::ostringstream out;
+	out.precision(2);
+	out << std::fixed << report.clients << " clients, " << report.booted << " booted, " << report.failed
+		<< " failed in " << seconds << " s\n"
+		<< "Transfers " << report.transfers << " done, " << report.transfer_failures << " failed ("
+		<< (attempted == 0 ? 0.0 : 100.0 * report.transfer_failures / attempted) << "%), "
+		<< report.missing << " optional missing, " << report.bytes / 1024 << " KiB at "
+		<< report.bytes / 1024 / seconds << " KiB/s\n"
+		<< "Boot time " << To_distribution_string(report.boot_ms) << "\n"
+		<< "Transfer time " << To_distribution_string(report.transfer_ms) << "\n"
+		<< "Requests " << report.requests << ", retransmits " << report.retransmits << ", timeouts "
+		<< report.timeouts << ", dropped " << report.dropped;
+	for (auto& error : report.errors) out << "\nServer error " << error.first << ": " << error.second;
+	return out.str();
+}
+
+/*
+ *	Emulates a storm of network boot clients against a server from one
+ *	thread: every client has a socket (source port) of its own, all are
+ *	polled together and their timeouts and think times run on one
+ *	timer wheel, so thousands of sessions cost no thread each.
+ *
+ *	A client powers on, gets each file in turn with the options a PXE
+ *	ROM sends (tsize, blksize, windowsize when above 1), waits a think
+ *	time between files and ACKs every window as a RFC 7440 receiver.
+ *	Contents are only counted. Loss is simulated by dropping datagrams
+ *	before they are sent or after they are received.
+ */
+class Tftp_storm
+{
+public:
+	explicit Tftp_storm(const Storm_settings& settings)
+		: settings(settings), random(settings.seed)
+	{
+	}
+	~Tftp_storm()
+	{
+		for (auto& client : clients)
+		{
+			if (client.socket >= 0) close(client.socket);
+		}
+	}
+	Tftp_storm(const Tftp_storm& other) = delete;
+
+	/*
+	 *	Runs until every client booted or gave up, false when the
+	 *	sockets could not be opened
+	 */
+	bool run(Storm_report& out)
+	{
+		report = Storm_report();
+		report.clients = settings.clients;
+		if (settings.files.empty() || !open_sockets()) return false;
+
+		Time started = Now_ms();
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			Time offset = settings.ramp_ms * i / std::max<size_t>(1, clients.size());
+			clients[i].timer = timers.schedule(started + offset, i);
+		}
+
+		Tftp_packet packet;
+		while (finished < clients.size())
+		{
+			I32 timeout = -1;
+			Time deadline = timers.next_expiry();
+			if (deadline != Time_never)
+			{
+				Time now = Now_ms();
+				timeout = deadline > now ? static_cast<I32>(deadline - now) : 0;
+			}
+			if (poll(descriptors.data(), descriptors.size(), timeout) < 0 && errno != EINTR)
+			{
+				Err("Storm poll failed");
+				return false;
+			}
+			for (size_t i = 0; i < descriptors.size(); ++i)
+			{
+				if (descriptors[i].revents & (POLLIN | POLLERR)) receive(i, packet);
+			}
+			timers.advance(Now_ms(), [this](U64 id) { on_timer(static_cast<size_t>(id)); });
+		}
+		report.elapsed_ms = Now_ms() - started;
+		out = std::move(report);
+		return true;
+	}
+
+private:
+	enum class State : I32
+	{
+		Waiting,
+		Requesting,
+		Receiving,
+		Done,
+	};
+
+	struct Client
+	{
+		size_t index{ 0 };
+		I32 socket{ -1 };
+		State state{ State::Waiting };
+		size_t step{ 0 };
+		I32 step_tries{ 0 };
+		bool probing{ false };
+		bool probed{ false };
+		Address peer;
+		bool peer_known{ false };
+		// Session left last (probe aborted, file got), whatever it still sends is ignored
+		Address stale_peer;
+		bool stale_known{ false };
+		U64 expected{ 1 };
+		I32 block_size{ Tftp_packet_data_size };
+		I32 window{ 1 };
+		I32 window_received{ 0 };
+		I32 attempts{ 0 };
+		Tftp_packet last_sent;
+		Time boot_started{ 0 };
+		Time transfer_started{ 0 };
+		Timer_wheel::Timer_id timer{ Timer_wheel::No_timer };
+	};
+
+	/*
+	 *	One socket per client, the descriptor limit is raised to fit
+	 */
+	bool open_sockets()
+	{
+		rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < settings.clients + 64)
+		{
+			limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, settings.clients + 64);
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+
+		clients.resize(settings.clients);
+		descriptors.resize(settings.clients);
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			clients[i].index = i;
+			clients[i].socket = socket(settings.server.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (clients[i].socket < 0)
+			{
+				Err("Could not open socket " + std::to_string(i + 1) + " of " + std::to_string(clients.size()) +
+					", raise the descriptor limit");
+				return false;
+			}
+			descriptors[i] = { clients[i].socket, POLLIN, 0 };
+		}
+		return true;
+	}
+
+	bool drop()
+	{
+		if (settings.loss <= 0.0) return false;
+		if (std::uniform_real_distribution<double>(0.0, 1.0)(random) >= settings.loss) return false;
+		++report.dropped;
+		return true;
+	}
+
+	void send(Client& client, const Tftp_packet& packet)
+	{
+		if (drop()) return;
+		const Address& to = client.peer_known ? client.peer : settings.server;
+		sendto(client.socket, packet.raw_data(), packet.size(), 0, to.data(), to.length);
+	}
+
+	/*
+	 *	Sent again on timeout
+	 */
+	void send_tracked(Client& client, const Tftp_packet& packet)
+	{
+		client.last_sent = packet;
+		client.attempts = 0;
+		send(client, packet);
+		arm(client, Now_ms() + Storm_timeout_ms, client.index);
+	}
+
+	void arm(Client& client, Time deadline, size_t index)
+	{
+		timers.cancel(client.timer);
+		client.timer = timers.schedule(deadline, index);
+	}
+
+	/*
+	 *	Errors the request port sent (busy) do not make it stale
+	 */
+	void leave_session(Client& client)
+	{
+		if (!client.peer_known || client.peer == settings.server) return;
+		client.stale_peer = client.peer;
+		client.stale_known = true;
+	}
+
+	void think(Client& client, Time backoff = 0)
+	{
+		leave_session(client);
+		client.state = State::Waiting;
+		Time pause = settings.think_ms == 0 ? 0 :
+			settings.think_ms / 2 + random() % (settings.think_ms + 1);
+		arm(client, Now_ms() + backoff + pause, client.index);
+	}
+
+	void start_step(Client& client)
+	{
+		if (client.step == 0 && client.step_tries == 0 && !client.probed) client.boot_started = Now_ms();
+		if (client.step == settings.files.size())
+		{
+			finish(client, true);
+			return;
+		}
+
+		string file_name = settings.files[client.step];
+		if (!file_name.empty() && file_name[0] == Storm_optional_prefix) file_name.erase(0, 1);
+		client.probing = settings.probe && client.step == 0 && !client.probed;
+		client.peer_known = false;
+		client.expected = 1;
+		client.block_size = Tftp_packet_data_size;
+		client.window = 1;
+		client.window_received = 0;
+		if (!client.probed || client.step != 0) client.transfer_started = Now_ms();
+
+		Tftp_options options;
+		options.emplace_back(Tftp_option_tsize, "0");
+		if (settings.block_size != Tftp_packet_data_size) options.emplace_back(Tftp_option_blksize, std::to_string(settings.block_size));
+		if (settings.window > 1) options.emplace_back(Tftp_option_windowsize, std::to_string(settings.window));
+		client.state = State::Requesting;
+		++report.requests;
+		send_tracked(client, Create_read(file_name, Tftp_mode::Octet, options));
+	}
+
+	void finish(Client& client, bool booted)
+	{
+		timers.cancel(client.timer);
+		client.timer = Timer_wheel::No_timer;
+		client.state = State::Done;
+		descriptors[client.index].fd = -1;
+		if (booted)
+		{
+			++report.booted;
+			report.boot_ms.push_back(Now_ms() - client.boot_started);
+		}
+		else
+		{
+			++report.failed;
+		}
+		++finished;
+	}
+
+	/*
+	 *	The file is asked for again after a think time while tries are
+	 *	left, the boot fails otherwise
+	 */
+	void fail_step(Client& client)
+	{
+		++report.transfer_failures;
+		if (++client.step_tries >= Storm_step_tries)
+		{
+			finish(client, false);
+			return;
+		}
+		think(client, Storm_retry_ms * client.step_tries);
+	}
+
+	void complete_step(Client& client)
+	{
+		++report.transfers;
+		report.transfer_ms.push_back(Now_ms() - client.transfer_started);
+		++client.step;
+		client.step_tries = 0;
+		think(client);
+	}
+
+	void on_timer(size_t index)
+	{
+		Client& client = clients[index];
+		client.timer = Timer_wheel::No_timer;
+		if (client.state == State::Waiting)
+		{
+			start_step(client);
+			return;
+		}
+		if (client.state == State::Done) return;
+		if (++client.attempts >= Storm_attempts)
+		{
+			++report.timeouts;
+			fail_step(client);
+			return;
+		}
+		++report.retransmits;
+		send(client, client.last_sent);
+		client.timer = timers.schedule(Now_ms() + Storm_timeout_ms, index);
+	}
+
+	void receive(size_t index, Tftp_packet& packet)
+	{
+		Client& client = clients[index];
+		Address from;
+		while (true)
+		{
+			from.length = sizeof(from.storage);
+			ssize_t received = recvfrom(client.socket, packet.raw_data(), Tftp_packet::capacity(),
+				MSG_DONTWAIT, from.data(), &from.length);
+			if (received < 0) return;
+			if (!packet.resize(static_cast<I32>(received)) || packet.size() < 4 || drop()) continue;
+			if (client.state == State::Done) continue;
+			if (client.state == State::Waiting)
+			{
+				// The final ACK was lost, the server sends the last block again
+				if (client.peer_known && from == client.peer && packet.get_op() == Tftp_operation::Data) send(client, client.last_sent);
+				continue;
+			}
+			if (client.stale_known && from == client.stale_peer) continue;
+			if (!client.peer_known)
+			{
+				client.peer = from;
+				client.peer_known = true;
+			}
+			else if (from != client.peer)
+			{
+				continue;
+			}
+			handle(client, packet);
+		}
+	}
+
+	void handle(Client& client, const Tftp_packet& packet)
+	{
+		switch (packet.get_op())
+		{
+		case Tftp_operation::Error:
+			on_error(client, packet);
+			break;
+		case Tftp_operation::Oack:
+			if (client.state == State::Requesting) on_oack(client, packet);
+			break;
+		case Tftp_operation::Data:
+			on_data(client, packet);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void on_error(Client& client, const Tftp_packet& packet)
+	{
+		auto error = static_cast<Tftp_error>(packet.get_word(2));
+		string reason = To_string(error);
+		string message = packet.size() > 5 ? packet.get_string(4, packet.size() - 5) : "";
+		if (!message.empty() && message != reason) reason += ": " + message;
+		++report.errors[reason];
+
+		const string& file_name = settings.files[client.step];
+		if (error == Tftp_error::Error_1 && !file_name.empty() && file_name[0] == Storm_optional_prefix)
+		{
+			++report.missing;
+			++client.step;
+			client.step_tries = 0;
+			think(client);
+			return;
+		}
+		fail_step(client);
+	}
+
+	/*
+	 *	Only the size was wanted, the file is asked for again right away
+	 */
+	void abort_probe(Client& client)
+	{
+		send(client, Create_error(To_word(Tftp_error::Error_8), "tsize probe"));
+		client.probed = true;
+		leave_session(client);
+		start_step(client);
+	}
+
+	void on_oack(Client& client, const Tftp_packet& packet)
+	{
+		Tftp_options options;
+		Get_options(packet, 2, options);
+		if (client.probing)
+		{
+			abort_probe(client);
+			return;
+		}
+		if (const string* size = Find_option(options, Tftp_option_blksize)) client.block_size = std::atoi(size->c_str());
+		if (const string* size = Find_option(options, Tftp_option_windowsize)) client.window = std::max(1, std::atoi(size->c_str()));
+		if (client.block_size < Tftp_blksize_min || client.block_size > Tftp_packet_blksize_max)
+		{
+			send(client, Create_error(To_word(Tftp_error::Error_8), "Bad blksize"));
+			fail_step(client);
+			return;
+		}
+		client.state = State::Receiving;
+		send_tracked(client, Create_ack(0));
+	}
+
+	void on_data(Client& client, const Tftp_packet& packet)
+	{
+		if (client.state == State::Requesting)
+		{
+			// Options ignored, plain RFC 1350 transfer
+			if (client.probing)
+			{
+				abort_probe(client);
+				return;
+			}
+			client.state = State::Receiving;
+		}
+
+		U64 block = Unwrap_block(packet.get_word(2), client.expected);
+		if (block != client.expected)
+		{
+			// Duplicate or gap, acknowledge what arrived in order
+			client.window_received = 0;
+			send_tracked(client, Create_ack(static_cast<Word>(client.expected - 1)));
+			return;
+		}
+
+		I32 length = packet.size() - Tftp_packet_header_size;
+		report.bytes += length;
+		++client.expected;
+		if (length < client.block_size)
+		{
+			client.last_sent = Create_ack(static_cast<Word>(block));
+			send(client, client.last_sent);
+			complete_step(client);
+			return;
+		}
+		if (++client.window_received >= client.window)
+		{
+			client.window_received = 0;
+			send_tracked(client, Create_ack(static_cast<Word>(block)));
+			return;
+		}
+		client.attempts = 0;
+		arm(client, Now_ms() + Storm_timeout_ms, client.index);
+	}
+
+	Storm_settings settings;
+	std::mt19937 random;
+	vector<Client> clients;
+	vector<pollfd> descriptors;
+	Timer_wheel timers;
+	size_t finished{ 0 };
+	Storm_report report;
+};
+
+}
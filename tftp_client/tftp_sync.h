@@ -0,0 +1,602 @@
+#pragma once
+
+#include "tftp_client.h"
+#include "tftp_file.h"
+
+#include <algorithm>
+#include <filesystem>
+
+namespace tftp
+{
+
+constexpr I32 Tftp_sync_sessions_default = 4;
+constexpr I32 Tftp_sync_sessions_max = 16;
+constexpr U64 Tftp_stripe_bytes_min = 1 << 20;
+constexpr U64 Tftp_stripes_per_session = 4;
+constexpr I32 Tftp_stripe_attempts = 2;
+
+/*
+ *	One file of a sync, checksums are CRC32C as kept in sidecars
+ */
+struct Sync_entry
+{
+	string local_name;
+	string remote_name;
+	U64 local_size{ 0 };
+	U64 remote_size{ 0 };
+	bool remote_exists{ false };
+	U32 local_checksum{ 0 };
+	bool has_local_checksum{ false };
+	U32 remote_checksum{ 0 };
+	bool has_remote_checksum{ false };
+	bool skip{ false };
+	bool failed{ false };
+};
+
+/*
+ *	Byte range of a striped get, a multiple of the block size except
+ *	for the last one
+ */
+struct Stripe
+{
+	U64 offset{ 0 };
+	U64 length{ 0 };
+	bool done{ false };
+};
+
+struct Sync_stats
+{
+	U64 files{ 0 };
+	U64 skipped{ 0 };
+	U64 transferred{ 0 };
+	U64 failed{ 0 };
+	U64 bytes{ 0 };
+	Time elapsed_ms{ 0 };
+};
+
+inline string To_string(const Sync_stats& stats)
+{
+	return "files " + std::to_string(stats.files) +
+		", unchanged " + std::to_string(stats.skipped) +
+		", transferred " + std::to_string(stats.transferred) +
+		" (" + std::to_string(stats.bytes) + " bytes)" +
+		", failed " + std::to_string(stats.failed) +
+		", " + std::to_string(stats.elapsed_ms) + " ms";
+}
+
+/*
+ *	Private directory (mkdtemp, mode 0700) the sessions keep the file
+ *	list and sidecars they pass through in, removed with its contents
+ */
+class Scratch_directory
+{
+public:
+	Scratch_directory() = default;
+	~Scratch_directory() { remove(); }
+	Scratch_directory(const Scratch_directory& other) = delete;
+
+	bool create(const string& parent)
+	{
+		remove();
+		string pattern = (std::filesystem::path(parent.empty() ? "." : parent) / ".tftp_sync.XXXXXX").string();
+		if (!mkdtemp(&pattern[0])) return false;
+		path = pattern;
+		return true;
+	}
+
+	void remove()
+	{
+		if (path.empty()) return;
+		std::error_code error;
+		std::filesystem::remove_all(path, error);
+		path.clear();
+	}
+
+	const string& get_path() const { return path; }
+
+private:
+	string path;
+};
+
+/*
+ *	Mirrors a directory tree to or from the server over parallel
+ *	sessions. Each session is a client of its own (socket, listen and
+ *	execute thread) so transfers run side by side with distinct TIDs.
+ *	Sessions are spread over the healthy mirrors fastest first, and
+ *	each one fails over on its own when its mirror stops answering.
+ *
+ *	A file is unchanged when the size the other side reports (tsize)
+ *	matches and the CRC32C sidecars agree. Whatever remains is sent
+ *	largest first so the long transfers do not end up last. Sidecars
+ *	are written next to every synced file for the next run.
+ *
+ *	Names in a remote list are taken relative to the local directory
+ *	as the server takes them (Relative_name), others are refused.
+ *	Scratch files live in a Scratch_directory next to what is written,
+ *	or in the system temporary directory for a put.
+ *
+ *	A single large file is got striped instead: the sessions fetch
+ *	disjoint byte ranges of it (offset / length options) straight into
+ *	their part of the local file.
+ */
+class Tftp_sync
+{
+public:
+	Tftp_sync(const Server_list& servers, I32 sessions)
+		: servers(servers), session_count(std::min(std::max(sessions, 1), Tftp_sync_sessions_max))
+	{}
+	~Tftp_sync() { stop(); }
+	Tftp_sync(const Tftp_sync& other) = delete;
+
+	/*
+	 *	Connects the sessions using the transfer settings of client
+	 */
+	bool start(const Tftp_client& settings)
+	{
+		vector<Address> ranking = servers.ranking(AF_UNSPEC);
+		size_t healthy = std::count_if(ranking.begin(), ranking.end(),
+			[this](const Address& address) { return servers.is_healthy(address); });
+		if (ranking.empty()) return false;
+
+		for (I32 i = 0; i < session_count; ++i)
+		{
+			auto session = std::make_unique<Session>();
+			session->index = i;
+			session->client.set_mode(settings.get_mode());
+			session->client.set_window_size(settings.get_window_size());
+			session->client.set_block_size(settings.get_block_size());
+			session->client.set_tuning(settings.is_tuning());
+			session->client.set_rate(settings.get_rate());
+			session->client.set_verbose(settings.is_verbose());
+			session->client.set_servers(servers);
+			if (!session->client.connect_to_server(ranking[i % std::max<size_t>(healthy, 1)]))
+			{
+				stop();
+				return false;
+			}
+			Session* started = session.get();
+			session->daemon = Thread([started]() { started->client.run_daemon(); });
+			sessions.push_back(std::move(session));
+		}
+		return true;
+	}
+
+	void stop()
+	{
+		for (auto& session : sessions)
+		{
+			Tftp_command quit;
+			quit.type = Tftp_command::Type::Quit;
+			session->client.order(quit);
+		}
+		for (auto& session : sessions)
+		{
+			if (session->daemon.joinable()) session->daemon.join();
+		}
+		sessions.clear();
+		scratch.remove();
+	}
+
+	/*
+	 *	Uploads every file under local_root to remote_root/<relative path>
+	 */
+	bool put_directory(const string& local_root, const string& remote_root, Sync_stats& stats)
+	{
+		Time start = Now_ms();
+		vector<Sync_entry> entries;
+		std::error_code error;
+		if (!open_scratch(std::filesystem::temp_directory_path(error).string())) return false;
+		for (std::filesystem::recursive_directory_iterator it(local_root, error), end; !error && it != end; it.increment(error))
+		{
+			if (!it->is_regular_file()) continue;
+			string relative = it->path().lexically_relative(local_root).generic_string();
+			if (Is_sidecar(relative)) continue;
+
+			Sync_entry entry;
+			entry.local_name = it->path().string();
+			entry.remote_name = remote_root.empty() ? relative : remote_root + "/" + relative;
+			entry.local_size = it->file_size();
+			entries.push_back(entry);
+		}
+		if (error)
+		{
+			Err("Could not read directory " + local_root + ": " + error.message());
+			return false;
+		}
+
+		parallel(entries, [this](Session& session, Sync_entry& entry)
+		{
+			entry.has_local_checksum = File_checksum(entry.local_name, entry.local_checksum);
+			if (!entry.has_local_checksum)
+			{
+				Err("Could not read " + entry.local_name);
+				entry.failed = true;
+				return;
+			}
+			entry.remote_exists = run(session, Size_command(entry.remote_name), &entry.remote_size);
+			if (!entry.remote_exists || entry.remote_size != entry.local_size) return;
+			entry.has_remote_checksum = fetch_checksum(session, entry.remote_name, entry.remote_checksum);
+			entry.skip = entry.has_remote_checksum && entry.remote_checksum == entry.local_checksum;
+		});
+
+		std::sort(entries.begin(), entries.end(), [](const Sync_entry& a, const Sync_entry& b)
+		{
+			return a.local_size > b.local_size;
+		});
+
+		parallel(entries, [this](Session& session, Sync_entry& entry)
+		{
+			if (entry.skip || entry.failed) return;
+
+			Tftp_command command;
+			command.type = Tftp_command::Type::Send_file;
+			command.file_name = entry.local_name;
+			command.destination_name = entry.remote_name;
+			command.verify = true;
+			command.expected_checksum = entry.local_checksum;
+			entry.failed = !run(session, command) ||
+				!put_checksum(session, entry.remote_name, entry.local_checksum);
+			if (!entry.failed) entry.remote_size = entry.local_size;
+		});
+
+		account(entries, stats, start);
+		return stats.failed == 0;
+	}
+
+	/*
+	 *	Downloads the files named in remote_list, one per line, to
+	 *	local_root/<name>
+	 */
+	bool get_list(const string& remote_list, const string& local_root, Sync_stats& stats)
+	{
+		Time start = Now_ms();
+		vector<Sync_entry> entries;
+		std::error_code error;
+		std::filesystem::create_directories(local_root, error);
+		if (!open_scratch(local_root)) return false;
+		{
+			Session& session = *sessions.front();
+			string list_name = temporary_name(session);
+			Tftp_command command;
+			command.type = Tftp_command::Type::Get_file;
+			command.file_name = remote_list;
+			command.destination_name = list_name;
+			if (!run(session, command))
+			{
+				Err("Could not get file list " + remote_list);
+				return false;
+			}
+			std::ifstream list(list_name);
+			string line;
+			while (std::getline(list, line))
+			{
+				while (!line.empty() && isspace(static_cast<unsigned char>(line.back()))) line.pop_back();
+				if (line.empty() || line[0] == '#') continue;
+
+				Sync_entry entry;
+				entry.remote_name = line;
+				string relative;
+				if (Relative_name(line, relative))
+				{
+					entry.local_name = (std::filesystem::path(local_root) / relative).string();
+				}
+				else
+				{
+					Err("Refusing " + line + " from " + remote_list + ", it leads out of " + local_root);
+					entry.failed = true;
+				}
+				entries.push_back(entry);
+			}
+			std::filesystem::remove(list_name, error);
+		}
+
+		parallel(entries, [this](Session& session, Sync_entry& entry)
+		{
+			if (entry.failed) return;
+			entry.remote_exists = run(session, Size_command(entry.remote_name), &entry.remote_size);
+			if (!entry.remote_exists)
+			{
+				entry.failed = true;
+				return;
+			}
+			entry.has_remote_checksum = fetch_checksum(session, entry.remote_name, entry.remote_checksum);
+
+			std::error_code error;
+			entry.local_size = std::filesystem::file_size(entry.local_name, error);
+			if (error || entry.local_size != entry.remote_size || !entry.has_remote_checksum) return;
+			entry.has_local_checksum = File_checksum(entry.local_name, entry.local_checksum);
+			entry.skip = entry.has_local_checksum && entry.local_checksum == entry.remote_checksum;
+		});
+
+		std::sort(entries.begin(), entries.end(), [](const Sync_entry& a, const Sync_entry& b)
+		{
+			return a.remote_size > b.remote_size;
+		});
+
+		parallel(entries, [this](Session& session, Sync_entry& entry)
+		{
+			if (entry.skip || entry.failed) return;
+			get_entry(session, entry);
+		});
+
+		account(entries, stats, start);
+		return stats.failed == 0;
+	}
+
+	/*
+	 *	Downloads remote_name to local_name over all sessions at once,
+	 *	verified against the remote sidecar when there is one. Against a
+	 *	server which does not serve byte ranges, or once a stripe failed
+	 *	every attempt, the file is got whole by a single session.
+	 */
+	bool get_striped(const string& remote_name, const string& local_name, Sync_stats& stats)
+	{
+		Time start = Now_ms();
+		vector<Sync_entry> entries(1);
+		Sync_entry& entry = entries.front();
+		Session& session = *sessions.front();
+		std::filesystem::path parent = std::filesystem::path(local_name).parent_path();
+		std::error_code error;
+		if (!parent.empty()) std::filesystem::create_directories(parent, error);
+		if (!open_scratch(parent.string())) return false;
+		entry.remote_name = remote_name;
+		entry.local_name = local_name;
+		entry.remote_exists = run(session, Size_command(remote_name), &entry.remote_size);
+		if (!entry.remote_exists)
+		{
+			Err("Could not get the size of " + remote_name);
+			entry.failed = true;
+		}
+		else
+		{
+			entry.has_remote_checksum = fetch_checksum(session, remote_name, entry.remote_checksum);
+			if (!get_stripes(entry))
+			{
+				Log("Getting " + remote_name + " over a single session");
+				get_entry(session, entry);
+			}
+		}
+		account(entries, stats, start);
+		return stats.failed == 0;
+	}
+
+private:
+	struct Session
+	{
+		Tftp_client client;
+		Thread daemon;
+		I32 index{ 0 };
+	};
+
+	/*
+	 *	Completion of an ordered command, shared with the callback so
+	 *	a session shutting down mid command cannot leave it dangling
+	 */
+	struct Completion
+	{
+		Mutex mutex;
+		Condition condition;
+		bool finished{ false };
+		bool succeeded{ false };
+		U64 size{ 0 };
+	};
+
+	static bool Is_sidecar(const string& name)
+	{
+		const string suffix = Checksum_sidecar("");
+		return name.size() >= suffix.size() &&
+			name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	static Tftp_command Size_command(const string& remote_name)
+	{
+		Tftp_command command;
+		command.type = Tftp_command::Type::Get_size;
+		command.file_name = remote_name;
+		return command;
+	}
+
+	/*
+	 *	Runs command on the session and waits for it to finish
+	 */
+	bool run(Session& session, Tftp_command command, U64* size = nullptr)
+	{
+		auto completion = std::make_shared<Completion>();
+		command.done = [completion](const Tftp_command&, bool succeeded, U64 transferred)
+		{
+			{
+				Mutex_guard gate_out(completion->mutex);
+
+				completion->finished = true;
+				completion->succeeded = succeeded;
+				completion->size = transferred;
+			}
+			completion->condition.notify_one();
+		};
+		session.client.order(command);
+
+		Unique_lock gate_in(completion->mutex);
+		while (!completion->finished)
+		{
+			if (!session.client.is_running()) return false;
+			completion->condition.wait_for(gate_in, std::chrono::milliseconds(100));
+		}
+		if (size) *size = completion->size;
+		return completion->succeeded;
+	}
+
+	bool open_scratch(const string& parent)
+	{
+		if (scratch.create(parent)) return true;
+		Err("Could not create a scratch directory in " + (parent.empty() ? string(".") : parent));
+		return false;
+	}
+
+	string temporary_name(const Session& session) const
+	{
+		return scratch.get_path() + "/session_" + std::to_string(session.index);
+	}
+
+	bool fetch_checksum(Session& session, const string& remote_name, U32& out)
+	{
+		string local_name = temporary_name(session);
+		Tftp_command command;
+		command.type = Tftp_command::Type::Get_file;
+		command.file_name = Checksum_sidecar(remote_name);
+		command.destination_name = Checksum_sidecar(local_name);
+		return run(session, command) && Read_checksum_sidecar(local_name, out);
+	}
+
+	bool put_checksum(Session& session, const string& remote_name, U32 checksum)
+	{
+		string local_name = temporary_name(session);
+		if (!Write_checksum_sidecar(local_name, checksum, std::filesystem::path(remote_name).filename().string()))
+		{
+			return false;
+		}
+		Tftp_command command;
+		command.type = Tftp_command::Type::Send_file;
+		command.file_name = Checksum_sidecar(local_name);
+		command.destination_name = Checksum_sidecar(remote_name);
+		return run(session, command);
+	}
+
+	/*
+	 *	Gets entry whole and writes its sidecar, replacing the local file
+	 */
+	void get_entry(Session& session, Sync_entry& entry)
+	{
+		std::error_code error;
+		std::filesystem::path local(entry.local_name);
+		if (local.has_parent_path()) std::filesystem::create_directories(local.parent_path(), error);
+		// A sidecar left from an older version would fail the verification
+		std::filesystem::remove(Checksum_sidecar(entry.local_name), error);
+
+		Tftp_command command;
+		command.type = Tftp_command::Type::Get_file;
+		command.file_name = entry.remote_name;
+		command.destination_name = entry.local_name;
+		command.verify = entry.has_remote_checksum;
+		command.expected_checksum = entry.remote_checksum;
+		entry.failed = !run(session, command);
+		if (!entry.failed) entry.local_size = entry.remote_size;
+		if (!entry.failed && entry.has_remote_checksum)
+		{
+			Write_checksum_sidecar(entry.local_name, entry.remote_checksum, local.filename().string());
+		}
+	}
+
+	/*
+	 *	Gets entry as byte ranges spread over the sessions into a local
+	 *	file preallocated to the remote size. Each session takes the next
+	 *	stripe once it is done with one, so faster mirrors take more.
+	 */
+	bool get_stripes(Sync_entry& entry)
+	{
+		U64 stripe_count = sessions.size() * Tftp_stripes_per_session;
+		U64 stripe_bytes = std::max(Tftp_stripe_bytes_min, (entry.remote_size + stripe_count - 1) / stripe_count);
+		stripe_bytes = (stripe_bytes + Tftp_packet_data_size - 1) / Tftp_packet_data_size * Tftp_packet_data_size;
+		if (sessions.size() < 2 || entry.remote_size < 2 * stripe_bytes) return false;
+
+		std::error_code error;
+		std::filesystem::path local(entry.local_name);
+		if (local.has_parent_path()) std::filesystem::create_directories(local.parent_path(), error);
+		std::filesystem::remove(Checksum_sidecar(entry.local_name), error);
+		{
+			std::ofstream out(entry.local_name, std::ofstream::binary | std::ofstream::trunc);
+			if (!out.good()) return false;
+		}
+		std::filesystem::resize_file(entry.local_name, entry.remote_size, error);
+		if (error) return false;
+
+		vector<Stripe> stripes;
+		for (U64 offset = 0; offset < entry.remote_size; offset += stripe_bytes)
+		{
+			Stripe stripe;
+			stripe.offset = offset;
+			stripe.length = std::min(stripe_bytes, entry.remote_size - offset);
+			stripes.push_back(stripe);
+		}
+		Log("Getting " + entry.remote_name + " in " + std::to_string(stripes.size()) + " stripes over " +
+			std::to_string(sessions.size()) + " sessions");
+
+		std::atomic<bool> failed{ false };
+		parallel(stripes, [this, &entry, &failed](Session& session, Stripe& stripe)
+		{
+			Tftp_command command;
+			command.type = Tftp_command::Type::Get_file;
+			command.file_name = entry.remote_name;
+			command.destination_name = entry.local_name;
+			command.ranged = true;
+			command.offset = stripe.offset;
+			command.length = stripe.length;
+			for (I32 attempt = 0; attempt < Tftp_stripe_attempts && !stripe.done && !failed; ++attempt)
+			{
+				U64 size{ 0 };
+				stripe.done = run(session, command, &size) && size == stripe.length;
+			}
+			if (!stripe.done) failed = true;
+		});
+		if (failed) return false;
+
+		U32 checksum{ 0 };
+		if (entry.has_remote_checksum &&
+			(!File_checksum(entry.local_name, checksum) || checksum != entry.remote_checksum))
+		{
+			Err("Checksum mismatch in stripes of " + entry.remote_name);
+			return false;
+		}
+		entry.local_size = entry.remote_size;
+		if (entry.has_remote_checksum)
+		{
+			Write_checksum_sidecar(entry.local_name, entry.remote_checksum, local.filename().string());
+		}
+		return true;
+	}
+
+	/*
+	 *	Hands items to the sessions in order, each session takes the
+	 *	next one as soon as it is free
+	 */
+	template <typename Item, typename Work>
+	void parallel(vector<Item>& items, Work work)
+	{
+		std::atomic<size_t> next{ 0 };
+		vector<Thread> workers;
+		for (auto& session : sessions)
+		{
+			Session* worker_session = session.get();
+			workers.emplace_back([&items, &next, &work, worker_session]()
+			{
+				for (size_t i = next++; i < items.size(); i = next++)
+				{
+					work(*worker_session, items[i]);
+				}
+			});
+		}
+		for (auto& worker : workers) worker.join();
+	}
+
+	static void account(const vector<Sync_entry>& entries, Sync_stats& stats, Time start)
+	{
+		for (auto& entry : entries)
+		{
+			++stats.files;
+			if (entry.failed) ++stats.failed;
+			else if (entry.skip) ++stats.skipped;
+			else
+			{
+				++stats.transferred;
+				stats.bytes += entry.local_size;
+			}
+		}
+		stats.elapsed_ms = Now_ms() - start;
+	}
+
+	Server_list servers;
+	I32 session_count;
+	vector<std::unique_ptr<Session>> sessions;
+	Scratch_directory scratch;
+};
+
+}
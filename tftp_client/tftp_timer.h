@@ -0,0 +1,293 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <assert.h>
+
+namespace tftp
+{
+
+using Time = uint64_t;
+
+constexpr Time Time_never = std::numeric_limits<Time>::max();
+
+/*
+ *	Clock of a replay running on this thread, Time_never while the
+ *	thread runs on the real clock
+ */
+inline Time& Virtual_now_us()
+{
+	static thread_local Time now_us = Time_never;
+	return now_us;
+}
+
+inline Time Now_us()
+{
+	Time virtual_us = Virtual_now_us();
+	if (virtual_us != Time_never) return virtual_us;
+
+	using namespace std::chrono;
+	return static_cast<Time>(duration_cast<microseconds>(
+		steady_clock::now().time_since_epoch()).count());
+}
+
+inline Time Now_ms()
+{
+	return Now_us() / 1000;
+}
+
+/*
+ *	Puts the calling thread on a clock which only moves when told to,
+ *	so timers, RTT samples and pacing replay exactly
+ */
+class Virtual_clock
+{
+public:
+	explicit Virtual_clock(Time start_us) { Virtual_now_us() = start_us; }
+	~Virtual_clock() { Virtual_now_us() = Time_never; }
+	Virtual_clock(const Virtual_clock& other) = delete;
+
+	Time now_us() const { return Virtual_now_us(); }
+
+	void advance_to(Time at_us)
+	{
+		if (at_us > Virtual_now_us()) Virtual_now_us() = at_us;
+	}
+};
+
+/*
+ *	Hierarchical timer wheel
+ *
+ *	Level 0 holds timers due within the next Slots ticks, level N holds
+ *	timers due within Slots^(N + 1) ticks and is cascaded into the lower
+ *	levels whenever the level below wraps around. Scheduling and cancelling
+ *	are O(1), advancing is O(1) per tick plus the cascaded timers.
+ *
+ *	Timers carry an opaque cookie which is handed back on expiry, nodes
+ *	are recycled through a free list so steady state does not allocate.
+ */
+class Timer_wheel
+{
+public:
+	using Timer_id = U64;
+
+	static constexpr Timer_id No_timer = 0;
+
+	Timer_wheel(Time tick_ms = 1, Time now_ms = Now_ms())
+		: tick_ms(tick_ms), current(now_ms / tick_ms)
+	{
+		assert(tick_ms > 0);
+		for (auto& level : slots) level.fill(Nil);
+		level_count.fill(0);
+	}
+	~Timer_wheel() = default;
+	Timer_wheel(const Timer_wheel& other) = delete;
+
+	Timer_id schedule(Time deadline_ms, U64 cookie)
+	{
+		U32 index;
+		if (free_nodes.empty())
+		{
+			index = static_cast<U32>(nodes.size());
+			nodes.emplace_back();
+		}
+		else
+		{
+			index = free_nodes.back();
+			free_nodes.pop_back();
+		}
+
+		Node& node = nodes[index];
+		node.deadline = std::max(deadline_ms / tick_ms, current + 1);
+		node.cookie = cookie;
+		node.active = true;
+		++node.generation;
+		link(index);
+		++count;
+
+		return (static_cast<Timer_id>(node.generation) << 32) | index;
+	}
+
+	bool cancel(Timer_id id)
+	{
+		if (id == No_timer) return false;
+		U32 index = static_cast<U32>(id & 0xffffffff);
+		U32 generation = static_cast<U32>(id >> 32);
+		if (index >= nodes.size()) return false;
+
+		Node& node = nodes[index];
+		if (!node.active || node.generation != generation) return false;
+
+		unlink(index);
+		release(index);
+		return true;
+	}
+
+	/*
+	 *	Fires every timer due at or before now_ms, on_expire receives the
+	 *	cookie passed to schedule. Timers may be scheduled or cancelled
+	 *	from within on_expire.
+	 */
+	template<typename F>
+	void advance(Time now_ms, F&& on_expire)
+	{
+		Time target = now_ms / tick_ms;
+		while (current < target)
+		{
+			if (count == 0)
+			{
+				current = target;
+				break;
+			}
+			if (level_count[0] == 0)
+			{
+				// Nothing due on level 0, jump to the tick before the next cascade
+				Time boundary = (current | Slot_mask) + 1;
+				if (boundary - 1 > current) current = std::min(boundary - 1, target);
+				if (current == target) break;
+			}
+
+			++current;
+			cascade();
+
+			U32& head = slots[0][current & Slot_mask];
+			while (head != Nil)
+			{
+				U32 index = head;
+				unlink(index);
+				if (nodes[index].deadline > current)
+				{
+					// Clamped beyond the wheel range, not due yet
+					link(index);
+					continue;
+				}
+				U64 cookie = nodes[index].cookie;
+				release(index);
+				on_expire(cookie);
+			}
+		}
+	}
+
+	/*
+	 *	Earliest time advance should be called again, exact for timers on
+	 *	level 0 and the next cascade point otherwise
+	 */
+	Time next_expiry() const
+	{
+		if (count == 0) return Time_never;
+
+		Time cascade_tick = (current | Slot_mask) + 1;
+		if (level_count[0] > 0)
+		{
+			for (Time tick = current + 1; tick <= current + Slots; ++tick)
+			{
+				if (slots[0][tick & Slot_mask] != Nil)
+				{
+					if (level_count[0] == count) return tick * tick_ms;
+					return std::min(tick, cascade_tick) * tick_ms;
+				}
+			}
+		}
+		return cascade_tick * tick_ms;
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	static constexpr I32 Slot_bits = 6;
+	static constexpr I32 Slots = 1 << Slot_bits;
+	static constexpr Time Slot_mask = Slots - 1;
+	static constexpr I32 Levels = 4;
+	static constexpr U32 Nil = std::numeric_limits<U32>::max();
+
+	struct Node
+	{
+		Time deadline{ 0 };
+		U64 cookie{ 0 };
+		U32 prev{ Nil };
+		U32 next{ Nil };
+		U32 generation{ 0 };
+		I32 level{ 0 };
+		I32 slot{ 0 };
+		bool active{ false };
+	};
+
+	void link(U32 index)
+	{
+		Node& node = nodes[index];
+		Time delta = node.deadline - current;
+		I32 level = 0;
+		while (level + 1 < Levels && delta >= (Time{ 1 } << (Slot_bits * (level + 1))))
+		{
+			++level;
+		}
+		// Timers beyond the wheel range are parked at its end and relinked there
+		Time range = (Time{ 1 } << (Slot_bits * Levels)) - 1;
+		Time placed = delta > range ? current + range : node.deadline;
+
+		node.level = level;
+		node.slot = static_cast<I32>((placed >> (Slot_bits * level)) & Slot_mask);
+
+		U32& head = slots[level][node.slot];
+		node.prev = Nil;
+		node.next = head;
+		if (head != Nil) nodes[head].prev = index;
+		head = index;
+		++level_count[level];
+	}
+
+	void unlink(U32 index)
+	{
+		Node& node = nodes[index];
+		if (node.prev != Nil) nodes[node.prev].next = node.next;
+		else slots[node.level][node.slot] = node.next;
+		if (node.next != Nil) nodes[node.next].prev = node.prev;
+		node.prev = node.next = Nil;
+		--level_count[node.level];
+	}
+
+	void release(U32 index)
+	{
+		nodes[index].active = false;
+		free_nodes.push_back(index);
+		--count;
+	}
+
+	void cascade()
+	{
+		for (I32 level = 1; level < Levels; ++level)
+		{
+			Time mask = (Time{ 1 } << (Slot_bits * level)) - 1;
+			if ((current & mask) != 0) break;
+
+			U32& head = slots[level][(current >> (Slot_bits * level)) & Slot_mask];
+			U32 index = head;
+			head = Nil;
+			while (index != Nil)
+			{
+				U32 next = nodes[index].next;
+				--level_count[level];
+				link(index);
+				index = next;
+			}
+		}
+	}
+
+	Time tick_ms;
+	Time current;
+	size_t count{ 0 };
+
+	std::array<std::array<U32, Slots>, Levels> slots;
+	std::array<size_t, Levels> level_count;
+	vector<Node> nodes;
+	vector<U32> free_nodes;
+
+
+};
+
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace tftp
+{
+
+constexpr size_t Trace_ring_size = 1 << 16;
+
+enum class Trace_event : Byte
+{
+	Package_sent = 0,
+	Package_received = 1,
+	Package_queued = 2,
+	Package_dequeued = 3,
+	Disk_write = 4,
+	Disk_read = 5,
+	Retransmit = 6,
+	Timer_fire = 7,
+	Wait = 8,
+	Lock = 9,
+};
+
+inline const char* To_trace_name(Trace_event event)
+{
+	switch (event)
+	{
+	case Trace_event::Package_sent:
+		return "package sent";
+	case Trace_event::Package_received:
+		return "package received";
+	case Trace_event::Package_queued:
+		return "package queued";
+	case Trace_event::Package_dequeued:
+		return "packages dequeued";
+	case Trace_event::Disk_write:
+		return "disk write";
+	case Trace_event::Disk_read:
+		return "disk read";
+	case Trace_event::Retransmit:
+		return "retransmit";
+	case Trace_event::Timer_fire:
+		return "timer fire";
+	case Trace_event::Wait:
+		return "wait";
+	case Trace_event::Lock:
+		return "lock";
+	}
+	return "unknown";
+}
+
+/*
+ *	Name of the value recorded with each event in the exported trace
+ */
+inline const char* To_trace_argument(Trace_event event)
+{
+	switch (event)
+	{
+	case Trace_event::Package_sent:
+	case Trace_event::Package_received:
+	case Trace_event::Disk_write:
+	case Trace_event::Disk_read:
+		return "bytes";
+	case Trace_event::Package_queued:
+	case Trace_event::Package_dequeued:
+		return "packages";
+	case Trace_event::Retransmit:
+		return "block";
+	case Trace_event::Timer_fire:
+		return "timer";
+	case Trace_event::Wait:
+		return "timeout_ms";
+	case Trace_event::Lock:
+		return "value";
+	}
+	return "value";
+}
+
+/*
+ *	Fixed size ring of events written by a single thread, the oldest
+ *	events are overwritten once it is full
+ */
+struct Trace_ring
+{
+	struct Record
+	{
+		U64 time_ns;
+		U64 argument;
+		Trace_event event;
+		char phase;
+	};
+
+	string thread_name;
+	U32 thread_id{ 0 };
+	std::atomic<U64> written{ 0 };
+	std::unique_ptr<Record[]> records{ new Record[Trace_ring_size] };
+};
+
+/*
+ *	Process wide tracer: every thread writes to its own ring without
+ *	locking, enabling and disabling is a relaxed flag so disabled
+ *	tracing costs one load per event. Dump writes the Chrome trace
+ *	event format, loadable by chrome://tracing and Perfetto.
+ */
+class Tracer
+{
+public:
+	static Tracer& Instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+	void set_enabled(bool new_enabled) { enabled.store(new_enabled, std::memory_order_relaxed); }
+
+	void record(Trace_event event, char phase, U64 argument)
+	{
+		Trace_ring& ring = thread_ring();
+		U64 index = ring.written.load(std::memory_order_relaxed);
+		Trace_ring::Record& record = ring.records[index % Trace_ring_size];
+		record.time_ns = Now_ns();
+		record.argument = argument;
+		record.event = event;
+		record.phase = phase;
+		ring.written.store(index + 1, std::memory_order_release);
+	}
+
+	/*
+	 *	Rings are only allocated once a thread records, the name is
+	 *	kept until then
+	 */
+	void name_thread(const string& name)
+	{
+		Thread_name() = name;
+	}
+
+	/*
+	 *	Stops tracing and writes every ring, returns false on I/O failure
+	 */
+	bool dump(const string& file_name)
+	{
+		set_enabled(false);
+
+		std::ofstream out(file_name);
+		if (!out.good()) return false;
+
+		std::lock_guard<std::mutex> gate(mutex);
+		out << "{\"traceEvents\":[";
+		bool first = true;
+		for (auto& ring : rings)
+		{
+			out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+				<< ring->thread_id << ",\"args\":{\"name\":\"" << ring->thread_name << "\"}}";
+			first = false;
+
+			U64 written = ring->written.load(std::memory_order_acquire);
+			U64 begin = written > Trace_ring_size ? written - Trace_ring_size : 0;
+			for (U64 i = begin; i < written; ++i)
+			{
+				const Trace_ring::Record& record = ring->records[i % Trace_ring_size];
+				out << ",\n{\"name\":\"" << To_trace_name(record.event)
+					<< "\",\"ph\":\"" << record.phase
+					<< "\",\"ts\":" << record.time_ns / 1000 << "." << Fraction(record.time_ns % 1000)
+					<< ",\"pid\":1,\"tid\":" << ring->thread_id;
+				if (record.phase == 'i') out << ",\"s\":\"t\"";
+				out << ",\"args\":{\"" << To_trace_argument(record.event) << "\":" << record.argument << "}}";
+			}
+		}
+		out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+		return out.good();
+	}
+
+private:
+	Tracer() = default;
+
+	static U64 Now_ns()
+	{
+		using namespace std::chrono;
+		return static_cast<U64>(duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count());
+	}
+
+	static string Fraction(U64 ns)
+	{
+		string digits = std::to_string(ns);
+		return string(3 - digits.size(), '0') + digits;
+	}
+
+	static string& Thread_name()
+	{
+		static thread_local string name;
+		return name;
+	}
+
+	Trace_ring& thread_ring()
+	{
+		// Rings are shared with the registry so they survive their threads
+		static thread_local std::shared_ptr<Trace_ring> ring;
+		if (!ring)
+		{
+			ring = std::make_shared<Trace_ring>();
+			std::lock_guard<std::mutex> gate(mutex);
+			ring->thread_id = static_cast<U32>(rings.size() + 1);
+			ring->thread_name = Thread_name().empty() ?
+				"thread " + std::to_string(ring->thread_id) : Thread_name();
+			rings.push_back(ring);
+		}
+		return *ring;
+	}
+
+	std::atomic<bool> enabled{ false };
+	std::mutex mutex;
+	vector<std::shared_ptr<Trace_ring>> rings;
+};
+
+/*
+ *	Instant event
+ */
+inline void Trace(Trace_event event, U64 argument = 0)
+{
+	Tracer& tracer = Tracer::Instance();
+	if (tracer.is_enabled()) tracer.record(event, 'i', argument);
+}
+
+inline void Trace_thread(const string& name)
+{
+	Tracer::Instance().name_thread(name);
+}
+
+/*
+ *	Duration event covering the lifetime of the scope
+ */
+class Trace_scope
+{
+public:
+	Trace_scope(Trace_event event, U64 argument = 0)
+		: event(event), active(Tracer::Instance().is_enabled())
+	{
+		if (active) Tracer::Instance().record(event, 'B', argument);
+	}
+	~Trace_scope()
+	{
+		close();
+	}
+
+	/*
+	 *	Ends the event early, e.g. once a lock has been acquired
+	 */
+	void close()
+	{
+		if (active) Tracer::Instance().record(event, 'E', 0);
+		active = false;
+	}
+	Trace_scope(const Trace_scope& other) = delete;
+
+private:
+	Trace_event event;
+	bool active;
+};
+
+}
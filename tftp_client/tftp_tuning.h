@@ -0,0 +1,82 @@
+#pragma once
+
+#include "tftp_packet.h"
+#include "tftp_address.h"
+
+#include <algorithm>
+#include <netinet/in.h>
+
+namespace tftp
+{
+
+constexpr I32 Tftp_udp_header_size = 8;
+constexpr I32 Tftp_tune_window_initial = 8;
+/*
+ *	A get whose round trip grew past the factor (and by at least the
+ *	minimum) over the best seen on the path is queueing
+ */
+constexpr double Tftp_tune_delay_factor = 2.0;
+constexpr Time Tftp_tune_delay_min_us = 1000;
+
+/*
+ *	MTU of the route to address as the kernel knows it, IP_MTU on a
+ *	connected socket with path MTU discovery on so a PMTU learned from
+ *	ICMP counts rather than the interface MTU. 0 when unknown.
+ */
+inline I32 Path_mtu(const Address& address)
+{
+	bool v6 = address.family() == AF_INET6;
+	I32 level = v6 ? IPPROTO_IPV6 : IPPROTO_IP;
+	I32 probe = socket(address.family(), SOCK_DGRAM, 0);
+	if (probe < 0) return 0;
+
+	I32 discover = v6 ? IPV6_PMTUDISC_DO : IP_PMTUDISC_DO;
+	I32 mtu = 0;
+	socklen_t length = sizeof(mtu);
+	if (setsockopt(probe, level, v6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER, &discover, sizeof(discover)) != 0 ||
+		connect(probe, address.data(), address.length) != 0 ||
+		getsockopt(probe, level, v6 ? IPV6_MTU : IP_MTU, &mtu, &length) != 0)
+	{
+		mtu = 0;
+	}
+	close(probe);
+	return mtu;
+}
+
+/*
+ *	Largest blksize whose DATA datagrams cross mtu unfragmented. Jumbo
+ *	paths are held at Tftp_packet_blksize_max, which keeps the packet
+ *	buffers small.
+ */
+inline I32 Blksize_for_mtu(I32 mtu, I32 family)
+{
+	I32 ip_header_size = family == AF_INET6 ? 40 : 20;
+	I32 block_size = mtu - ip_header_size - Tftp_udp_header_size - Tftp_packet_header_size;
+	return std::min(std::max(block_size, Tftp_blksize_min), Tftp_packet_blksize_max);
+}
+
+/*
+ *	Transfer parameters chosen for the path to one server
+ */
+struct Path_tuning
+{
+	I32 mtu{ 0 };
+	I32 block_size{ Tftp_packet_data_size };
+	I32 window_size{ Tftp_tune_window_initial };
+	Time base_rtt_us{ 0 };
+};
+
+/*
+ *	Whether a smoothed round trip of srtt_us shows queueing over the
+ *	base round trip, which follows the smallest one seen
+ */
+inline bool Is_queueing(Time& base_rtt_us, Time srtt_us)
+{
+	bool queueing = base_rtt_us > 0 &&
+		srtt_us > static_cast<Time>(Tftp_tune_delay_factor * base_rtt_us) &&
+		srtt_us > base_rtt_us + Tftp_tune_delay_min_us;
+	if (srtt_us > 0 && (base_rtt_us == 0 || srtt_us < base_rtt_us)) base_rtt_us = srtt_us;
+	return queueing;
+}
+
+}
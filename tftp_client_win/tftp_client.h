@@ -2,6 +2,11 @@
 
 #include "tftp_packet.h"
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
 namespace tftp
 {
 
@@ -13,7 +18,7 @@ struct Address
 	I32 port{ 0 };
 };
 
-enum class Tftp_error : I32
+enum class Tftp_client_error : I32
 {
 	Timeout = 0,
 	Select = 1,
@@ -0,0 +1,589 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ *	Portable TFTP codec shared by the Linux and the Windows client. A
+ *	target includes it from its tftp_packet.h after defining
+ *	tftp::Tftp_packet_capacity, the largest datagram it handles, which
+ *	makes Tftp_packet and the default packet type of the builders.
+ *	Nothing here depends on the platform beyond the standard library.
+ */
+
+namespace tftp
+{
+
+using I32 = int32_t;
+using U64 = uint64_t;
+using Word = uint16_t;
+using Byte = uint8_t;
+using std::string;
+using std::vector;
+
+enum class Tftp_operation : Word
+{
+	Read = 1,
+	Write = 2,
+	Data = 3,
+	Ack = 4,
+	Error = 5,
+	Oack = 6,
+};
+
+constexpr Word To_word(Tftp_operation op)
+{
+	return static_cast<Word>(op);
+}
+
+enum class Tftp_mode : I32
+{
+	Netascii = 1,
+	Octet = 2,
+	Mail = 3,
+};
+
+inline string To_string(Tftp_mode mode)
+{
+	switch (mode)
+	{
+	case tftp::Tftp_mode::Netascii:
+		return "netascii";
+	case tftp::Tftp_mode::Octet:
+		return "octet";
+	case tftp::Tftp_mode::Mail:
+		return "mail";
+	}
+	assert(false);
+	return "";
+}
+
+enum class Tftp_error : I32
+{
+	Error_0 = 0,
+	Error_1 = 1,
+	Error_2 = 2,
+	Error_3 = 3,
+	Error_4 = 4,
+	Error_5 = 5,
+	Error_6 = 6,
+	Error_7 = 7,
+	Error_8 = 8,
+};
+
+constexpr Word To_word(Tftp_error error)
+{
+	return static_cast<Word>(error);
+}
+
+inline string To_string(Tftp_error error)
+{
+	switch (error)
+	{
+	case Tftp_error::Error_0:
+		return "Not defined, see error message (if any)";
+	case Tftp_error::Error_1:
+		return "File not found";
+	case Tftp_error::Error_2:
+		return "Access violation";
+	case Tftp_error::Error_3:
+		return "Disk full or allocation exceeded";
+	case Tftp_error::Error_4:
+		return "Illegal TFTP operation";
+	case Tftp_error::Error_5:
+		return "Unknown transfer ID";
+	case Tftp_error::Error_6:
+		return "File already exists";
+	case Tftp_error::Error_7:
+		return "No such user";
+	case Tftp_error::Error_8:
+		return "Option negotiation failed";
+	default:
+		break;
+	}
+	// Codes come off the wire, a peer may send any
+	return "Unknown error " + std::to_string(static_cast<I32>(error));
+}
+
+constexpr I32 Tftp_packet_header_size = 4;
+constexpr I32 Tftp_packet_data_size = 512;
+constexpr I32 Tftp_packet_datagram_size = Tftp_packet_header_size + Tftp_packet_data_size;
+/*
+ *	blksize (RFC 2348) the target negotiates at most, whatever fits its
+ *	packets
+ */
+constexpr I32 Tftp_blksize_min = 8;
+constexpr I32 Tftp_packet_blksize_max = Tftp_packet_capacity - Tftp_packet_header_size;
+
+/*
+ *	Block numbers on the wire wrap at 16 bits, expands one to the
+ *	absolute block number nearest to reference
+ */
+inline U64 Unwrap_block(Word block, U64 reference)
+{
+	auto delta = static_cast<int16_t>(static_cast<Word>(block - static_cast<Word>(reference)));
+	if (delta < 0 && static_cast<U64>(-delta) > reference) return 0;
+	return reference + delta;
+}
+
+/*
+ *	RFC 2347 option name / value pairs, kept in request order
+ */
+using Tftp_options = vector<std::pair<string, string>>;
+
+const string Tftp_option_windowsize = "windowsize";
+const string Tftp_option_tsize = "tsize";
+const string Tftp_option_blksize = "blksize";
+/*
+ *	Extension of this implementation: an RRQ for the byte range
+ *	[offset, offset + length) of a file, length defaults to the rest
+ *	of it. The server echoes the range it serves.
+ */
+const string Tftp_option_offset = "offset";
+const string Tftp_option_length = "length";
+
+enum class Byte_order : I32
+{
+	Little = 0,
+	Big = 1,
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr Byte_order Host_byte_order = Byte_order::Big;
+#else
+// Windows only runs little endian
+constexpr Byte_order Host_byte_order = Byte_order::Little;
+#endif
+
+/*
+ *	Whether a constexpr function is being evaluated at compile time,
+ *	where memcpy cannot be used. Compilers without the builtin always
+ *	take the constexpr path.
+ */
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define TFTP_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+#elif defined(_MSC_VER) && _MSC_VER >= 1925
+#define TFTP_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+#ifndef TFTP_CONSTANT_EVALUATED
+#define TFTP_CONSTANT_EVALUATED() true
+#endif
+
+/*
+ *	Network (big endian) from / to the given host order, the swap
+ *	compiles to a single rotate or bswap
+ */
+template<Byte_order Order>
+constexpr Word To_network(Word value)
+{
+	return Order == Byte_order::Big ? value : static_cast<Word>((value >> 8) | (value << 8));
+}
+
+/*
+ *	Datagram of at most Capacity bytes. Header words are read and
+ *	written with one unaligned load / store each, the whole header with
+ *	one 4 byte store, swapped when the host order is not the network
+ *	order.
+ */
+template<I32 Capacity, Byte_order Order = Host_byte_order>
+class Basic_tftp_packet
+{
+public:
+	static_assert(Capacity >= Tftp_packet_datagram_size, "A packet must hold a full DATA datagram");
+
+	constexpr Basic_tftp_packet() = default;
+
+	void clear()
+	{
+		packet_size = 0;
+		memset(data, 0, sizeof(data));
+	}
+
+	bool add(Byte byte)
+	{
+		return add(&byte, sizeof(Byte));
+	}
+
+	/*
+	 *	Appended in network order
+	 */
+	bool add(Word word)
+	{
+		if (packet_size + static_cast<I32>(sizeof(Word)) > Capacity) return false;
+		set_word(packet_size, word);
+		packet_size += sizeof(Word);
+		return true;
+	}
+
+	bool add(const string& str)
+	{
+		return add(reinterpret_cast<const Byte*>(str.data()), static_cast<I32>(str.size()));
+	}
+
+	/*
+	 *	Mostly short strings, which a loop the compiler inlines copies
+	 *	faster than a call to memcpy
+	 */
+	constexpr bool add(const Byte* data_ptr, I32 data_size)
+	{
+		assert(data_size >= 0);
+		if (packet_size + data_size > Capacity) return false;
+		for (I32 i = 0; i < data_size; ++i) data[packet_size + i] = data_ptr[i];
+		packet_size += data_size;
+		return true;
+	}
+
+	constexpr Byte get_byte(I32 off) const
+	{
+		return get(off);
+	}
+
+	Word get_word(I32 off) const
+	{
+		assert(off >= 0 && off + static_cast<I32>(sizeof(Word)) <= packet_size);
+		Word value;
+		memcpy(&value, data + off, sizeof(value));
+		return To_network<Order>(value);
+	}
+
+	void set_word(I32 off, Word word)
+	{
+		assert(off >= 0 && off + static_cast<I32>(sizeof(Word)) <= Capacity);
+		word = To_network<Order>(word);
+		memcpy(data + off, &word, sizeof(word));
+	}
+
+	/*
+	 *	Opcode and block / error number in network order, the packet
+	 *	then holds the header only. Byte by byte only at compile time.
+	 */
+	constexpr void set_header(Word op, Word number)
+	{
+		packet_size = Tftp_packet_header_size;
+		if (TFTP_CONSTANT_EVALUATED())
+		{
+			data[0] = static_cast<Byte>(op >> 8);
+			data[1] = static_cast<Byte>(op & 0xff);
+			data[2] = static_cast<Byte>(number >> 8);
+			data[3] = static_cast<Byte>(number & 0xff);
+			return;
+		}
+		uint32_t header = Order == Byte_order::Little ?
+			To_network<Order>(op) | static_cast<uint32_t>(To_network<Order>(number)) << 16 :
+			static_cast<uint32_t>(op) << 16 | number;
+		memcpy(data, &header, sizeof(header));
+	}
+
+	string get_string(I32 off, I32 length) const
+	{
+		assert(off >= 0 && length >= 0 && off + length <= packet_size);
+		return string(reinterpret_cast<const char*>(data + off), length);
+	}
+
+	constexpr Byte get(I32 data_off) const
+	{
+		assert(data_off >= 0);
+		assert(data_off + 1 <= packet_size);
+
+		return data[data_off];
+	}
+
+	Tftp_operation get_op() const
+	{
+		return static_cast<Tftp_operation>(get_word(0));
+	}
+
+	constexpr I32 size() const
+	{
+		return packet_size;
+	}
+
+	/*
+	 *	Direct access for receiving into and sending from the packet
+	 *	without intermediate buffers, resize marks how much is valid
+	 */
+	Byte* raw_data() { return data; }
+	const Byte* raw_data() const { return data; }
+
+	static constexpr I32 capacity() { return Capacity; }
+
+	constexpr bool resize(I32 new_size)
+	{
+		if (new_size < 0 || new_size > capacity()) return false;
+		packet_size = new_size;
+		return true;
+	}
+
+	vector<Byte> get_bytes() const
+	{
+		return vector<Byte>(data, data + packet_size);
+	}
+
+private:
+	I32 packet_size{ 0 };
+	Byte data[Capacity]{ 0 };
+};
+
+using Tftp_packet = Basic_tftp_packet<Tftp_packet_capacity>;
+
+template<I32 Capacity, Byte_order Order>
+string To_string(const Basic_tftp_packet<Capacity, Order>& packet)
+{
+	if (packet.size() < 2) return "<empty or malformad TFTP packet>";
+	auto type = packet.get_op();
+	string result = "Package";
+	switch (type)
+	{
+	case tftp::Tftp_operation::Read:
+		result += " with RRQ";
+		break;
+	case tftp::Tftp_operation::Write:
+		result += " with WRQ";
+		break;
+	case tftp::Tftp_operation::Data:
+		if (packet.size() < 4) return "<empty or malformad TFTP packet>";
+		result += " with data (" + std::to_string(packet.size()) + " bytes)";
+		result += " with package_number (" + std::to_string(static_cast<I32>(packet.get_word(2))) + ")";
+		break;
+	case tftp::Tftp_operation::Ack:
+		if (packet.size() < 4) return "<empty or malformad TFTP packet>";
+		result += " with ack";
+		result += " with package_number (" + std::to_string(static_cast<I32>(packet.get_word(2))) + ")";
+		break;
+	case tftp::Tftp_operation::Error:
+		if (packet.size() < 4) return "<empty or malformad TFTP packet>";
+		result += " with error (" + To_string(static_cast<Tftp_error>(packet.get_word(2))) + ")";
+		break;
+	case tftp::Tftp_operation::Oack:
+		result += " with oack";
+		break;
+	}
+	return result;
+}
+
+/*
+ *	string	= option
+ *	1 byte	= 0
+ *	string	= value
+ *	1 byte	= 0
+ *	... repeated for every option
+ */
+template<I32 Capacity, Byte_order Order>
+bool Add_options(Basic_tftp_packet<Capacity, Order>& packet, const Tftp_options& options)
+{
+	bool good = true;
+	for (auto& option : options)
+	{
+		good &= packet.add(option.first);
+		good &= packet.add(Byte{ 0 });
+		good &= packet.add(option.second);
+		good &= packet.add(Byte{ 0 });
+	}
+	return good;
+}
+
+/*
+ *	Reads zero terminated option / value pairs starting at offset,
+ *	option names are lowercased as they are case insensitive
+ */
+template<I32 Capacity, Byte_order Order>
+bool Get_options(const Basic_tftp_packet<Capacity, Order>& packet, I32 offset, Tftp_options& out)
+{
+	out.clear();
+	string fields[2];
+	I32 field = 0;
+	for (I32 i = offset; i < packet.size(); ++i)
+	{
+		char c = static_cast<char>(packet.get_byte(i));
+		if (c != 0)
+		{
+			if (field == 0 && c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+			fields[field] += c;
+			continue;
+		}
+		if (field == 1)
+		{
+			out.emplace_back(fields[0], fields[1]);
+			fields[0].clear();
+			fields[1].clear();
+		}
+		field ^= 1;
+	}
+	return field == 0 && fields[0].empty();
+}
+
+/*
+ *	Splits an RRQ / WRQ into file name, mode and options, the mode is
+ *	lowercased as it is case insensitive
+ */
+template<I32 Capacity, Byte_order Order>
+bool Get_request(const Basic_tftp_packet<Capacity, Order>& packet, string& file_name, string& mode, Tftp_options& options)
+{
+	file_name.clear();
+	mode.clear();
+	I32 offset = 2;
+	for (; offset < packet.size() && packet.get_byte(offset) != 0; ++offset)
+	{
+		file_name += static_cast<char>(packet.get_byte(offset));
+	}
+	for (++offset; offset < packet.size() && packet.get_byte(offset) != 0; ++offset)
+	{
+		char c = static_cast<char>(packet.get_byte(offset));
+		mode += c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+	}
+	if (offset >= packet.size() || file_name.empty() || mode.empty()) return false;
+	return Get_options(packet, offset + 1, options);
+}
+
+inline const string* Find_option(const Tftp_options& options, const string& name)
+{
+	for (auto& option : options)
+	{
+		if (option.first == name) return &option.second;
+	}
+	return nullptr;
+}
+
+/*
+ *	2 bytes = opcode
+ *	string	= filename
+ *	1 byte	= 0
+ *	string	= transfer_mode
+ *	1 byte	= 0
+ *	options	= see Add_options
+ */
+template<typename Packet = Tftp_packet>
+Packet Create_read(const string& file_name, Tftp_mode mode = Tftp_mode::Netascii, const Tftp_options& options = {})
+{
+	bool good = true;
+
+	Packet packet;
+	good &= packet.add(To_word(Tftp_operation::Read));
+	good &= packet.add(file_name);
+	good &= packet.add(Byte{ 0 });
+	good &= packet.add(To_string(mode));
+	good &= packet.add(Byte{ 0 });
+	good &= Add_options(packet, options);
+
+	assert(good);
+
+	return packet;
+}
+
+/*
+ *	2 bytes = opcode
+ *	string	= filename
+ *	1 byte	= 0
+ *	string	= transfer_mode
+ *	1 byte	= 0
+ *	options	= see Add_options
+ */
+template<typename Packet = Tftp_packet>
+Packet Create_write(const string& file_name, Tftp_mode mode = Tftp_mode::Netascii, const Tftp_options& options = {})
+{
+	bool good = true;
+
+	Packet packet;
+	good &= packet.add(To_word(Tftp_operation::Write));
+	good &= packet.add(file_name);
+	good &= packet.add(Byte{ 0 });
+	good &= packet.add(To_string(mode));
+	good &= packet.add(Byte{ 0 });
+	good &= Add_options(packet, options);
+
+	assert(good);
+
+	return packet;
+}
+
+/*
+ *	2 bytes = opcode
+ *	2 bytes	= packet_number
+ */
+template<typename Packet = Tftp_packet>
+constexpr Packet Create_ack(Word packet_number)
+{
+	Packet packet;
+	packet.set_header(To_word(Tftp_operation::Ack), packet_number);
+	return packet;
+}
+
+/*
+ *	2 bytes = opcode
+ *	2 bytes = block_number
+ *	n bytes	= data
+ */
+template<typename Packet = Tftp_packet>
+constexpr Packet Create_data(Word block_number, const Byte* data, I32 data_size)
+{
+	assert(data_size >= 0 && data_size <= Packet::capacity() - Tftp_packet_header_size);
+
+	Packet packet;
+	packet.set_header(To_word(Tftp_operation::Data), block_number);
+	// The final block of a file sized in whole blocks is empty
+	if (data_size > 0) packet.add(data, data_size);
+
+	return packet;
+}
+
+/*
+ *	The fixed size builders build packets at compile time too, the
+ *	others take strings and cannot before C++20
+ */
+constexpr bool Codec_builds_constexpr()
+{
+	using Packet = Basic_tftp_packet<Tftp_packet_datagram_size>;
+	const Byte payload[2]{ 0xab, 0xcd };
+	Packet ack = Create_ack<Packet>(0x0102);
+	Packet data = Create_data<Packet>(0x0304, payload, sizeof(payload));
+	return ack.size() == Tftp_packet_header_size && ack.get_byte(1) == 4 && ack.get_byte(3) == 0x02 &&
+		data.size() == Tftp_packet_header_size + 2 && data.get_byte(2) == 0x03 && data.get_byte(5) == 0xcd;
+}
+static_assert(Codec_builds_constexpr(), "ACK and DATA builders must be constexpr");
+
+/*
+ *	2 bytes = opcode
+ *	2 bytes = error_code
+ *	string	= message
+ *	1 byte	= 0
+ */
+template<typename Packet = Tftp_packet>
+Packet Create_error(Word error_code, const string& message)
+{
+	bool good = true;
+
+	Packet packet;
+	packet.set_header(To_word(Tftp_operation::Error), error_code);
+	good &= packet.add(message);
+	good &= packet.add(Byte{ 0 });
+
+	assert(good);
+
+	return packet;
+}
+
+/*
+ *	2 bytes = opcode
+ *	options	= see Add_options
+ */
+template<typename Packet = Tftp_packet>
+Packet Create_oack(const Tftp_options& options)
+{
+	bool good = true;
+
+	Packet packet;
+	good &= packet.add(To_word(Tftp_operation::Oack));
+	good &= Add_options(packet, options);
+
+	assert(good);
+
+	return packet;
+}
+
+}